@@ -0,0 +1,284 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#endif
+
+namespace bench {
+
+static inline uint64_t nowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// cpu time consumed by the whole process (user + system)
+static inline uint64_t cpuNs() {
+#ifndef _WIN32
+	timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+	uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+	return (k + u) * 100; // 100ns ticks
+#endif
+}
+
+// port a socket is bound to, for listeners that asked for any free one
+static inline uint16_t boundPort(int fd) {
+	sockaddr_in address = {0};
+	socklen_t len = sizeof(address);
+	if(getsockname(fd, (sockaddr*)&address, &len) < 0) return 0;
+	return ntohs(address.sin_port);
+}
+
+// tcp listener on a free loopback port, throws if there is none
+static inline int loopbackListener(uint16_t& port, int backlog = 128) {
+	int listener = (int)socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in address = {0};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if(listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, backlog) < 0 ||
+	   !(port = boundPort(listener))) {
+#ifndef _WIN32
+		if(listener >= 0) close(listener);
+#else
+		if(listener >= 0) closesocket(listener);
+#endif
+		throw std::runtime_error("failed to set up loopback listener");
+	}
+	return listener;
+}
+
+#ifndef _WIN32
+// lifts the open file limit to the hard limit for runs holding many connections, returns the limit in effect
+static inline uint64_t raiseFdLimit() {
+	rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	getrlimit(RLIMIT_NOFILE, &limit);
+	return limit.rlim_cur;
+}
+#endif
+
+// keeps the optimizer from discarding benchmarked results
+template <class T> static inline void keep(T const& value) {
+#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : "r,m"(value) : "memory");
+#else
+	static volatile const T* sink;
+	sink = &value;
+#endif
+}
+
+/**
+ * log-linear histogram, every power of two is split into 16 linear sub buckets which keeps the relative error of
+ * percentiles below ~6%. not thread safe - record per thread and merge().
+ */
+class Histogram {
+	static constexpr int SUB_BITS = 4;
+	static constexpr int SUB_COUNT = 1 << SUB_BITS;
+
+	uint64_t buckets[64 * SUB_COUNT] = {0};
+	uint64_t total = 0;
+	uint64_t sum = 0;
+	uint64_t minValue = UINT64_MAX;
+	uint64_t maxValue = 0;
+
+	static inline int highestBit(uint64_t value) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return (int)index;
+#else
+		return 63 - __builtin_clzll(value);
+#endif
+	}
+
+	static inline int bucketOf(uint64_t value) {
+		if(value < SUB_COUNT) return (int)value;
+		int exponent = highestBit(value);
+		int sub = (int)(value >> (exponent - SUB_BITS)) & (SUB_COUNT - 1);
+		return (exponent - SUB_BITS + 1) * SUB_COUNT + sub;
+	}
+
+	static inline uint64_t lowerBound(int bucket) {
+		if(bucket < SUB_COUNT) return bucket;
+		int exponent = bucket / SUB_COUNT + SUB_BITS - 1;
+		return ((uint64_t)SUB_COUNT | (bucket % SUB_COUNT)) << (exponent - SUB_BITS);
+	}
+
+  public:
+	inline void record(uint64_t value) {
+		buckets[bucketOf(value)]++;
+		total++;
+		sum += value;
+		if(value < minValue) minValue = value;
+		if(value > maxValue) maxValue = value;
+	}
+
+	void merge(const Histogram& other) {
+		for(int i = 0; i < 64 * SUB_COUNT; i++) buckets[i] += other.buckets[i];
+		total += other.total;
+		sum += other.sum;
+		minValue = std::min(minValue, other.minValue);
+		maxValue = std::max(maxValue, other.maxValue);
+	}
+
+	void reset() { *this = Histogram(); }
+
+	uint64_t count() const { return total; }
+	uint64_t min() const { return total ? minValue : 0; }
+	uint64_t max() const { return maxValue; }
+	double mean() const { return total ? (double)sum / total : 0; }
+
+	// percentile in [0, 100], reported as the midpoint of its bucket
+	uint64_t percentile(double p) const {
+		if(total == 0) return 0;
+		uint64_t rank = (uint64_t)(p / 100.0 * (total - 1)) + 1;
+		uint64_t seen = 0;
+		for(int i = 0; i < 64 * SUB_COUNT; i++) {
+			seen += buckets[i];
+			if(seen < rank) continue;
+			if(i == 64 * SUB_COUNT - 1) return maxValue;
+
+			uint64_t midpoint = lowerBound(i) + (lowerBound(i + 1) - lowerBound(i)) / 2;
+			return std::min(std::max(midpoint, minValue), maxValue);
+		}
+		return maxValue;
+	}
+};
+
+// minimal streaming json writer for benchmark reports
+class Json {
+	std::string out;
+	std::vector<bool> first;
+
+	void separator() {
+		if(first.empty()) return;
+		if(!first.back()) out += ',';
+		first.back() = false;
+	}
+
+	void writeString(const std::string& str) {
+		out += '"';
+		for(char c : str) {
+			if(c == '"' || c == '\\') out += '\\';
+			if((uint8_t)c < 0x20) {
+				char escaped[8];
+				snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+				out += escaped;
+				continue;
+			}
+			out += c;
+		}
+		out += '"';
+	}
+
+  public:
+	Json& beginObject() {
+		separator();
+		out += '{';
+		first.push_back(true);
+		return *this;
+	}
+
+	Json& endObject() {
+		out += '}';
+		first.pop_back();
+		return *this;
+	}
+
+	Json& beginArray() {
+		separator();
+		out += '[';
+		first.push_back(true);
+		return *this;
+	}
+
+	Json& endArray() {
+		out += ']';
+		first.pop_back();
+		return *this;
+	}
+
+	// object key, the following value must not emit another separator
+	Json& key(const std::string& name) {
+		separator();
+		writeString(name);
+		out += ':';
+		first.back() = true;
+		return *this;
+	}
+
+	Json& value(const std::string& str) {
+		separator();
+		writeString(str);
+		return *this;
+	}
+
+	Json& value(const char* str) { return value(std::string(str)); }
+
+	Json& value(double number) {
+		separator();
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.6g", number);
+		out += buffer;
+		return *this;
+	}
+
+	template <class T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+	Json& value(T number) {
+		separator();
+		out += std::to_string(number);
+		return *this;
+	}
+
+	Json& value(bool flag) {
+		separator();
+		out += flag ? "true" : "false";
+		return *this;
+	}
+
+	Json& value(const Histogram& histogram) {
+		beginObject();
+		key("count").value(histogram.count());
+		key("min").value(histogram.min());
+		key("mean").value(histogram.mean());
+		key("p50").value(histogram.percentile(50));
+		key("p99").value(histogram.percentile(99));
+		key("p999").value(histogram.percentile(99.9));
+		key("max").value(histogram.max());
+		return endObject();
+	}
+
+	template <class T> Json& field(const std::string& name, const T& v) { return key(name).value(v); }
+
+	const std::string& str() const { return out; }
+};
+
+} // namespace bench
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef FRAME_CAPTURE_H_
+#define FRAME_CAPTURE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * append only recording of websocket frames in a memory mapped file, for replaying real traffic later on.
+ *
+ * layout, integers in host byte order:
+ *   file header, 32 bytes: magic "WSCAP001", end of the last complete record, wall clock start in unix ns,
+ *                          flags (1 if payloads are stored), 4 reserved bytes
+ *   record, 17 bytes + payload: ns since the start, connection, payload length, flags, the payload if stored
+ *
+ * the end offset in the header only moves once a record is complete, a capture cut short by a crash reads up to
+ * its last whole record. recording never fails a connection: if the file can't grow or maxBytes is reached the
+ * capture just stops and counts what it missed.
+ */
+class FrameCapture {
+  public:
+	static constexpr size_t FILE_HEADER_SIZE = 32;
+	static constexpr size_t RECORD_HEADER_SIZE = 17;
+
+	// record flags, the opcode sits in the low nibble
+	enum Flags : uint8_t { OpcodeMask = 0x0f, Stored = 0x10, Compressed = 0x20, Fin = 0x40, Outbound = 0x80 };
+
+	struct Record {
+		uint64_t timeNs; // since the capture started
+		uint32_t connection;
+		uint32_t length; // payload length of the frame, whether stored or not
+		uint8_t flags;
+		const uint8_t* payload; // null unless stored, valid as long as the reader
+
+		uint8_t opcode() const { return flags & OpcodeMask; }
+		bool fin() const { return flags & Fin; }
+		bool compressed() const { return flags & Compressed; }
+		bool outbound() const { return flags & Outbound; } // sent by the side that recorded
+	};
+
+	struct Stats {
+		uint64_t records = 0;
+		uint64_t bytes = 0; // file size so far
+		uint64_t missed = 0; // records lost after the capture stopped
+	};
+
+	// reads a capture file, also one that is still being written up to what was complete when it got opened
+	class Reader {
+		int fd;
+		const uint8_t* map;
+		size_t size;
+		size_t end;
+		size_t pos = FILE_HEADER_SIZE;
+
+	  public:
+		Reader(const std::string& path) {
+			fd = ::open(path.c_str(), O_RDONLY);
+			if(fd < 0) throw std::runtime_error("failed to open capture " + path);
+
+			struct stat info;
+			if(fstat(fd, &info) < 0 || (size_t)info.st_size < FILE_HEADER_SIZE) {
+				::close(fd);
+				throw std::runtime_error("not a capture file: " + path);
+			}
+			size = info.st_size;
+
+			void* mapping = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+			if(mapping == MAP_FAILED) {
+				::close(fd);
+				throw std::runtime_error("failed to map capture " + path);
+			}
+			map = (const uint8_t*)mapping;
+
+			uint64_t recorded;
+			memcpy(&recorded, map + 8, 8);
+			end = std::min<uint64_t>(recorded, size);
+			if(memcmp(map, MAGIC, 8) != 0 || end < FILE_HEADER_SIZE) {
+				munmap(mapping, size);
+				::close(fd);
+				throw std::runtime_error("not a capture file: " + path);
+			}
+		}
+
+		Reader(const Reader&) = delete;
+		Reader& operator=(const Reader&) = delete;
+
+		~Reader() {
+			munmap((void*)map, size);
+			::close(fd);
+		}
+
+		// wall clock time the capture started, unix ns
+		uint64_t startedNs() const {
+			uint64_t started;
+			memcpy(&started, map + 16, 8);
+			return started;
+		}
+
+		bool payloadsStored() const { return map[24] & 1; }
+
+		// the next record in the order they were written, false at the end
+		bool next(Record& record) {
+			if(end - pos < RECORD_HEADER_SIZE) return false;
+			const uint8_t* header = map + pos;
+			memcpy(&record.timeNs, header, 8);
+			memcpy(&record.connection, header + 8, 4);
+			memcpy(&record.length, header + 12, 4);
+			record.flags = header[16];
+
+			size_t stored = record.flags & Stored ? record.length : 0;
+			if(end - pos - RECORD_HEADER_SIZE < stored) return false;
+			record.payload = stored ? header + RECORD_HEADER_SIZE : 0;
+			pos += RECORD_HEADER_SIZE + stored;
+			return true;
+		}
+
+		void rewind() { pos = FILE_HEADER_SIZE; }
+	};
+
+  private:
+	static constexpr char MAGIC[8] = {'W', 'S', 'C', 'A', 'P', '0', '0', '1'};
+
+	int fd = -1;
+	uint8_t* map = 0;
+	size_t mapped = 0;
+	size_t used = FILE_HEADER_SIZE;
+	bool payloads;
+	uint64_t maxBytes;
+	uint64_t startNs;
+	bool stopped = false;
+	Stats counters;
+	std::atomic<uint32_t> connections = 0;
+	std::mutex lock;
+
+	static uint64_t steadyNs() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// file and mapping hold at least size bytes afterwards, false if they can't. lock must be held
+	bool reserve(size_t size) {
+		if(size <= mapped) return true;
+		size_t grown = std::max(size, mapped * 2);
+		if(ftruncate(fd, grown) < 0) return false;
+
+		void* mapping = mmap(0, grown, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(mapping == MAP_FAILED) return false;
+		munmap(map, mapped);
+		map = (uint8_t*)mapping;
+		mapped = grown;
+		return true;
+	}
+
+  public:
+	/**
+	 * starts a new capture at path, replacing what is there. without payloads only sizes and timing are kept, which
+	 * is enough to replay the load and keeps message contents out of the file. maxBytes caps the file size, 0 for
+	 * no cap.
+	 */
+	FrameCapture(const std::string& path, bool payloads = true, uint64_t maxBytes = 0)
+		: payloads(payloads), maxBytes(maxBytes) {
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0) throw std::runtime_error("failed to create capture " + path);
+		if(!reserve(1024 * 1024)) {
+			::close(fd);
+			throw std::runtime_error("failed to map capture " + path);
+		}
+
+		uint64_t wallNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+							  std::chrono::system_clock::now().time_since_epoch())
+							  .count();
+		uint64_t end = used;
+		memcpy(map, MAGIC, 8);
+		memcpy(map + 8, &end, 8);
+		memcpy(map + 16, &wallNs, 8);
+		map[24] = payloads ? 1 : 0;
+		startNs = steadyNs();
+	}
+
+	FrameCapture(const FrameCapture&) = delete;
+	FrameCapture& operator=(const FrameCapture&) = delete;
+
+	// the file is cut to what was recorded
+	~FrameCapture() {
+		munmap(map, mapped);
+		if(ftruncate(fd, used) < 0) {}
+		::close(fd);
+	}
+
+	// id for a new connection, records of one connection share it
+	uint32_t connection() { return ++connections; }
+
+	// payload may be null if it is not at hand, the record then only has the length
+	void record(uint32_t connection, bool outbound, uint8_t opcode, bool fin, bool compressed, const uint8_t* payload,
+				uint64_t length) {
+		uint32_t clamped = (uint32_t)std::min<uint64_t>(length, UINT32_MAX);
+		bool store = payloads && payload && length <= UINT32_MAX;
+		uint8_t flags = (opcode & OpcodeMask) | (store ? Stored : 0) | (compressed ? Compressed : 0) | (fin ? Fin : 0) |
+						(outbound ? Outbound : 0);
+		size_t size = RECORD_HEADER_SIZE + (store ? length : 0);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if(stopped || (maxBytes && used + size > maxBytes) || !reserve(used + size)) {
+			stopped = true;
+			counters.missed++;
+			return;
+		}
+
+		// timestamps are taken in order, so records are sorted by time
+		uint64_t timeNs = steadyNs() - startNs;
+		uint8_t* out = map + used;
+		memcpy(out, &timeNs, 8);
+		memcpy(out + 8, &connection, 4);
+		memcpy(out + 12, &clamped, 4);
+		out[16] = flags;
+		if(store) memcpy(out + RECORD_HEADER_SIZE, payload, length);
+
+		used += size;
+		uint64_t end = used;
+		memcpy(map + 8, &end, 8);
+		counters.records++;
+	}
+
+	Stats stats() {
+		std::lock_guard<std::mutex> guard(lock);
+		Stats current = counters;
+		current.bytes = used;
+		return current;
+	}
+};
+#endif
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef SSL_BENCH_H_
+#define SSL_BENCH_H_
+
+#include "SSLSocket.h"
+#include "Bench.h"
+
+#include <cstdio>
+
+/**
+ * loopback benchmark for SSLSocket/SSLServer. both ends run in this process, so cpu figures cover client and server.
+ * needs a keypair for the server, a throwaway self signed one does:
+ *
+ *   openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 -subj /CN=localhost \
+ *       -keyout key.pem -out cert.pem
+ *
+ * certificate verification is disabled on the shared client config for the duration of the run.
+ */
+class SSLBench {
+
+	enum Mode : uint8_t { HANDSHAKE = 0, UPLOAD = 1, DOWNLOAD = 2 };
+
+	// every connection starts with a mode byte, transfers end with a single ack byte from the receiving side
+	static void serve(SSLSocket sock) {
+		try {
+			uint8_t mode = sock.receiveByte();
+			uint64_t amount = sock.receiveLongInt();
+			uint32_t writeSize = sock.receiveInt();
+
+			if(mode == UPLOAD) {
+				uint64_t received = 0;
+				while(received < amount) received += sock.receiveAvailable().size();
+			} else if(mode == DOWNLOAD) {
+				vector<uint8_t> chunk(writeSize, 'x');
+				for(uint64_t sent = 0; sent < amount; sent += chunk.size()) sock.send(chunk);
+				sock.receiveByte();
+			}
+
+			sock.send((uint8_t)1);
+		} catch(...) {}
+		sock.disconnect();
+	}
+
+	static void request(SSLSocket& sock, Mode mode, uint64_t amount, uint32_t writeSize) {
+		sock.send((uint8_t)mode);
+		sock.send(amount);
+		sock.send(writeSize);
+	}
+
+	static SSLSocket connect(uint16_t port) {
+		SSLSocket sock;
+		if(!sock.connect("127.0.0.1", port)) throw std::runtime_error("failed to connect to benchmark server");
+		sock.handshake();
+		return sock;
+	}
+
+	static uint64_t handshake(uint16_t port, bool* resumed = 0) {
+		uint64_t start = bench::nowNs();
+		SSLSocket sock = connect(port);
+		uint64_t elapsed = bench::nowNs() - start;
+
+		// the ack also pulls in post handshake session tickets
+		request(sock, HANDSHAKE, 0, 0);
+		sock.receiveByte();
+		if(resumed) *resumed = sock.resumed();
+		sock.disconnect();
+
+		return elapsed;
+	}
+
+  public:
+	struct Options {
+		string label;
+		size_t handshakes = 200;
+		size_t handshakeThreads = 4;
+		vector<uint32_t> writeSizes = {64, 1024, 16 * 1024, 256 * 1024};
+		uint64_t bytesPerSize = 256ull * 1024 * 1024;
+	};
+
+	static string run(string certFile, string keyFile) { return run(certFile, keyFile, Options()); }
+
+	// runs every measurement and returns the report as json
+	static string run(string certFile, string keyFile, Options options) {
+		SSLServer server(certFile, keyFile, options.handshakeThreads);
+
+		uint16_t port;
+		int listener = bench::loopbackListener(port);
+
+		std::thread acceptor([&]() {
+			while(1) {
+				int fd = ::accept(listener, 0, 0);
+				if(fd < 0) return;
+				server.submit(fd, [](SSLSocket& sock) { std::thread(serve, sock).detach(); });
+			}
+		});
+
+		tls_config* clientConfig = SSLSocket::config();
+		tls_config_insecure_noverifycert(clientConfig);
+		tls_config_insecure_noverifyname(clientConfig);
+
+		bench::Json report;
+		report.beginObject();
+		report.field("label", options.label);
+		report.field("tls_api", (uint64_t)TLS_API);
+
+		// full handshakes, one at a time
+		bench::Histogram full;
+		tls_config_set_session_fd(clientConfig, -1);
+		for(size_t i = 0; i < options.handshakes; i++) full.record(handshake(port));
+
+		// resumed handshakes, the session is persisted by libtls through the session file
+		bench::Histogram resumed;
+		uint64_t resumedCount = 0;
+		FILE* sessionFile = tmpfile();
+		tls_config_set_session_fd(clientConfig, fileno(sessionFile));
+		handshake(port);
+		for(size_t i = 0; i < options.handshakes; i++) {
+			bool wasResumed = false;
+			resumed.record(handshake(port, &wasResumed));
+			resumedCount += wasResumed;
+		}
+		tls_config_set_session_fd(clientConfig, -1);
+		fclose(sessionFile);
+
+		// concurrent full handshakes against the worker pool
+		std::atomic<uint64_t> completed = 0;
+		uint64_t start = bench::nowNs();
+		vector<std::thread> clients;
+		for(size_t t = 0; t < options.handshakeThreads; t++) {
+			clients.emplace_back([&]() {
+				for(size_t i = 0; i < options.handshakes / options.handshakeThreads; i++) {
+					try {
+						handshake(port);
+						completed++;
+					} catch(...) {}
+				}
+			});
+		}
+		for(auto& client : clients) client.join();
+		double handshakeSeconds = (bench::nowNs() - start) / 1e9;
+
+		report.key("handshake").beginObject();
+		report.field("full_ns", full);
+		report.field("resumed_ns", resumed);
+		report.field("resumed_ratio", options.handshakes ? (double)resumedCount / options.handshakes : 0.0);
+		report.field("concurrency", (uint64_t)options.handshakeThreads);
+		report.field("per_sec", completed / handshakeSeconds);
+		report.field("server_failed", server.handshakesFailed.load());
+		report.field("server_rejected", server.handshakesRejected.load());
+		report.endObject();
+
+		report.key("throughput").beginArray();
+		for(uint32_t writeSize : options.writeSizes) {
+			uint64_t amount = options.bytesPerSize - options.bytesPerSize % writeSize;
+			vector<uint8_t> chunk(writeSize, 'x');
+
+			// SSLSocket::send, the server drains and acks
+			SSLSocket sock = connect(port);
+			request(sock, UPLOAD, amount, writeSize);
+			uint64_t wallStart = bench::nowNs();
+			uint64_t cpuStart = bench::cpuNs();
+			for(uint64_t sent = 0; sent < amount; sent += writeSize) sock.send(chunk);
+			sock.receiveByte();
+			uint64_t sendWall = bench::nowNs() - wallStart;
+			uint64_t sendCpu = bench::cpuNs() - cpuStart;
+			sock.disconnect();
+
+			// SSLSocket::receive, the server streams writeSize chunks
+			sock = connect(port);
+			request(sock, DOWNLOAD, amount, writeSize);
+			wallStart = bench::nowNs();
+			cpuStart = bench::cpuNs();
+			for(uint64_t received = 0; received < amount; received += writeSize) bench::keep(sock.receive(writeSize));
+			sock.send((uint8_t)1);
+			sock.receiveByte();
+			uint64_t receiveWall = bench::nowNs() - wallStart;
+			uint64_t receiveCpu = bench::cpuNs() - cpuStart;
+			sock.disconnect();
+
+			double gigabytes = amount / 1e9;
+
+			report.beginObject();
+			report.field("write_size", (uint64_t)writeSize);
+			report.field("bytes", amount);
+			report.field("send_mb_s", amount / 1e6 / (sendWall / 1e9));
+			report.field("send_cpu_ns_per_gb", sendCpu / gigabytes);
+			report.field("receive_mb_s", amount / 1e6 / (receiveWall / 1e9));
+			report.field("receive_cpu_ns_per_gb", receiveCpu / gigabytes);
+			report.endObject();
+		}
+		report.endArray();
+		report.endObject();
+
+		closeSocket(listener);
+		acceptor.join();
+
+		tls_config_verify(clientConfig);
+
+		return report.str();
+	}
+};
+
+#endif
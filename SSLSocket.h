@@ -1,9 +1,25 @@
 #ifndef SSL_SOCKET_H_
 #define SSL_SOCKET_H_
 #include "TCPSocket.h"
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <time.h>
+
+#ifdef _WIN32
 #include <wincrypt.h>
-
-#define min(a, b) ((a) < (b) ? (a) : (b))
+#include <bcrypt.h>
+#pragma comment(lib, "bcrypt.lib")
+#elif defined(__linux__)
+#include <sys/random.h>
+#else
+#include <stdlib.h> // arc4random_buf
+#endif
 
 extern "C" {
 
@@ -181,15 +197,22 @@ time_t tls_peer_ocsp_this_update(struct tls* _ctx);
 const char* tls_peer_ocsp_url(struct tls* _ctx);
 }
 
+class SSLServer;
+
 class SSLSocket : public TCPSocket {
+	friend class SSLServer;
 
 	static inline tls_config* tlsConf = 0;
 	static inline vector<uint8_t> certificates;
 
 	void platformInit() override {
 		TCPSocket::platformInit();
-		if(!tlsConf) tlsConf = tls_config_new();
+		if(tlsConf) return;
+		tlsConf = tls_config_new();
 
+#ifndef _WIN32
+		tls_config_set_ca_file(tlsConf, tls_default_ca_cert_file());
+#else
 		// load all ca's
 
 		HCERTSTORE hStore = CertOpenSystemStoreA(0, "ROOT");
@@ -210,21 +233,57 @@ class SSLSocket : public TCPSocket {
 		CertCloseStore(hStore, 0);
 
 		tls_config_set_ca_mem(tlsConf, certificates.data(), certificates.size());
+#endif
 	}
 
 	tls* context = 0;
 
+	// set for sockets accepted by an SSLServer, keeps the server context they were accepted with alive across reloads
+	std::shared_ptr<void> serverContext;
+	std::shared_ptr<tls> connection;
+
 	uint8_t surgeBuffer[8192];
 	uint32_t surgeUsed = 0;
 
+	SSLSocket(int socket, std::shared_ptr<void> serverContext, tls* accepted)
+		: TCPSocket(socket), serverContext(serverContext), connection(accepted, tls_free) {
+		context = accepted;
+	}
+
   public:
+	SSLSocket() {}
+
+	using TCPSocket::send;
+
+	// shared client configuration, e.g. for tls_config_set_session_fd or tls_config_insecure_noverifycert
+	static tls_config* config() {
+		SSLSocket().platformInit();
+		return tlsConf;
+	}
+
+	// completes the handshake now instead of on the first read/write
+	void handshake() {
+		int ret;
+		while((ret = tls_handshake(context)) != 0) {
+			if(ret == TLS_WANT_POLLIN) {
+				if(!readReady()) throw TimeoutException("handshake timed out");
+			} else if(ret == TLS_WANT_POLLOUT) {
+				if(!writeReady()) throw TimeoutException("handshake timed out");
+			} else {
+				throw NetworkException(tls_error(context) ? tls_error(context) : "tls handshake failed");
+			}
+		}
+	}
+
+	bool resumed() { return context && tls_conn_session_resumed(context) == 1; }
+
 	bool connect(string host, uint16_t port) override {
 
 		platformInit();
 		disconnect();
 
 		uint8_t ip[4] = {0};
-		uint8_t results = sscanf(host.c_str(), "%3u.%3u.%3u.%3u", &ip[0], &ip[1], &ip[2], &ip[3]);
+		uint8_t results = sscanf(host.c_str(), "%3hhu.%3hhu.%3hhu.%3hhu", &ip[0], &ip[1], &ip[2], &ip[3]);
 
 		// isn't an ip address - parse dns
 		if(results != 4) {
@@ -258,17 +317,28 @@ class SSLSocket : public TCPSocket {
 	void disconnect() override {
 		remote = {0};
 		if(socketFd == 0) return;
-		closeSocket(socketFd);
-		tls_reset(context);
+
+		if(connection) {
+			tls_close(context);
+			closeSocket(socketFd);
+			connection.reset();
+			serverContext.reset();
+			context = 0;
+		} else {
+			closeSocket(socketFd);
+			tls_reset(context);
+		}
+
+		socketFd = 0;
 		surgeUsed = 0;
 	}
 
-	void send(vector<uint8_t>& bytes) override {
-		int sentTotal = 0;
+	void send(const uint8_t* data, size_t length) override {
+		size_t sentTotal = 0;
 
-		while(sentTotal < bytes.size()) {
-			if(!writeReady(15 * 1000)) throw TimeoutException("send timed out after 15s");
-			int sentBytes = tls_write(context, (char*)bytes.data() + sentTotal, bytes.size() - sentTotal);
+		while(sentTotal < length) {
+			if(!writeReady()) throw TimeoutException("send timed out");
+			int sentBytes = tls_write(context, (char*)data + sentTotal, length - sentTotal);
 
 			if(sentBytes > 0) sentTotal += sentBytes;
 			else if(sentBytes == 0)
@@ -278,8 +348,22 @@ class SSLSocket : public TCPSocket {
 		}
 	}
 
+	// tls has no gathered write, small frames are joined so they still go out as one record
+	void sendv(const uint8_t* header, size_t headerLength, const uint8_t* payload, size_t payloadLength) override {
+		if(headerLength + payloadLength > 16 * 1024) {
+			send(header, headerLength);
+			send(payload, payloadLength);
+			return;
+		}
+
+		uint8_t joined[16 * 1024];
+		memcpy(joined, header, headerLength);
+		if(payloadLength) memcpy(joined + headerLength, payload, payloadLength);
+		send(joined, headerLength + payloadLength);
+	}
+
 	vector<uint8_t> receiveAvailable() override {
-		if(!readReady(15 * 1000)) throw TimeoutException("receive timed out after 15s");
+		if(!readReady()) throw TimeoutException("receive timed out");
 		int receivedBytes = tls_read(context, surgeBuffer + surgeUsed, 8192 - surgeUsed);
 
 		if(receivedBytes == 0) throw CloseException("socket is closed");
@@ -292,10 +376,30 @@ class SSLSocket : public TCPSocket {
 		return vector<uint8_t>(surgeBuffer, surgeBuffer + receivedBytes);
 	}
 
-	vector<uint8_t> receiveUntil(vector<uint8_t> byteSequence) override {
+	size_t receiveAvailable(uint8_t* buffer, size_t length) override {
+		if(surgeUsed) {
+			size_t fromSurge = std::min<size_t>(length, surgeUsed);
+			memcpy(buffer, surgeBuffer, fromSurge);
+			memmove(surgeBuffer, surgeBuffer + fromSurge, surgeUsed - fromSurge);
+			surgeUsed -= fromSurge;
+			return fromSurge;
+		}
+
+		if(!readReady()) throw TimeoutException("receive timed out");
+		int receivedBytes = tls_read(context, buffer, length);
+
+		if(receivedBytes == 0) throw CloseException("socket is closed");
+		else if(receivedBytes < 0)
+			throw NetworkException("connection was aborted during receive");
+
+		return receivedBytes;
+	}
+
+	vector<uint8_t> receiveUntil(vector<uint8_t> byteSequence, size_t maxLength = SIZE_MAX) override {
 		vector<uint8_t> buffer;
 
 		while(1) {
+			if(buffer.size() >= maxLength) throw NetworkException("delimiter not found within the size limit");
 			try {
 				auto available = receiveAvailable();
 				buffer.insert(buffer.end(), available.begin(), available.end());
@@ -316,13 +420,13 @@ class SSLSocket : public TCPSocket {
 
 	vector<uint8_t> receive(uint64_t amount) override {
 		vector<uint8_t> buffer(amount);
-		memcpy(buffer.data(), surgeBuffer, min(amount, surgeUsed));
+		memcpy(buffer.data(), surgeBuffer, std::min<uint64_t>(amount, surgeUsed));
 
-		int receivedTotal = min(amount, surgeUsed);
+		int receivedTotal = std::min<uint64_t>(amount, surgeUsed);
 		surgeUsed -= receivedTotal;
 
 		while(receivedTotal < amount) {
-			if(!readReady(15 * 1000)) throw TimeoutException("receive timed out after 15s");
+			if(!readReady()) throw TimeoutException("receive timed out");
 			int receivedBytes = tls_read(context, (char*)buffer.data() + receivedTotal, amount - receivedTotal);
 
 			if(receivedBytes > 0) receivedTotal += receivedBytes;
@@ -336,4 +440,265 @@ class SSLSocket : public TCPSocket {
 	}
 };
 
+class SSLServer {
+
+	struct Context {
+		tls* server = 0;
+		tls_config* config = 0;
+		time_t created = time(0);
+
+		~Context() {
+			if(server) tls_free(server);
+			if(config) tls_config_free(config);
+		}
+	};
+
+	struct PendingHandshake {
+		int fd;
+		std::function<void(SSLSocket&)> onReady;
+	};
+
+	std::shared_ptr<Context> current;
+	vector<uint8_t> certificate, privateKey; // keypair of current, contexts are rebuilt from it to rotate ticket keys
+	std::mutex contextLock;
+
+	std::deque<PendingHandshake> pending;
+	std::mutex pendingLock;
+	std::condition_variable pendingSignal;
+	vector<std::thread> workers;
+
+	size_t maxPending;
+	uint32_t handshakeTimeoutMs;
+	bool running = true;
+
+	// session ids and ticket keys must not be guessable, they come from the os csprng
+	static void osEntropy(void* out, size_t length) {
+#ifdef _WIN32
+		if(BCryptGenRandom(0, (PUCHAR)out, (ULONG)length, BCRYPT_USE_SYSTEM_PREFERRED_RNG) != 0)
+			throw std::runtime_error("BCryptGenRandom failed");
+#elif defined(__linux__)
+		for(size_t done = 0; done < length;) {
+			ssize_t got = getrandom((uint8_t*)out + done, length - done, 0);
+			if(got < 0 && errno != EINTR) throw std::runtime_error("getrandom failed");
+			if(got > 0) done += got;
+		}
+#else
+		arc4random_buf(out, length);
+#endif
+	}
+
+	/**
+	 * session tickets are encrypted with keys of the server instead of each context's own, so tickets issued before
+	 * a reload still decrypt afterwards. libtls honours a key for one session lifetime after it was added to a
+	 * context, so contexts are rebuilt with a new key after half of that. the previous key is kept to decrypt the
+	 * tickets issued with it. guarded by contextLock.
+	 */
+	struct TicketKey {
+		uint32_t revision = 0;
+		uint8_t key[TLS_TICKET_KEY_SIZE];
+	};
+	TicketKey ticketKeys[2]; // newest first
+	uint8_t sessionId[TLS_MAX_SESSION_ID_LENGTH];
+	int sessionLifetime;
+
+	void rotateTicketKey() {
+		ticketKeys[1] = ticketKeys[0];
+		ticketKeys[0].revision++;
+		osEntropy(ticketKeys[0].key, sizeof(ticketKeys[0].key));
+	}
+
+	// contextLock must be held
+	std::shared_ptr<Context> createContext(const vector<uint8_t>& cert, const vector<uint8_t>& key) {
+		auto ctx = std::make_shared<Context>();
+
+		ctx->config = tls_config_new();
+		if(!ctx->config) throw std::runtime_error("failed to allocate tls config");
+
+		if(tls_config_set_keypair_mem(ctx->config, cert.data(), cert.size(), key.data(), key.size()) == -1)
+			throw std::runtime_error(tls_config_error(ctx->config));
+
+		if(sessionLifetime > 0) {
+			if(tls_config_set_session_id(ctx->config, sessionId, sizeof(sessionId)) == -1 ||
+			   tls_config_set_session_lifetime(ctx->config, sessionLifetime) == -1)
+				throw std::runtime_error(tls_config_error(ctx->config));
+
+			// each key added goes in front, the newest has to end up first
+			for(int i = 1; i >= 0; i--) {
+				if(ticketKeys[i].revision &&
+				   tls_config_add_ticket_key(ctx->config, ticketKeys[i].revision, ticketKeys[i].key,
+											 sizeof(ticketKeys[i].key)) == -1)
+					throw std::runtime_error(tls_config_error(ctx->config));
+			}
+		}
+
+		ctx->server = tls_server();
+		if(!ctx->server) throw std::runtime_error("failed to allocate tls server context");
+		if(tls_configure(ctx->server, ctx->config) == -1) throw std::runtime_error(tls_error(ctx->server));
+
+		return ctx;
+	}
+
+	// the current context, rebuilt with a new ticket key once its keys are about to expire
+	std::shared_ptr<Context> context() {
+		std::lock_guard<std::mutex> lock(contextLock);
+		if(sessionLifetime > 0 && time(0) - current->created >= sessionLifetime / 2) {
+			rotateTicketKey();
+			try {
+				current = createContext(certificate, privateKey);
+			} catch(...) {} // keeps serving with the old one, it was built from the same keypair
+		}
+		return current;
+	}
+
+	static vector<uint8_t> loadFile(const string& path) {
+		size_t len = 0;
+		uint8_t* data = tls_load_file(path.c_str(), &len, 0);
+		if(!data) throw std::runtime_error("failed to load " + path);
+
+		vector<uint8_t> contents(data, data + len);
+		tls_unload_file(data, len);
+		return contents;
+	}
+
+	void worker() {
+		while(1) {
+			PendingHandshake job;
+			{
+				std::unique_lock<std::mutex> lock(pendingLock);
+				pendingSignal.wait(lock, [&]() { return !running || !pending.empty(); });
+				if(!running) return;
+
+				job = std::move(pending.front());
+				pending.pop_front();
+			}
+
+			try {
+				SSLSocket sock = accept(job.fd);
+				job.onReady(sock);
+			} catch(...) {}
+		}
+	}
+
+  public:
+	std::atomic<uint64_t> handshakesCompleted = 0;
+	std::atomic<uint64_t> handshakesFailed = 0;
+	std::atomic<uint64_t> handshakesRejected = 0;
+
+	/**
+	 * @param workerCount number of threads doing tls handshakes, bounds the cpu a connection storm can take away from
+	 *                    established connections
+	 * @param maxPending  accepted sockets waiting for a handshake worker, further sockets are closed right away
+	 * @param handshakeTimeoutMs time a handshake may take in total before it fails, 0 waits forever
+	 * @param sessionLifetime seconds a session can be resumed for, 0 disables resumption
+	 */
+	SSLServer(string certFile, string keyFile, size_t workerCount = 0, size_t maxPending = 1024,
+			  uint32_t handshakeTimeoutMs = 10 * 1000, int sessionLifetime = 300)
+		: maxPending(maxPending), handshakeTimeoutMs(handshakeTimeoutMs), sessionLifetime(sessionLifetime) {
+		if(tls_init() == -1) throw std::runtime_error("tls_init failed");
+
+		osEntropy(sessionId, sizeof(sessionId));
+		rotateTicketKey();
+
+		reload(certFile, keyFile);
+
+		if(workerCount == 0) workerCount = std::max(1u, std::thread::hardware_concurrency() / 2);
+		for(size_t i = 0; i < workerCount; i++) workers.emplace_back([&]() { worker(); });
+	}
+
+	~SSLServer() {
+		{
+			std::lock_guard<std::mutex> lock(pendingLock);
+			running = false;
+			for(auto& job : pending) closeSocket(job.fd);
+			pending.clear();
+		}
+		pendingSignal.notify_all();
+		for(auto& worker : workers) worker.join();
+	}
+
+	// swaps in a new keypair, sessions accepted before keep the context they were accepted with. sessions stay
+	// resumable across reloads
+	void reload(string certFile, string keyFile) {
+		auto cert = loadFile(certFile);
+		auto key = loadFile(keyFile);
+		reload(cert, key);
+	}
+
+	void reload(const vector<uint8_t>& cert, const vector<uint8_t>& key) {
+		std::lock_guard<std::mutex> lock(contextLock);
+		current = createContext(cert, key);
+		certificate = cert;
+		privateKey = key;
+	}
+
+	// performs the handshake on the calling thread
+	SSLSocket accept(int fd) {
+		std::shared_ptr<Context> ctx = context();
+
+		tls* accepted = 0;
+		if(tls_accept_socket(ctx->server, &accepted, fd) == -1) {
+			handshakesFailed++;
+			closeSocket(fd);
+			throw std::runtime_error(tls_error(ctx->server));
+		}
+
+		SSLSocket sock(fd, ctx, accepted);
+
+		// the timeout bounds the whole handshake, a peer trickling bytes in cannot hold the worker past it
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(handshakeTimeoutMs);
+		sock.setBlocking(false);
+
+		int ret;
+		string error;
+		while((ret = tls_handshake(accepted)) != 0) {
+			if(ret != TLS_WANT_POLLIN && ret != TLS_WANT_POLLOUT) {
+				error = tls_error(accepted) ? tls_error(accepted) : "tls handshake failed";
+				break;
+			}
+			int64_t remaining = 0;
+			if(handshakeTimeoutMs) {
+				remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+								deadline - std::chrono::steady_clock::now())
+								.count();
+				if(remaining <= 0) {
+					error = "tls handshake timed out";
+					break;
+				}
+			}
+			if(!sock.ready(ret == TLS_WANT_POLLOUT, (uint32_t)remaining)) {
+				error = "tls handshake timed out";
+				break;
+			}
+		}
+
+		if(ret != 0) {
+			handshakesFailed++;
+			sock.disconnect();
+			throw TCPSocket::NetworkException(error);
+		}
+
+		sock.setBlocking(true);
+		handshakesCompleted++;
+		return sock;
+	}
+
+	/**
+	 * queues the handshake for the worker pool, onReady runs on a worker thread and should hand the socket off
+	 * instead of serving it there. returns false and closes the socket if the queue is full.
+	 */
+	bool submit(int fd, std::function<void(SSLSocket&)> onReady) {
+		{
+			std::lock_guard<std::mutex> lock(pendingLock);
+			if(!running || pending.size() >= maxPending) {
+				handshakesRejected++;
+				closeSocket(fd);
+				return false;
+			}
+			pending.push_back({fd, onReady});
+		}
+		pendingSignal.notify_one();
+		return true;
+	}
+};
+
 #endif
\ No newline at end of file
@@ -14,6 +14,10 @@
 #include <unistd.h>
 #include <endian.h>
 #include <netdb.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
 #include <cstring>
 #define closeSocket(fd) \
 	do { \
@@ -24,12 +28,16 @@
 #define ntohll(x) be64toh(x)
 #define htonll(x) htobe64(x)
 #define set_ip_sockaddr_in(sockobj, ip) do { sockobj.sin_addr.s_addr = (ip); } while (0)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS, SO_NOSIGPIPE would be needed there
+#endif
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <windows.h>
 typedef int socklen_t;
 #define closeSocket(fd) closesocket(fd)
+#define MSG_NOSIGNAL 0
 
 #if __BIG_ENDIAN__
 #define htonll(x) (x)
@@ -67,6 +75,7 @@ using std::vector, std::string;
 
 class TCPSocket {
 
+  protected:
 	sockaddr_in remote;
 	int socketFd = 0;
 
@@ -77,37 +86,46 @@ class TCPSocket {
 		return time;
 	}
 
-	bool readReady(uint32_t timeoutMs) {
-		fd_set fdSet;
-		FD_ZERO(&fdSet);
-		FD_SET(socketFd, &fdSet);
+	// 0 waits forever
+	uint32_t receiveTimeoutMs = 15 * 1000;
+	uint32_t sendTimeoutMs = 15 * 1000;
 
-		timeval timeout = create_timeout(timeoutMs);
-		int ret = select(FD_SETSIZE, &fdSet, 0, 0, &timeout);
-		return (ret <= 0 || !FD_ISSET(socketFd, &fdSet)) ? false : true;
-	}
-
-	bool writeReady(uint32_t timeoutMs) {
+	// poll where available, select cannot watch descriptors past FD_SETSIZE
+	bool ready(bool write, uint32_t timeoutMs) {
+#ifndef _WIN32
+		pollfd entry = {socketFd, (short)(write ? POLLOUT : POLLIN), 0};
+		int ret;
+		do {
+			ret = poll(&entry, 1, timeoutMs ? (int)timeoutMs : -1);
+		} while(ret < 0 && errno == EINTR);
+		return ret > 0;
+#else
 		fd_set fdSet;
 		FD_ZERO(&fdSet);
 		FD_SET(socketFd, &fdSet);
 
 		timeval timeout = create_timeout(timeoutMs);
-		int ret = select(FD_SETSIZE, 0, &fdSet, 0, &timeout);
+		int ret = select(FD_SETSIZE, write ? 0 : &fdSet, write ? &fdSet : 0, 0, timeoutMs ? &timeout : 0);
 		return (ret <= 0 || !FD_ISSET(socketFd, &fdSet)) ? false : true;
+#endif
 	}
 
+	bool readReady() { return ready(false, receiveTimeoutMs); }
+	bool writeReady() { return ready(true, sendTimeoutMs); }
+
 #ifdef _WIN32
 	inline static bool wsaReady = false;
 	inline static WSADATA wsaData;
+#endif
 
-	static void startWSA() {
+	virtual void platformInit() {
+#ifdef _WIN32
 		if(wsaReady) return;
 		if(WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) throw std::runtime_error("WSAStartup failed!");
 
 		wsaReady = true;
-	}
 #endif
+	}
 
   public:
 	
@@ -117,23 +135,34 @@ class TCPSocket {
 		int tmp = sizeof(sockaddr_in);
 		getpeername(socket, (sockaddr*)&remote, (socklen_t*)&tmp);
 	}
+	virtual ~TCPSocket() {}
 
 	sockaddr_in getRemote() {
 		return remote;
 	}
 
+	int getFd() { return socketFd; }
+
+	void setBlocking(bool blocking) {
+#ifndef _WIN32
+		int flags = fcntl(socketFd, F_GETFL, 0);
+		fcntl(socketFd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#else
+		u_long nonBlocking = blocking ? 0 : 1;
+		ioctlsocket(socketFd, FIONBIO, &nonBlocking);
+#endif
+	}
+
 	EXCEPTION_DEF(TimeoutException);
 	EXCEPTION_DEF(NetworkException);
 	EXCEPTION_DEF(CloseException);
 
-	bool connect(string host, uint16_t port) {
-#ifdef _WIN32
-		startWSA();
-#endif
+	virtual bool connect(string host, uint16_t port) {
+		platformInit();
 		disconnect();
 
 		uint8_t ip[4] = {0};
-		uint8_t results = sscanf(host.c_str(), "%3u.%3u.%3u.%3u", &ip[0], &ip[1], &ip[2], &ip[3]);
+		uint8_t results = sscanf(host.c_str(), "%3hhu.%3hhu.%3hhu.%3hhu", &ip[0], &ip[1], &ip[2], &ip[3]);
 
 		// isn't an ip address - parse dns
 		if(results != 4) {
@@ -158,18 +187,68 @@ class TCPSocket {
 		return true;
 	}
 
-	void disconnect() {
+	virtual void disconnect() {
 		remote = {0};
 		if(socketFd == 0) return;
 		closeSocket(socketFd);
 	}
 
-	void send(vector<uint8_t>& bytes) {
-		int sentTotal = 0;
+	// how long blocking sends and receives wait before they throw TimeoutException, 0 waits forever
+	void setReceiveTimeout(uint32_t ms) { receiveTimeoutMs = ms; }
+	void setSendTimeout(uint32_t ms) { sendTimeoutMs = ms; }
+
+	// wakes up everything blocked on the socket, the fd itself stays valid until disconnect()
+	void interrupt() {
+#ifndef _WIN32
+		::shutdown(socketFd, SHUT_RDWR);
+#else
+		::shutdown(socketFd, SD_BOTH);
+#endif
+	}
+
+	void send(vector<uint8_t>& bytes) { send(bytes.data(), bytes.size()); }
+
+	virtual void send(const uint8_t* data, size_t length) {
+		size_t sentTotal = 0;
+
+		while(sentTotal < length) {
+			if(!writeReady()) throw TimeoutException("send timed out");
+			int sentBytes = ::send(socketFd, (char*)data + sentTotal, length - sentTotal, MSG_NOSIGNAL);
+
+			if(sentBytes > 0)
+				sentTotal += sentBytes;
+			else if(sentBytes == 0)
+				throw CloseException("socket was closed during send");
+			else
+				throw NetworkException("connection was aborted during send");
+		}
+	}
+
+	// sends header and payload back to back with a single gathered write where the kernel takes it all at once
+	virtual void sendv(const uint8_t* header, size_t headerLength, const uint8_t* payload, size_t payloadLength) {
+		size_t total = headerLength + payloadLength;
+		size_t sentTotal = 0;
 
-		while(sentTotal < bytes.size()) {
-			if(!writeReady(15 * 1000)) throw TimeoutException("send timed out after 15s");
-			int sentBytes = ::send(socketFd, (char*)bytes.data() + sentTotal, bytes.size() - sentTotal, 0);
+		while(sentTotal < total) {
+			if(!writeReady()) throw TimeoutException("send timed out");
+
+			size_t headerLeft = sentTotal < headerLength ? headerLength - sentTotal : 0;
+			size_t payloadSent = sentTotal - (headerLength - headerLeft);
+#ifndef _WIN32
+			iovec parts[2] = {{(void*)(header + headerLength - headerLeft), headerLeft},
+							  {(void*)(payload + payloadSent), payloadLength - payloadSent}};
+			msghdr message = {0};
+			message.msg_iov = headerLeft ? parts : parts + 1;
+			message.msg_iovlen = headerLeft ? 2 : 1;
+			long sentBytes = sendmsg(socketFd, &message, MSG_NOSIGNAL);
+#else
+			WSABUF parts[2] = {{(ULONG)headerLeft, (CHAR*)(header + headerLength - headerLeft)},
+							   {(ULONG)(payloadLength - payloadSent), (CHAR*)(payload + payloadSent)}};
+			DWORD sent = 0;
+			long sentBytes = WSASend(socketFd, headerLeft ? parts : parts + 1, headerLeft ? 2 : 1, &sent, 0, 0, 0) == 0
+								 ? (long)sent
+								 : -1;
+#endif
 
 			if(sentBytes > 0)
 				sentTotal += sentBytes;
@@ -180,56 +259,120 @@ class TCPSocket {
 		}
 	}
 
+	static bool wouldBlock() {
+#ifndef _WIN32
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+#else
+		return WSAGetLastError() == WSAEWOULDBLOCK;
+#endif
+	}
+
+	// for non blocking sockets: writes what fits right now, returns the amount written (0 if the socket is full)
+	long trySendv(const uint8_t* header, size_t headerLength, const uint8_t* payload, size_t payloadLength) {
+#ifndef _WIN32
+		iovec parts[2] = {{(void*)header, headerLength}, {(void*)payload, payloadLength}};
+		msghdr message = {0};
+		message.msg_iov = parts;
+		message.msg_iovlen = 2;
+		long sentBytes = sendmsg(socketFd, &message, MSG_NOSIGNAL);
+#else
+		WSABUF parts[2] = {{(ULONG)headerLength, (CHAR*)header}, {(ULONG)payloadLength, (CHAR*)payload}};
+		DWORD sent = 0;
+		long sentBytes = WSASend(socketFd, parts, 2, &sent, 0, 0, 0) == 0 ? (long)sent : -1;
+#endif
+		if(sentBytes >= 0) return sentBytes;
+		if(wouldBlock()) return 0;
+		throw NetworkException("connection was aborted during send");
+	}
+
+#ifndef _WIN32
+	// trySendv for any number of buffers
+	long trySendv(const iovec* parts, size_t count) {
+		msghdr message = {0};
+		message.msg_iov = (iovec*)parts;
+		message.msg_iovlen = count;
+		long sentBytes = sendmsg(socketFd, &message, MSG_NOSIGNAL);
+		if(sentBytes >= 0) return sentBytes;
+		if(wouldBlock()) return 0;
+		throw NetworkException("connection was aborted during send");
+	}
+#endif
+
+	// for non blocking sockets: returns the amount read, 0 if nothing is available
+	long tryReceive(uint8_t* buffer, size_t length) {
+		long receivedBytes = recv(socketFd, (char*)buffer, length, 0);
+		if(receivedBytes > 0) return receivedBytes;
+		if(receivedBytes == 0) throw CloseException("socket is closed");
+		if(wouldBlock()) return 0;
+		throw NetworkException("connection was aborted during receive");
+	}
+
 	SEND_TYPE(uint8_t, NOOP_FUNC);
 	SEND_TYPE(uint16_t, htons);
 	SEND_TYPE(uint32_t, htonl);
 	SEND_TYPE(uint64_t, htonll);
 
-	vector<uint8_t> receiveAvailable() {
+	virtual vector<uint8_t> receiveAvailable() {
 		uint8_t buffer[4096];
-		if(!readReady(15 * 1000)) throw TimeoutException("receive timed out after 15s");
-		int receivedBytes = recv(socketFd, (char*)buffer, 4096, 0);
-		
+		size_t receivedBytes = receiveAvailable(buffer, 4096);
+		return vector<uint8_t>(buffer, buffer + receivedBytes);
+	}
+
+	// reads whatever is available (at least one byte) into buffer, returns the amount read
+	virtual size_t receiveAvailable(uint8_t* buffer, size_t length) {
+		if(!readReady()) throw TimeoutException("receive timed out");
+		int receivedBytes = recv(socketFd, (char*)buffer, length, 0);
+
 		if(receivedBytes == 0)
 			throw CloseException("socket is closed");
 		else if(receivedBytes < 0)
 			throw NetworkException("connection was aborted during receive");
 
-		return vector<uint8_t>(buffer, buffer + receivedBytes);
+		return receivedBytes;
 	}
 
-	vector<uint8_t> receiveUntil(vector<uint8_t> byteSequence) {
+	// reads up to and including byteSequence, nothing behind it is taken off the socket. throws once maxLength
+	// bytes went by without it
+	virtual vector<uint8_t> receiveUntil(vector<uint8_t> byteSequence, size_t maxLength = SIZE_MAX) {
 		vector<uint8_t> buffer;
 
 		uint8_t peekBuffer[4096];
 
 		while(1) {
-			if(!readReady(15 * 1000)) throw TimeoutException("receive timed out after 15s");
-			int receivedBytes = recv(socketFd, (char*)peekBuffer, 4096, MSG_PEEK);
+			if(buffer.size() >= maxLength) throw NetworkException("delimiter not found within the size limit");
+			if(!readReady()) throw TimeoutException("receive timed out");
+			int receivedBytes = recv(socketFd, (char*)peekBuffer, std::min<size_t>(4096, maxLength - buffer.size()), MSG_PEEK);
 
 			if(receivedBytes == 0)
 				throw CloseException("socket is closed");
 			else if(receivedBytes < 0)
 				throw NetworkException("connection was aborted during receive");
 
+			// the sequence may straddle what was read before and the new bytes
+			size_t previous = buffer.size();
+			size_t searchFrom = previous >= byteSequence.size() ? previous - byteSequence.size() + 1 : 0;
 			buffer.insert(buffer.end(), peekBuffer, peekBuffer + receivedBytes);
-			auto iter = std::search(buffer.begin(), buffer.end(), byteSequence.begin(), byteSequence.end());
-			if(iter != buffer.end()) {
-				int readSize = iter - (buffer.end() - receivedBytes) + byteSequence.size();
+			auto iter = std::search(buffer.begin() + searchFrom, buffer.end(), byteSequence.begin(), byteSequence.end());
+
+			// peeked bytes are only taken off the socket up to the end of the sequence
+			bool found = iter != buffer.end();
+			size_t readSize = receivedBytes;
+			if(found) {
+				readSize = iter + byteSequence.size() - buffer.begin() - previous;
 				buffer.erase(iter + byteSequence.size(), buffer.end());
-				recv(socketFd, (char*)peekBuffer, readSize, 0); // remove until found from receive queue
-				return buffer;
 			}
+			recv(socketFd, (char*)peekBuffer, readSize, 0);
+			if(found) return buffer;
 		}
 	}
 
-	vector<uint8_t> receive(uint64_t amount) {
+	virtual vector<uint8_t> receive(uint64_t amount) {
 		vector<uint8_t> buffer(amount);
 
 		int receivedTotal = 0;
 
 		while(receivedTotal < amount) {
-			if(!readReady(15 * 1000)) throw TimeoutException("receive timed out after 15s");
+			if(!readReady()) throw TimeoutException("receive timed out");
 			int receivedBytes = recv(socketFd, (char*)buffer.data() + receivedTotal, amount - receivedTotal, 0);
 
 			if(receivedBytes > 0)
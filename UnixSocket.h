@@ -0,0 +1,64 @@
+#ifndef _UNIX_SOCKET_H_
+#define _UNIX_SOCKET_H_
+
+#include "TCPSocket.h"
+
+#ifndef _WIN32
+#include <sys/un.h>
+#include <sys/stat.h>
+
+/**
+ * stream socket on a filesystem path for connections within one machine. everything but connecting is inherited from
+ * TCPSocket, host is the socket path and ports do not apply.
+ */
+class UnixSocket : public TCPSocket {
+
+	// false if path does not fit sun_path
+	static bool toAddress(const string& path, sockaddr_un& address) {
+		address = {0};
+		address.sun_family = AF_UNIX;
+		if(path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+		memcpy(address.sun_path, path.data(), path.size());
+		return true;
+	}
+
+  public:
+	UnixSocket() {}
+	UnixSocket(int socket) { socketFd = socket; }
+
+	// the port only keeps the TCPSocket signature, paths have none
+	bool connect(string path, uint16_t = 0) override {
+		platformInit();
+		disconnect();
+
+		sockaddr_un address;
+		if(!toAddress(path, address)) return false;
+
+		socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(socketFd < 0) return false;
+
+		if(::connect(socketFd, (const sockaddr*)&address, sizeof(address)) < 0) return false;
+		return true;
+	}
+
+	// socket bound to path and ready for listen(). a socket file left behind by an earlier listener is replaced, any
+	// other file at path is not
+	static int bind(const string& path) {
+		sockaddr_un address;
+		if(!toAddress(path, address)) throw std::runtime_error("unix socket path too long");
+
+		struct stat existing;
+		if(lstat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) unlink(path.c_str());
+
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0) throw std::runtime_error("failed to create socket");
+		if(::bind(fd, (const sockaddr*)&address, sizeof(address)) < 0) {
+			::close(fd);
+			throw std::runtime_error("failed to bind socket");
+		}
+		return fd;
+	}
+};
+#endif
+
+#endif
@@ -0,0 +1,1248 @@
+#ifndef WEB_SOCKET_BENCH_H_
+#define WEB_SOCKET_BENCH_H_
+
+#include "Websocket.h"
+#include "Bench.h"
+
+#include <random>
+
+/**
+ * microbenchmarks for the websocket hot paths. every function runs standalone and returns its results as json.
+ */
+class WebSocketBench {
+
+	// repeats fn until roughly budgetNs passed, returns ns per call
+	template <class F> static double timeIt(F fn, uint64_t budgetNs = 200 * 1000 * 1000) {
+		fn(); // warm up caches and lazy initialization
+
+		uint64_t iterations = 0;
+		uint64_t start = bench::nowNs();
+		uint64_t elapsed = 0;
+		while(elapsed < budgetNs) {
+			for(int i = 0; i < 8; i++) fn();
+			iterations += 8;
+			elapsed = bench::nowNs() - start;
+		}
+		return (double)elapsed / iterations;
+	}
+
+	// connected loopback tcp pair, the second socket is drained by a background thread until it gets closed
+	struct LoopbackPair {
+		TCPSocket sender;
+		std::thread drain;
+
+		LoopbackPair() {
+			uint16_t port;
+			int listener = bench::loopbackListener(port, 1);
+			sender.connect("127.0.0.1", port);
+			int receiver = accept(listener, 0, 0);
+			closeSocket(listener);
+
+			drain = std::thread([receiver]() {
+				char buffer[64 * 1024];
+				while(recv(receiver, buffer, sizeof(buffer), 0) > 0) {}
+				closeSocket(receiver);
+			});
+		}
+
+		~LoopbackPair() {
+			sender.disconnect();
+			drain.join();
+		}
+	};
+
+	static vector<size_t> payloadSizes(size_t from, size_t to) {
+		vector<size_t> sizes;
+		for(size_t size = from; size <= to; size *= 4) sizes.push_back(size);
+		return sizes;
+	}
+
+	// transport for running the frame codec on memory: receives hand out input at most readSize bytes at a time and
+	// throw CloseException at its end, sends are appended to output
+	struct MemorySocket : public TCPSocket {
+		vector<uint8_t> input;
+		size_t inputPos = 0;
+		size_t readSize = SIZE_MAX;
+		vector<uint8_t> output;
+
+		MemorySocket() { socketFd = -1; }
+
+		using TCPSocket::receiveAvailable;
+		using TCPSocket::send;
+
+		void send(const uint8_t* data, size_t length) override { output.insert(output.end(), data, data + length); }
+
+		void sendv(const uint8_t* header, size_t headerLength, const uint8_t* payload, size_t payloadLength) override {
+			send(header, headerLength);
+			send(payload, payloadLength);
+		}
+
+		size_t receiveAvailable(uint8_t* buffer, size_t length) override {
+			if(inputPos == input.size()) throw CloseException("end of input");
+			size_t take = std::min({length, readSize, input.size() - inputPos});
+			memcpy(buffer, input.data() + inputPos, take);
+			inputPos += take;
+			return take;
+		}
+	};
+
+	typedef BasicWebSocket<MemorySocket> MemoryWebSocket;
+	typedef std::pair<vector<uint8_t>, bool> Message; // payload, binary
+
+	// a frame laid out as RFC 6455 5.2 describes it, written without encodeHeader so the two check each other
+	static vector<uint8_t> wireFrame(uint8_t opcode, const vector<uint8_t>& payload, bool masked, bool fin = true,
+									 uint8_t rsv = 0) {
+		vector<uint8_t> out = {(uint8_t)((fin ? 0x80 : 0) | rsv << 4 | opcode)};
+		uint8_t maskBit = masked ? 0x80 : 0;
+		uint64_t length = payload.size();
+		if(length < 126) out.push_back(maskBit | (uint8_t)length);
+		else if(length < 65536)
+			out.insert(out.end(), {(uint8_t)(maskBit | 126), (uint8_t)(length >> 8), (uint8_t)length});
+		else {
+			out.push_back(maskBit | 127);
+			for(int shift = 56; shift >= 0; shift -= 8) out.push_back((uint8_t)(length >> shift));
+		}
+
+		const uint8_t key[4] = {0x5a, 0x13, 0xc7, 0x81};
+		if(masked) out.insert(out.end(), key, key + 4);
+		for(size_t i = 0; i < length; i++) out.push_back(masked ? payload[i] ^ key[i % 4] : payload[i]);
+		return out;
+	}
+
+	static vector<uint8_t> concat(std::initializer_list<vector<uint8_t>> parts) {
+		vector<uint8_t> out;
+		for(auto& part : parts) out.insert(out.end(), part.begin(), part.end());
+		return out;
+	}
+
+	// frames a connection sent as (first byte, payload), false if data is not a sequence of complete frames masked
+	// as expected
+	static bool unwire(const vector<uint8_t>& data, bool masked, vector<std::pair<uint8_t, vector<uint8_t>>>& frames) {
+		for(size_t pos = 0; pos < data.size();) {
+			if(data.size() - pos < 2 || (bool)(data[pos + 1] & 0x80) != masked) return false;
+			uint8_t first = data[pos];
+			uint64_t length = data[pos + 1] & 0x7f;
+			pos += 2;
+
+			size_t extended = length == 126 ? 2 : length == 127 ? 8 : 0;
+			if(data.size() - pos < extended + (masked ? 4 : 0)) return false;
+			if(extended) length = 0;
+			for(size_t i = 0; i < extended; i++) length = length << 8 | data[pos++];
+
+			const uint8_t* key = &data[pos];
+			if(masked) pos += 4;
+			if(data.size() - pos < length) return false;
+
+			vector<uint8_t> payload(data.begin() + pos, data.begin() + pos + length);
+			if(masked)
+				for(size_t i = 0; i < length; i++) payload[i] ^= key[i % 4];
+			frames.push_back({first, payload});
+			pos += length;
+		}
+		return true;
+	}
+
+	/**
+	 * one conformance case: input goes through readFrame and handleFrame of a server (masked input) or client
+	 * connection the way receiveLoop drives them. messages and the frames sent back in reply must be exactly the
+	 * expected ones.
+	 */
+	struct CodecCase {
+		string name;
+		bool server;
+		vector<uint8_t> input;
+		vector<Message> messages;
+		vector<std::pair<uint8_t, vector<uint8_t>>> replies;
+		uint64_t maxFrameSize = 0;
+	};
+
+	static bool codecRun(const CodecCase& test, size_t readSize) {
+		MemoryWebSocket ws;
+		ws.clientMode = !test.server;
+		ws.sock.input = test.input;
+		ws.sock.readSize = readSize;
+		if(test.maxFrameSize) ws.parser.maxFrameSize = test.maxFrameSize;
+
+		vector<Message> messages;
+		ws.onMessage([&](vector<uint8_t>& message, bool binary) { messages.push_back({message, binary}); });
+
+		while(1) {
+			MemoryWebSocket::Frame* frame;
+			try {
+				frame = &ws.readFrame();
+			} catch(MessageTooBigException& e) {
+				ws.fail(e);
+				break;
+			} catch(...) { break; }
+			if(!ws.handleFrame(*frame)) break;
+		}
+
+		vector<std::pair<uint8_t, vector<uint8_t>>> replies;
+		return unwire(ws.sock.output, !test.server, replies) && replies == test.replies && messages == test.messages;
+	}
+
+	static std::pair<uint8_t, vector<uint8_t>> closeReply(uint16_t code) {
+		return {0x88, {(uint8_t)(code >> 8), (uint8_t)code}};
+	}
+
+	static vector<CodecCase> codecCases() {
+		typedef MemoryWebSocket W;
+		vector<CodecCase> cases;
+
+		for(bool server : {true, false}) {
+			string side = server ? "server_" : "client_";
+			bool m = server; // what the peer sends is masked when we are the server
+			auto add = [&](string name, vector<uint8_t> input, vector<Message> messages,
+						   vector<std::pair<uint8_t, vector<uint8_t>>> replies = {}) {
+				cases.push_back({side + name, server, input, messages, replies});
+			};
+
+			// all three length encodings at their edges
+			for(uint64_t length : {0, 1, 125, 126, 127, 65535, 65536, 70000}) {
+				vector<uint8_t> payload(length);
+				for(size_t i = 0; i < length; i++) payload[i] = 'a' + i % 26;
+				add("text_" + std::to_string(length), wireFrame(W::Text, payload, m), {{payload, false}});
+				add("binary_" + std::to_string(length), wireFrame(W::Binary, payload, m), {{payload, true}});
+			}
+
+			// control frames between the fragments of a message, a utf-8 character split over two of them
+			vector<uint8_t> part1 = {'G', 'r', 0xc3}, part2 = {0xbc, 0xc3, 0x9f}, part3 = {'e'}, ping = {'p'};
+			add("fragmented_text",
+				concat({wireFrame(W::Text, part1, m, false), wireFrame(W::Ping, ping, m),
+						wireFrame(W::Continuation, part2, m, false), wireFrame(W::Pong, {'x'}, m),
+						wireFrame(W::Continuation, part3, m)}),
+				{{concat({part1, part2, part3}), false}}, {{0x8a, ping}});
+
+			vector<uint8_t> large(70000, 'z');
+			add("fragmented_binary_64bit",
+				concat({wireFrame(W::Binary, large, m, false), wireFrame(W::Continuation, large, m, false),
+						wireFrame(W::Continuation, large, m)}),
+				{{concat({large, large, large}), true}});
+
+			vector<uint8_t> ping125(125, 'q');
+			add("ping_125", wireFrame(W::Ping, ping125, m), {}, {{0x8a, ping125}});
+			add("pong_unsolicited", wireFrame(W::Pong, {'u'}, m), {});
+
+			// the close reply echoes the code, nothing behind the close frame is delivered
+			add("close_1000", concat({wireFrame(W::Close, {0x03, 0xe8}, m), wireFrame(W::Text, {'x'}, m)}), {},
+				{closeReply(1000)});
+			add("close_reason", wireFrame(W::Close, {0x03, 0xe9, 'b', 'y', 'e'}, m), {}, {closeReply(1001)});
+			add("close_empty", wireFrame(W::Close, {}, m), {}, {{0x88, {}}});
+			for(uint16_t code : {1014, 3000, 4999})
+				add("close_" + std::to_string(code), wireFrame(W::Close, closeReply(code).second, m), {},
+					{closeReply(code)});
+
+			// malformed input ends in a close with the matching status code
+			add("reserved_opcode_3", wireFrame(0x03, {'x'}, m), {}, {closeReply(1002)});
+			add("reserved_opcode_b", wireFrame(0x0b, {'x'}, m), {}, {closeReply(1002)});
+			add("rsv1_without_extension", wireFrame(W::Text, {'x'}, m, true, 0b100), {}, {closeReply(1002)});
+			add("rsv3", wireFrame(W::Binary, {'x'}, m, true, 0b001), {}, {closeReply(1002)});
+			add("fragmented_ping", wireFrame(W::Ping, {'x'}, m, false), {}, {closeReply(1002)});
+			add("ping_126", wireFrame(W::Ping, vector<uint8_t>(126, 'x'), m), {}, {closeReply(1002)});
+			add("close_one_byte", wireFrame(W::Close, {0x03}, m), {}, {closeReply(1002)});
+			// codes that must not go on the wire, RFC 6455 7.4
+			for(uint16_t code : {0, 999, 1004, 1005, 1006, 1015, 1016, 2999, 5000})
+				add("close_" + std::to_string(code), wireFrame(W::Close, closeReply(code).second, m), {},
+					{closeReply(1002)});
+			add("close_invalid_utf8_reason", wireFrame(W::Close, {0x03, 0xe8, 'o', 0xff}, m), {}, {closeReply(1007)});
+			add("orphan_continuation", wireFrame(W::Continuation, {'x'}, m), {}, {closeReply(1002)});
+			add("data_inside_message", concat({wireFrame(W::Text, {'x'}, m, false), wireFrame(W::Text, {'y'}, m)}), {},
+				{closeReply(1002)});
+			add("wrong_masking", wireFrame(W::Binary, {'x'}, !m), {}, {closeReply(1002)});
+			add("invalid_utf8", wireFrame(W::Text, {0xc3, 0x28}, m), {}, {closeReply(1007)});
+			add("invalid_utf8_fragmented", concat({wireFrame(W::Text, {'x'}, m, false), wireFrame(W::Continuation, {0xff}, m)}),
+				{}, {closeReply(1007)});
+
+			CodecCase tooBig = {side + "frame_too_big", server, wireFrame(W::Binary, vector<uint8_t>(2048, 'x'), m), {},
+								{closeReply(1009)}, 1024};
+			cases.push_back(tooBig);
+		}
+
+		return cases;
+	}
+
+	// sendFrame output of a server (unmasked) or client (masked) connection must read back as the frames sent
+	static bool encodeRun(bool server, uint64_t length) {
+		MemoryWebSocket ws;
+		ws.clientMode = !server;
+
+		vector<uint8_t> payload(length);
+		for(size_t i = 0; i < length; i++) payload[i] = (uint8_t)(i * 31);
+		ws.sendFrame(MemoryWebSocket::Binary, payload);
+		ws.sendFrame(MemoryWebSocket::Text, payload.data(), length / 2, false);
+		ws.sendFrame(MemoryWebSocket::Continuation, payload.data() + length / 2, length - length / 2);
+
+		vector<std::pair<uint8_t, vector<uint8_t>>> frames;
+		vector<std::pair<uint8_t, vector<uint8_t>>> expected = {
+			{0x82, payload},
+			{0x01, vector<uint8_t>(payload.begin(), payload.begin() + length / 2)},
+			{0x80, vector<uint8_t>(payload.begin() + length / 2, payload.end())}};
+		return unwire(ws.sock.output, !server, frames) && frames == expected;
+	}
+
+#ifdef WEBSOCKET_EPOLL
+	// bare blocking client connection without a receive thread, thousands of WebSocket objects would bring their own
+	struct RawClient {
+		int fd = -1;
+
+		// every loopback source address has its own ~28k ephemeral ports, so large counts spread over 127.0.0.x
+		bool open(uint16_t port, size_t index) {
+			fd = socket(AF_INET, SOCK_STREAM, 0);
+			if(fd < 0) return false;
+
+			sockaddr_in address = {0};
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + index / 20000);
+			if(bind(fd, (sockaddr*)&address, sizeof(address)) < 0) return false;
+
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			address.sin_port = htons(port);
+			if(::connect(fd, (sockaddr*)&address, sizeof(address)) < 0) return false;
+
+			timeval timeout = {10, 0};
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+			const char* request = "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: Upgrade\r\nUpgrade: websocket\r\n"
+								  "Sec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+			if(::send(fd, request, strlen(request), MSG_NOSIGNAL) < 0) return false;
+
+			string response;
+			char c;
+			while(response.size() < 4 || response.compare(response.size() - 4, 4, "\r\n\r\n") != 0) {
+				if(recv(fd, &c, 1, 0) != 1) return false;
+				response += c;
+			}
+			return response.compare(0, 12, "HTTP/1.1 101") == 0;
+		}
+
+		bool send(const vector<uint8_t>& payload) {
+			const uint8_t key[4] = {1, 2, 3, 4};
+			uint8_t frame[WebSocket::MAX_HEADER_SIZE + 125];
+			size_t headerSize = WebSocket::encodeHeader(frame, true, WebSocket::Binary, payload.size(), key);
+			memcpy(frame + headerSize, payload.data(), payload.size());
+			util::mask(frame + headerSize, payload.size(), key);
+			return ::send(fd, frame, headerSize + payload.size(), MSG_NOSIGNAL) == (long)(headerSize + payload.size());
+		}
+
+		// waits for the next data frame, control frames (the server pings) are skipped. payloads stay below 126
+		bool receive() {
+			while(1) {
+				uint8_t header[2];
+				uint8_t payload[125];
+				if(recv(fd, header, 2, MSG_WAITALL) != 2) return false;
+				size_t length = header[1] & 0x7f;
+				if(length && recv(fd, payload, length, MSG_WAITALL) != (long)length) return false;
+				if(!(header[0] & 0x08)) return true;
+			}
+		}
+
+		void close() {
+			if(fd >= 0) ::close(fd);
+			fd = -1;
+		}
+	};
+
+	// statm is opened up front, once the connections used up the fd limit there would be none left for it
+	static size_t residentBytes(int statm) {
+		char buffer[128] = {0};
+		long pages = 0, resident = 0;
+		if(pread(statm, buffer, sizeof(buffer) - 1, 0) <= 0 || sscanf(buffer, "%ld %ld", &pages, &resident) != 2) return 0;
+		return resident * sysconf(_SC_PAGESIZE);
+	}
+#endif
+
+  public:
+	// util::mask kernels from 16 B to 16 MiB
+	static string masking() {
+		typedef void (*Kernel)(uint8_t*, size_t, const uint8_t*, size_t);
+		vector<std::pair<string, Kernel>> kernels = {{"scalar", util::maskScalar}};
+#ifdef WEBSOCKET_X86
+		if(util::cpu().sse2) kernels.push_back({"sse2", util::maskSSE2});
+		if(util::cpu().avx2) kernels.push_back({"avx2", util::maskAVX2});
+#endif
+
+		const uint8_t key[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+		bench::Json report;
+		report.beginObject().key("masking").beginArray();
+
+		for(size_t size : payloadSizes(16, 16 * 1024 * 1024)) {
+			vector<uint8_t> payload(size, 0xab);
+
+			report.beginObject();
+			report.field("bytes", size);
+			for(auto& kernel : kernels) {
+				double ns = timeIt([&]() {
+					kernel.second(payload.data(), payload.size(), key, 0);
+					bench::keep(payload[0]);
+				});
+				report.field(kernel.first + "_gb_s", size / ns);
+			}
+			report.endObject();
+		}
+
+		report.endArray().endObject();
+		return report.str();
+	}
+
+	// small message rate over loopback, one send per field as sendFrame used to do vs. one gathered write per frame
+	static string frameEmission() {
+		bench::Json report;
+		report.beginObject().key("frame_emission").beginArray();
+
+		for(bool clientMode : {false, true}) {
+			for(size_t size : {10, 64, 125, 1024}) {
+				vector<uint8_t> payload(size, 'x');
+
+				LoopbackPair legacyPair;
+				double legacyNs = timeIt([&]() {
+					TCPSocket& sock = legacyPair.sender;
+					sock.send((uint8_t)(0b10000000 | WebSocket::Binary));
+					sock.send((uint8_t)((clientMode ? 0b10000000 : 0) | (size > 125 ? 126 : size)));
+					if(size > 125) sock.send((uint16_t)size);
+					if(clientMode) {
+						vector<uint8_t> copy(payload);
+						vector<uint8_t> maskingKey(4);
+						(*(uint32_t*)maskingKey.data()) = rand();
+						for(size_t i = 0; i < copy.size(); i++) copy[i] ^= maskingKey[i % 4];
+						sock.send(maskingKey);
+						sock.send(copy);
+					} else {
+						sock.send(payload);
+					}
+				});
+
+				LoopbackPair pair;
+				WebSocket ws;
+				ws.clientMode = clientMode;
+				ws.sock = pair.sender;
+				double ns = timeIt([&]() { ws.send(payload); });
+
+				report.beginObject();
+				report.field("mode", clientMode ? "client" : "server");
+				report.field("bytes", size);
+				report.field("legacy_msgs_s", 1e9 / legacyNs);
+				report.field("msgs_s", 1e9 / ns);
+				report.endObject();
+			}
+		}
+
+		report.endArray().endObject();
+		return report.str();
+	}
+
+	/**
+	 * masking key generation from several threads at once, rand() as sendFrame used to call it vs. the per thread
+	 * SecureRandom. then client mode sends of small messages with one connection per thread, which is where the key
+	 * source used to be shared.
+	 */
+	static string maskKeys(vector<size_t> threadCounts = {1, 2, 4, 8}, size_t keysPerThread = 2000000,
+						   size_t messagesPerThread = 200000) {
+		auto parallel = [](size_t threads, const function<void()>& work) {
+			vector<std::thread> workers;
+			uint64_t start = bench::nowNs();
+			for(size_t t = 0; t < threads; t++) workers.emplace_back(work);
+			for(auto& worker : workers) worker.join();
+			return bench::nowNs() - start;
+		};
+
+		bench::Json report;
+		report.beginObject().key("mask_keys").beginArray();
+
+		for(size_t threads : threadCounts) {
+			uint64_t legacyNs = parallel(threads, [&]() {
+				uint32_t key = 0;
+				for(size_t i = 0; i < keysPerThread; i++) key ^= rand();
+				bench::keep(key);
+			});
+
+			uint64_t keysNs = parallel(threads, [&]() {
+				uint8_t key[4];
+				for(size_t i = 0; i < keysPerThread; i++) {
+					util::maskingKey(key);
+					bench::keep(key);
+				}
+			});
+
+			vector<uint8_t> payload(64, 'x');
+			uint64_t sendNs = parallel(threads, [&]() {
+				LoopbackPair pair;
+				WebSocket ws;
+				ws.clientMode = true;
+				ws.sock = pair.sender;
+				for(size_t i = 0; i < messagesPerThread; i++) ws.send(payload);
+			});
+
+			double keys = (double)threads * keysPerThread;
+
+			report.beginObject();
+			report.field("threads", threads);
+			report.field("legacy_keys_s", keys / (legacyNs / 1e9));
+			report.field("keys_s", keys / (keysNs / 1e9));
+			report.field("send_msgs_s", (double)threads * messagesPerThread / (sendNs / 1e9));
+			report.endObject();
+		}
+
+		report.endArray().endObject();
+		return report.str();
+	}
+
+	// the old substr based header parsing, kept for comparison
+	static size_t legacyHeaderParse(const string& httpRequest) {
+		unordered_map<string, string> headers;
+		auto headersRaw = httpRequest.substr(httpRequest.find("\r\n") + 2);
+		headersRaw = headersRaw.substr(0, headersRaw.find("\r\n\r\n") + 2);
+
+		size_t pos;
+		while((pos = headersRaw.find("\r\n")) != string::npos) {
+			auto header = headersRaw.substr(0, pos);
+			size_t delim = header.find(": ");
+			auto headerName = header.substr(0, delim);
+			std::transform(headerName.begin(), headerName.end(), headerName.begin(), tolower);
+			headers[headerName] = header.substr(delim + 2);
+			headersRaw = headersRaw.substr(pos + 2);
+		}
+		return headers.count("sec-websocket-key");
+	}
+
+	// upgrade request parsing, a typical browser handshake and one carrying large cookies
+	static string handshakeParsing() {
+		string browser = "GET /socket?room=42 HTTP/1.1\r\n"
+						 "Host: example.com:8080\r\n"
+						 "Connection: Upgrade\r\n"
+						 "Pragma: no-cache\r\n"
+						 "Cache-Control: no-cache\r\n"
+						 "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+						 "Chrome/120.0.0.0 Safari/537.36\r\n"
+						 "Upgrade: websocket\r\n"
+						 "Origin: https://example.com\r\n"
+						 "Sec-WebSocket-Version: 13\r\n"
+						 "Accept-Encoding: gzip, deflate, br\r\n"
+						 "Accept-Language: en-US,en;q=0.9\r\n"
+						 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+						 "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+						 "\r\n";
+
+		string cookies = browser;
+		string cookieLines;
+		for(int i = 0; i < 12; i++) cookieLines += "Cookie: session" + std::to_string(i) + "=" + string(600, 'c') + "\r\n";
+		cookies.insert(cookies.find("Sec-WebSocket-Key"), cookieLines);
+
+		bench::Json report;
+		report.beginObject().key("handshake_parsing").beginArray();
+
+		for(auto& request : {std::make_pair("browser", &browser), std::make_pair("cookies", &cookies)}) {
+			const string& text = *request.second;
+
+			double legacyNs = timeIt([&]() { bench::keep(legacyHeaderParse(text)); });
+
+			util::HttpHead head;
+			double ns = timeIt([&]() {
+				bench::keep(head.parse(text));
+				bench::keep(head.get("sec-websocket-key").size());
+			});
+
+			report.beginObject();
+			report.field("request", request.first);
+			report.field("bytes", text.size());
+			report.field("headers", head.headerCount);
+			report.field("legacy_ns", legacyNs);
+			report.field("ns", ns);
+			report.field("gb_s", text.size() / ns);
+			report.endObject();
+		}
+
+		report.endArray().endObject();
+		return report.str();
+	}
+
+	/**
+	 * sha-1 block kernels on 64 KiB, then whole handshake digests: a 24 byte key plus the magic string, padded to two
+	 * blocks. avx2_x8 hashes eight keys per call, hash_many is what the SHA1 class picks for a batch on this cpu.
+	 */
+	static string sha1() {
+		typedef void (*Kernel)(uint32_t*, const uint8_t*, size_t);
+		vector<std::pair<string, Kernel>> kernels = {{"scalar", util::SHA1::transformScalar}};
+#ifdef WEBSOCKET_X86
+		if(util::cpu().sha && util::cpu().sse41) kernels.push_back({"shani", util::SHA1::transformSHANI});
+#endif
+
+		vector<uint8_t> data(64 * 1024, 0x5a);
+		string key = "dGhlIHNhbXBsZSBub25jZQ==" MAGIC_STRING;
+		uint8_t padded[128];
+		size_t blocks = util::SHA1::pad((const uint8_t*)key.data(), key.size(), padded) / 64;
+
+		bench::Json report;
+		report.beginObject().key("sha1").beginObject();
+
+		report.key("blocks_gb_s").beginObject();
+		for(auto& kernel : kernels) {
+			uint32_t state[5] = {0};
+			double ns = timeIt([&]() {
+				kernel.second(state, data.data(), data.size() / 64);
+				bench::keep(state[0]);
+			});
+			report.field(kernel.first, data.size() / ns);
+		}
+#ifdef WEBSOCKET_X86
+		alignas(32) uint8_t lanes[8 * util::SHA1::LANE_BYTES];
+		for(int lane = 0; lane < 8; lane++) memcpy(lanes + lane * util::SHA1::LANE_BYTES, data.data(), sizeof(lanes) / 8);
+		const size_t laneBlocks[8] = {4, 4, 4, 4, 4, 4, 4, 4};
+		uint32_t states[8][5] = {{0}};
+		if(util::cpu().avx2) {
+			double ns = timeIt([&]() {
+				util::SHA1::transformAVX2x8(states, lanes, laneBlocks);
+				bench::keep(states[0][0]);
+			});
+			report.field("avx2_x8", sizeof(lanes) / ns);
+		}
+#endif
+		report.endObject();
+
+		report.key("handshake_keys_s").beginObject();
+		for(auto& kernel : kernels) {
+			double ns = timeIt([&]() {
+				uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+				kernel.second(state, padded, blocks);
+				bench::keep(state[0]);
+			});
+			report.field(kernel.first, 1e9 / ns);
+		}
+#ifdef WEBSOCKET_X86
+		if(util::cpu().avx2) {
+			for(int lane = 0; lane < 8; lane++)
+				util::SHA1::pad((const uint8_t*)key.data(), key.size(), lanes + lane * util::SHA1::LANE_BYTES);
+			const size_t keyBlocks[8] = {blocks, blocks, blocks, blocks, blocks, blocks, blocks, blocks};
+			double ns = timeIt([&]() {
+				uint32_t states[8][5];
+				for(auto& state : states) {
+					const uint32_t initial[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+					memcpy(state, initial, sizeof(initial));
+				}
+				util::SHA1::transformAVX2x8(states, lanes, keyBlocks);
+				bench::keep(states[0][0]);
+			});
+			report.field("avx2_x8", 8e9 / ns);
+		}
+#endif
+		double classNs = timeIt([&]() {
+			uint8_t digest[20];
+			util::SHA1().update(key).final(digest);
+			bench::keep(digest[0]);
+		});
+		report.field("sha1_class", 1e9 / classNs);
+
+		const uint8_t* keys[64];
+		size_t lengths[64];
+		uint8_t digests[64][20];
+		for(int i = 0; i < 64; i++) {
+			keys[i] = (const uint8_t*)key.data();
+			lengths[i] = key.size();
+		}
+		double manyNs = timeIt([&]() {
+			util::SHA1::hashMany(keys, lengths, digests, 64);
+			bench::keep(digests[0][0]);
+		});
+		report.field("hash_many", 64e9 / manyNs);
+		report.endObject();
+
+		report.endObject().endObject();
+		return report.str();
+	}
+
+	// util::b64_encode and b64_decode kernels from 16 B to 1 MiB of raw data, throughput counts the raw side
+	static string base64() {
+		typedef size_t (*Encoder)(const uint8_t*, size_t, char*);
+		typedef long (*Decoder)(const char*, size_t, uint8_t*);
+		vector<std::tuple<string, Encoder, Decoder>> kernels = {{"scalar", util::b64EncodeScalar, util::b64DecodeScalar}};
+#ifdef WEBSOCKET_X86
+		if(util::cpu().ssse3) kernels.push_back({"ssse3", util::b64EncodeSSSE3, util::b64DecodeSSSE3});
+		if(util::cpu().avx2) kernels.push_back({"avx2", util::b64EncodeAVX2, util::b64DecodeAVX2});
+#endif
+
+		bench::Json report;
+		report.beginObject().key("base64").beginArray();
+
+		for(size_t size : payloadSizes(16, 1024 * 1024)) {
+			vector<uint8_t> raw(size);
+			for(size_t i = 0; i < size; i++) raw[i] = (uint8_t)(i * 2654435761u >> 13);
+			string encoded(util::b64_encoded_length(size), '\0');
+			vector<uint8_t> decoded(util::b64_max_decoded_length(encoded.size()));
+
+			report.beginObject();
+			report.field("bytes", size);
+			for(auto& [name, encode, decode] : kernels) {
+				double encodeNs = timeIt([&, encode = encode]() { bench::keep(encode(raw.data(), size, encoded.data())); });
+				double decodeNs =
+					timeIt([&, decode = decode]() { bench::keep(decode(encoded.data(), encoded.size(), decoded.data())); });
+				if(decode(encoded.data(), encoded.size(), decoded.data()) != (long)size ||
+				   memcmp(decoded.data(), raw.data(), size))
+					throw std::runtime_error("base64 round trip failed for " + name);
+
+				report.field(name + "_encode_gb_s", size / encodeNs);
+				report.field(name + "_decode_gb_s", size / decodeNs);
+			}
+			report.endObject();
+		}
+
+		report.endArray().endObject();
+		return report.str();
+	}
+
+	// frames in memory, as if a single large recv had returned them or they came in 4 KiB reads
+	static string frameParsing() {
+		bench::Json report;
+		report.beginObject().key("frame_parsing").beginArray();
+
+		const uint8_t key[4] = {1, 2, 3, 4};
+
+		for(size_t size : {2, 16, 125, 1024, 16 * 1024}) {
+			vector<uint8_t> stream;
+			size_t frames = 0;
+			while(stream.size() < 4 * 1024 * 1024) {
+				uint8_t header[WebSocket::MAX_HEADER_SIZE];
+				size_t headerSize = WebSocket::encodeHeader(header, true, WebSocket::Binary, size, key);
+				stream.insert(stream.end(), header, header + headerSize);
+				stream.insert(stream.end(), size, 'x');
+				frames++;
+			}
+
+			report.beginObject();
+			report.field("payload_bytes", size);
+
+			for(size_t chunk : {stream.size(), (size_t)4096}) {
+				WebSocket::FrameParser parser;
+				double ns = timeIt([&]() {
+					size_t parsed = 0;
+					for(size_t offset = 0; offset < stream.size(); offset += chunk) {
+						size_t length = std::min(chunk, stream.size() - offset);
+						for(size_t pos = 0; pos < length;) {
+							bool ready;
+							pos += parser.feed(stream.data() + offset + pos, length - pos, ready);
+							parsed += ready;
+						}
+					}
+					bench::keep(parsed);
+				});
+
+				string prefix = chunk == stream.size() ? "single_read" : "4k_reads";
+				report.field(prefix + "_frames_s", frames / (ns / 1e9));
+				report.field(prefix + "_gb_s", stream.size() / ns);
+			}
+
+			report.endObject();
+		}
+
+		report.endArray().endObject();
+		return report.str();
+	}
+
+	/**
+	 * the frame codec on memory buffers. checks conformance first - every opcode, all three length encodings,
+	 * masked and unmasked, fragments with control frames in between and malformed input, each fed whole and in
+	 * 1 and 7 byte reads - and throws if any case fails. then times sendFrame and readFrame plus handleFrame per
+	 * frame for server and client connections.
+	 */
+	static string frameCodec() {
+		vector<string> failed;
+		size_t runs = 0;
+		for(auto& test : codecCases()) {
+			for(size_t readSize : {SIZE_MAX, (size_t)1, (size_t)7}) {
+				runs++;
+				if(!codecRun(test, readSize)) {
+					failed.push_back(test.name + "/" + (readSize == SIZE_MAX ? "whole" : std::to_string(readSize)));
+					break;
+				}
+			}
+		}
+		for(bool server : {true, false}) {
+			for(uint64_t length : {0, 1, 125, 126, 65535, 65536, 70000}) {
+				runs++;
+				if(!encodeRun(server, length))
+					failed.push_back(string(server ? "server" : "client") + "_encode_" + std::to_string(length));
+			}
+		}
+
+		if(!failed.empty()) {
+			string names;
+			for(auto& name : failed) names += (names.empty() ? "" : ", ") + name;
+			throw std::runtime_error("frame codec conformance failed: " + names);
+		}
+
+		bench::Json report;
+		report.beginObject().key("frame_codec").beginObject();
+		report.field("conformance_runs", runs);
+		report.key("throughput").beginArray();
+
+		for(size_t size : {(size_t)2, (size_t)125, (size_t)1024, (size_t)16 * 1024, (size_t)1024 * 1024}) {
+			vector<uint8_t> payload(size, 'x');
+			report.beginObject();
+			report.field("payload_bytes", size);
+
+			for(bool server : {true, false}) {
+				string side = server ? "server" : "client";
+				MemoryWebSocket sender;
+				sender.clientMode = !server;
+				double ns = timeIt([&]() {
+					sender.sock.output.clear();
+					sender.sendFrame(MemoryWebSocket::Binary, payload);
+				});
+				report.field(side + "_encode_ns", ns);
+				report.field(side + "_encode_gb_s", size / ns);
+
+				// a few MiB of frames from the peer, masked if they go to the server
+				MemoryWebSocket receiver;
+				receiver.clientMode = !server;
+				size_t frames = std::max<size_t>(1, 4 * 1024 * 1024 / (size + 14));
+				for(size_t i = 0; i < frames; i++) {
+					vector<uint8_t> frame = wireFrame(MemoryWebSocket::Binary, payload, server);
+					receiver.sock.input.insert(receiver.sock.input.end(), frame.begin(), frame.end());
+				}
+				size_t received = 0;
+				receiver.onMessage([&](vector<uint8_t>&, bool) { received++; });
+
+				ns = timeIt([&]() {
+					receiver.sock.inputPos = 0;
+					for(size_t i = 0; i < frames; i++) receiver.handleFrame(receiver.readFrame());
+				});
+				if(received % frames) throw std::runtime_error("frame codec lost frames");
+				report.field(side + "_decode_ns", ns / frames);
+				report.field(side + "_decode_gb_s", size * frames / ns);
+			}
+
+			report.endObject();
+		}
+
+		report.endArray().endObject().endObject();
+		return report.str();
+	}
+
+	// utf-8 validation of text payloads from 64 B to 16 MiB, pure ascii and mixed with 2, 3 and 4 byte characters
+	static string utf8() {
+		typedef bool (*Kernel)(const uint8_t*, size_t);
+		vector<std::pair<string, Kernel>> kernels = {{"scalar", util::Utf8Validator::validateScalar}};
+#ifdef WEBSOCKET_X86
+		if(util::cpu().sse41 && util::cpu().ssse3) kernels.push_back({"sse41", util::Utf8Validator::validateSSE41});
+		if(util::cpu().avx2) kernels.push_back({"avx2", util::Utf8Validator::validateAVX2});
+#endif
+
+		vector<std::pair<string, string>> texts = {
+			{"ascii", "the quick brown fox jumps over the lazy dog. "},
+			{"mixed", "Grüße aus Zürich, 東京から – price: 12€ 🚀 "},
+		};
+
+		bench::Json report;
+		report.beginObject().key("utf8").beginArray();
+
+		for(auto& text : texts) {
+			for(size_t size : payloadSizes(64, 16 * 1024 * 1024)) {
+				string payload;
+				while(payload.size() < size) payload += text.second;
+				const uint8_t* data = (const uint8_t*)payload.data();
+
+				report.beginObject();
+				report.field("text", text.first);
+				report.field("bytes", payload.size());
+				for(auto& kernel : kernels) {
+					double ns = timeIt([&]() { bench::keep(kernel.second(data, payload.size())); });
+					report.field(kernel.first + "_gb_s", payload.size() / ns);
+				}
+
+				// as the receive path sees it, split into 4 KiB reads
+				util::Utf8Validator validator;
+				double ns = timeIt([&]() {
+					for(size_t offset = 0; offset < payload.size(); offset += 4096)
+						validator.update(data + offset, std::min<size_t>(4096, payload.size() - offset));
+					bench::keep(validator.finish());
+				});
+				report.field("incremental_gb_s", payload.size() / ns);
+				report.endObject();
+			}
+		}
+
+		report.endArray().endObject();
+		return report.str();
+	}
+
+#ifdef WEBSOCKET_EPOLL
+	/**
+	 * echo server over loopback with growing numbers of open connections. for every count it reports the resident
+	 * memory per connection, round trip latency of single probes while everything else is idle, and latency when
+	 * every connection sends at once. client and server share the process, so both count towards the fd limit -
+	 * connections_open tells how far it got. eventLoop false measures the thread per connection server instead.
+	 */
+	static string connectionScaling(vector<size_t> counts = {1000, 10000, 50000}, bool eventLoop = true,
+									size_t loopThreads = 0) {
+		uint64_t fdLimit = bench::raiseFdLimit();
+
+		WebSocketServer server(0, INADDR_LOOPBACK);
+		server.onConnection([](WebSocket& ws) {
+			ws.onMessage([&ws](vector<uint8_t>& message, bool binary) { ws.send(message, binary); });
+		});
+		uint16_t port = bench::boundPort(server.socketPtr);
+
+		std::thread serverThread([&]() {
+			if(eventLoop) server.runEventLoop(loopThreads);
+			else
+				server.run();
+		});
+		while(!server.running) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		vector<uint8_t> payload(32, 'x');
+		vector<RawClient> clients;
+		int statm = ::open("/proc/self/statm", O_RDONLY);
+		size_t baseline = residentBytes(statm);
+		bool limitReached = false;
+
+		bench::Json report;
+		report.beginObject();
+		report.field("mode", eventLoop ? "event_loop" : "thread_per_connection");
+		report.key("connection_scaling").beginArray();
+
+		for(size_t count : counts) {
+			uint64_t connectStart = bench::nowNs();
+			while(clients.size() < count && !limitReached) {
+				RawClient client;
+				if(!client.open(port, clients.size())) {
+					client.close();
+					limitReached = true;
+					break;
+				}
+				clients.push_back(client);
+			}
+			double connectSeconds = (bench::nowNs() - connectStart) / 1e9;
+			if(clients.empty()) break;
+
+			// idle: single round trips on random connections while all others sit there
+			bench::Histogram idle;
+			for(size_t i = 0; i < 1000; i++) {
+				RawClient& client = clients[rand() % clients.size()];
+				uint64_t start = bench::nowNs();
+				if(!client.send(payload) || !client.receive()) break;
+				idle.record(bench::nowNs() - start);
+			}
+
+			// active: every connection sends, then the replies are collected, spread over a few client threads
+			size_t clientThreads = std::min<size_t>(8, clients.size());
+			vector<bench::Histogram> perThread(clientThreads);
+			std::atomic<uint64_t> failed = 0;
+			uint64_t activeStart = bench::nowNs();
+			vector<std::thread> threads;
+			for(size_t t = 0; t < clientThreads; t++) {
+				threads.emplace_back([&, t]() {
+					vector<uint64_t> sentAt(clients.size());
+					for(int round = 0; round < 3; round++) {
+						for(size_t i = t; i < clients.size(); i += clientThreads) {
+							sentAt[i] = bench::nowNs();
+							if(!clients[i].send(payload)) failed++;
+						}
+						for(size_t i = t; i < clients.size(); i += clientThreads) {
+							if(!clients[i].receive()) failed++;
+							perThread[t].record(bench::nowNs() - sentAt[i]);
+						}
+					}
+				});
+			}
+			for(auto& worker : threads) worker.join();
+			double activeSeconds = (bench::nowNs() - activeStart) / 1e9;
+
+			bench::Histogram active;
+			for(auto& histogram : perThread) active.merge(histogram);
+
+			size_t resident = residentBytes(statm);
+
+			report.beginObject();
+			report.field("connections", count);
+			report.field("connections_open", clients.size());
+			report.field("connects_per_sec", clients.size() / std::max(connectSeconds, 1e-9));
+			report.field("resident_bytes", resident);
+			report.field("bytes_per_connection", (double)(resident - std::min(resident, baseline)) / clients.size());
+			report.field("idle_rtt_ns", idle);
+			report.field("active_rtt_ns", active);
+			report.field("active_msgs_s", active.count() / activeSeconds);
+			report.field("active_failed", failed.load());
+			report.endObject();
+
+			if(limitReached) break;
+		}
+
+		report.endArray();
+		report.field("fd_limit", fdLimit);
+		report.endObject();
+
+		for(auto& client : clients) client.close();
+		::close(statm);
+		server.stop();
+		serverThread.join();
+
+		return report.str();
+	}
+#endif
+
+#ifdef WEBSOCKET_EPOLL
+	/**
+	 * one producer sending to every subscriber of a topic through WebSocketServer::broadcast, compared to calling
+	 * WebSocket::send for each of them. reports messages delivered to clients per second, a single thread drains
+	 * all client sockets. like connectionScaling it is bound by the fd limit, see subscribers_open.
+	 */
+	static string fanOut(size_t subscribers = 10000, size_t messageSize = 128, size_t messages = 200,
+						 size_t loopThreads = 0) {
+		uint64_t fdLimit = bench::raiseFdLimit();
+
+		WebSocketServer server(0, INADDR_LOOPBACK);
+		server.onConnection([&](WebSocket& ws) { server.subscribe(ws, "bench"); });
+		uint16_t port = bench::boundPort(server.socketPtr);
+
+		std::thread serverThread([&]() { server.runEventLoop(loopThreads); });
+		while(!server.running) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		// a few fds stay free for the drain thread's epoll instance
+		vector<RawClient> clients;
+		while(clients.size() < subscribers && clients.size() + 16 < fdLimit / 2) {
+			RawClient client;
+			if(!client.open(port, clients.size())) {
+				client.close();
+				break;
+			}
+			clients.push_back(client);
+		}
+		while(server.subscriberCount("bench") < clients.size()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		int drainFd = epoll_create1(0);
+		for(auto& client : clients) {
+			fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL, 0) | O_NONBLOCK);
+			epoll_event event = {0};
+			event.events = EPOLLIN;
+			event.data.fd = client.fd;
+			epoll_ctl(drainFd, EPOLL_CTL_ADD, client.fd, &event);
+		}
+
+		vector<uint8_t> payload(messageSize, 'x');
+		uint8_t header[WebSocket::MAX_HEADER_SIZE];
+		uint64_t frameSize = WebSocket::encodeHeader(header, true, WebSocket::Binary, messageSize, 0) + messageSize;
+
+		bench::Json report;
+		report.beginObject();
+		report.field("subscribers", subscribers);
+		report.field("subscribers_open", clients.size());
+		report.field("message_bytes", messageSize);
+		report.key("fan_out").beginArray();
+
+		for(bool shared : {true, false}) {
+			uint64_t expected = frameSize * messages * clients.size();
+			std::atomic<bool> complete = false;
+
+			std::thread drain([&]() {
+				vector<uint8_t> buffer(64 * 1024);
+				epoll_event events[256];
+				uint64_t received = 0;
+				uint64_t deadline = bench::nowNs() + 60ull * 1000 * 1000 * 1000;
+				while(received < expected && bench::nowNs() < deadline) {
+					int count = epoll_wait(drainFd, events, 256, 100);
+					for(int i = 0; i < count; i++) {
+						long bytes;
+						while((bytes = recv(events[i].data.fd, buffer.data(), buffer.size(), 0)) > 0) received += bytes;
+					}
+				}
+				complete = received >= expected;
+			});
+
+			uint64_t start = bench::nowNs();
+			if(shared) {
+				for(size_t i = 0; i < messages; i++) server.broadcast("bench", payload);
+			} else {
+				WebSocketServer::Subscribers targets;
+				{
+					lock_guard<mutex> lock(server.clientsLock);
+					targets = server.topics["bench"].members;
+				}
+				for(size_t i = 0; i < messages; i++) {
+					for(auto& target : targets) target->send(payload);
+				}
+			}
+			uint64_t producerNs = bench::nowNs() - start;
+			drain.join();
+			double seconds = (bench::nowNs() - start) / 1e9;
+
+			report.beginObject();
+			report.field("mode", shared ? "broadcast" : "send_per_client");
+			report.field("complete", complete.load());
+			report.field("delivered_msgs_s", messages * clients.size() / seconds);
+			report.field("producer_ns_per_message", (double)producerNs / messages);
+			report.endObject();
+		}
+
+		report.endArray().endObject();
+
+		::close(drainFd);
+		for(auto& client : clients) client.close();
+		server.stop();
+		serverThread.join();
+
+		return report.str();
+	}
+#endif
+
+#ifdef WEBSOCKET_EPOLL
+	/**
+	 * streams a message larger than the send queue limit to a client that does not read for a while, once from a
+	 * thread of its own and once from the connection handler on the event loop. the thread has to wait for room,
+	 * the handler has to lose the connection, and either way the queue must stay within maxBytes - throws if it
+	 * does not. reports the queue peak and what reached the client once it reads.
+	 */
+	static string slowConsumer(size_t messageBytes = 64 * 1024 * 1024, size_t maxBytes = 1024 * 1024) {
+		const size_t fragmentSize = 64 * 1024;
+		messageBytes -= messageBytes % fragmentSize;
+
+		SendQueueOptions options;
+		options.maxBytes = maxBytes;
+		options.highWaterMark = maxBytes / 2;
+		options.lowWaterMark = maxBytes / 4;
+
+		// the last fragment carries fin, every frame has the header of a 64 KiB payload
+		uint8_t header[WebSocket::MAX_HEADER_SIZE];
+		uint64_t frameHeader = WebSocket::encodeHeader(header, true, WebSocket::Binary, fragmentSize, 0);
+		uint64_t expected = messageBytes + messageBytes / fragmentSize * frameHeader;
+
+		bench::Json report;
+		report.beginObject();
+		report.field("message_bytes", messageBytes);
+		report.field("max_bytes", maxBytes);
+		report.key("slow_consumer").beginArray();
+
+		for(bool onLoop : {false, true}) {
+			WebSocketServer server(0, INADDR_LOOPBACK);
+			server.setSendQueue(options);
+
+			std::atomic<bool> finished = false;
+			std::atomic<bool> writerClosed = false;
+			std::atomic<size_t> peak = 0;
+			std::thread writer;
+			auto stream = [&](WebSocket& ws) {
+				vector<uint8_t> chunk(fragmentSize, 'x');
+				try {
+					auto message = ws.beginMessage(true, fragmentSize);
+					for(size_t sent = 0; sent < messageBytes; sent += chunk.size()) message.write(chunk);
+					message.finish();
+				} catch(TCPSocket::CloseException&) { writerClosed = true; }
+				peak = ws.sendQueueStats().peakBytes;
+				finished = true;
+			};
+			server.onConnection([&](WebSocket& ws) {
+				if(onLoop) stream(ws);
+				else
+					writer = std::thread(stream, std::ref(ws));
+			});
+
+			uint16_t port = bench::boundPort(server.socketPtr);
+
+			std::thread serverThread([&]() { server.runEventLoop(1); });
+			while(!server.running) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+			RawClient client;
+			bool opened = client.open(port, 0);
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
+			bool waited = !finished;
+
+			uint64_t start = bench::nowNs();
+			uint64_t received = 0;
+			vector<uint8_t> buffer(256 * 1024);
+			while(opened && received < expected) {
+				long bytes = recv(client.fd, buffer.data(), buffer.size(), 0);
+				if(bytes <= 0) break;
+				received += bytes;
+			}
+			double seconds = (bench::nowNs() - start) / 1e9;
+
+			if(writer.joinable()) writer.join();
+			client.close();
+			server.stop();
+			serverThread.join();
+
+			string mode = onLoop ? "loop_handler" : "writer_thread";
+			if(!opened) throw std::runtime_error("slow consumer " + mode + " failed to connect");
+			if(peak > std::max<size_t>(maxBytes, fragmentSize + WebSocket::MAX_HEADER_SIZE))
+				throw std::runtime_error("slow consumer " + mode + " queued " + std::to_string(peak) + " bytes");
+			if(onLoop ? !writerClosed : (!waited || writerClosed || received != expected))
+				throw std::runtime_error("slow consumer " + mode + " did not " + (onLoop ? "drop" : "wait for") +
+										 " the client");
+
+			report.beginObject();
+			report.field("mode", mode);
+			report.field("peak_queue_bytes", (uint64_t)peak);
+			report.field("writer_waited", waited);
+			report.field("connection_dropped", (bool)writerClosed);
+			report.field("received_bytes", received);
+			report.field("drain_mb_s", received / 1e6 / std::max(seconds, 1e-9));
+			report.endObject();
+		}
+
+		report.endArray().endObject();
+		return report.str();
+	}
+#endif
+
+	// market data style json messages, used when no corpus of real traffic is given
+	static vector<string> jsonCorpus(size_t count = 10000) {
+		const char* symbols[] = {"AAPL", "MSFT", "GOOG", "AMZN", "NVDA", "TSLA", "META", "BRK.B"};
+		vector<string> corpus;
+		std::mt19937 random(42); // same corpus every run, without touching the process wide rand()
+		for(size_t i = 0; i < count; i++) {
+			char message[512];
+			snprintf(message, sizeof(message),
+					 "{\"type\":\"trade\",\"seq\":%zu,\"symbol\":\"%s\",\"price\":%d.%02d,\"size\":%d,\"side\":\"%s\","
+					 "\"venue\":\"XNAS\",\"ts\":\"2024-01-02T14:30:%02d.%06dZ\",\"conditions\":[\"@\",\"T\"]}",
+					 i, symbols[random() % 8], 100 + (int)(random() % 400), (int)(random() % 100),
+					 (int)(random() % 50 + 1) * 100, random() % 2 ? "buy" : "sell", (int)(random() % 60),
+					 (int)(random() % 1000000));
+			corpus.push_back(message);
+		}
+		return corpus;
+	}
+
+#ifdef WEBSOCKET_DEFLATE
+	// permessage-deflate ratio and cpu per message over a json corpus, with and without context takeover
+	static string deflate() { return deflate(jsonCorpus()); }
+
+	static string deflate(const vector<string>& corpus) {
+		bench::Json report;
+		report.beginObject().key("deflate").beginArray();
+
+		for(bool contextTakeover : {true, false}) {
+			DeflateOptions options;
+			options.threshold = 0;
+
+			PerMessageDeflate sender(options, 15, !contextTakeover, !contextTakeover);
+			PerMessageDeflate receiver(options, 15, !contextTakeover, !contextTakeover);
+
+			vector<uint8_t> compressed;
+			size_t inflated = 0;
+			for(auto& message : corpus) {
+				sender.compress((const uint8_t*)message.data(), message.size(), compressed);
+				receiver.decompress(compressed.data(), compressed.size(), true,
+									[&](const uint8_t*, size_t length) { inflated += length; });
+			}
+
+			DeflateStats& out = sender.stats;
+			DeflateStats& in = receiver.stats;
+
+			report.beginObject();
+			report.field("context_takeover", contextTakeover);
+			report.field("messages", (uint64_t)corpus.size());
+			report.field("bytes", out.bytesBeforeCompression);
+			report.field("ratio", out.ratio());
+			report.field("compress_ns_per_msg", (double)out.compressNs / corpus.size());
+			report.field("compress_mb_s", out.bytesBeforeCompression / 1e6 / (out.compressNs / 1e9));
+			report.field("inflate_ns_per_msg", (double)in.inflateNs / corpus.size());
+			report.field("inflate_mb_s", in.bytesAfterInflate / 1e6 / (in.inflateNs / 1e9));
+			report.field("roundtrip_ok", inflated == out.bytesBeforeCompression);
+			report.endObject();
+		}
+
+		report.endArray().endObject();
+		return report.str();
+	}
+#endif
+};
+
+#endif
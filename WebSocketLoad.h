@@ -0,0 +1,495 @@
+#ifndef WEB_SOCKET_LOAD_H_
+#define WEB_SOCKET_LOAD_H_
+
+#include "Websocket.h"
+#include "Bench.h"
+
+#ifdef WEBSOCKET_EPOLL
+#include <queue>
+
+/**
+ * load generator for websocket echo servers, built on the library's own client. connections are split over a few
+ * threads and each thread drives its share from one epoll loop, like the server's event loop does.
+ *
+ * every message carries the time it was meant to go out in its first 8 bytes, the echo brings it back and the
+ * difference is the end to end latency. closed loop keeps inFlight messages outstanding per connection and sends
+ * the next one when a reply comes in. open loop sends on a fixed schedule no matter how the server keeps up, late
+ * sends are measured from their scheduled time so a stalled server shows up in the latency instead of hiding in a
+ * lower send rate. loops spin while a send is due within the next millisecond.
+ *
+ * replay() sends the frames of a FrameCapture instead, with their recorded sizes and timing.
+ *
+ * without a url an event loop echo server is started on loopback in this process, it shares the cpus with the load.
+ */
+class WebSocketLoad {
+  public:
+	struct Options {
+		string url;				  // ws:// url of an echo server, empty for one in this process
+		size_t connections = 100;
+		size_t threads = 1;		  // client loops
+		size_t messageSize = 64;  // payload bytes, at least the 8 byte timestamp
+		double rate = 0;		  // messages per second over all connections, 0 for closed loop
+		size_t inFlight = 1;	  // closed loop: outstanding messages per connection
+		uint32_t warmupMs = 1000; // traffic that is not measured
+		uint32_t durationMs = 5000;
+		size_t serverThreads = 1; // loops of the in process server
+	};
+
+	struct ReplayOptions {
+		string path;			  // capture file
+		string url;				  // server to replay against, empty for an echo server in this process
+		double speed = 1;		  // 1 keeps the recorded timing, 2 is twice as fast, 0 sends as fast as possible
+		bool outbound = false;	  // replay what the recording side sent, for captures taken on clients
+		size_t threads = 1;		  // client loops
+		uint32_t drainMs = 1000;  // how long replies are still collected after the last frame went out
+		size_t serverThreads = 1; // loops of the in process server
+	};
+
+  private:
+	struct Connection {
+		std::unique_ptr<WebSocket> socket; // null if it failed to connect
+		uint64_t intervalNs = 0;		   // open loop
+	};
+
+	// everything one client loop owns, only the final counters are read by other threads
+	struct Worker {
+		vector<Connection> connections;
+		unordered_map<int, WebSocket*> sockets; // the ones still open by fd
+		vector<uint8_t> payload;
+		bench::Histogram latency;
+		bench::Histogram sendLag; // how late scheduled sends went out
+		uint64_t sent = 0;
+		uint64_t received = 0;
+		uint64_t sentBytes = 0;
+		uint64_t receivedBytes = 0;
+		uint64_t connectFailures = 0;
+		uint64_t connectionsLost = 0;
+		uint64_t doneNs = 0; // replay: when the last frame went out
+		SendQueueStats queueStats;
+	};
+
+	// start of warmup, start and end of the measurement, set once every worker is connected
+	struct Clock {
+		std::atomic<size_t> ready = 0;
+		std::atomic<bool> started = false;
+		uint64_t startNs = 0;
+		uint64_t measureNs = 0;
+		uint64_t endNs = 0;
+	};
+
+	// event loop echo server on loopback for runs without a url
+	struct EchoServer {
+		WebSocketServer server = WebSocketServer(0, INADDR_LOOPBACK);
+		std::thread loop;
+		string url;
+
+		EchoServer(size_t threads) {
+			server.onConnection([](WebSocket& ws) {
+				ws.onMessage([&ws](vector<uint8_t>& message, bool binary) { ws.send(message, binary); });
+			});
+
+			url = "ws://127.0.0.1:" + std::to_string(bench::boundPort(server.socketPtr)) + "/";
+
+			loop = std::thread([this, threads]() { server.runEventLoop(threads); });
+			while(!server.running) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		~EchoServer() {
+			server.stop();
+			loop.join();
+		}
+	};
+
+	static bool measured(const Clock& clock, uint64_t stamp) { return stamp >= clock.measureNs && stamp < clock.endNs; }
+
+	// connects connection and hands it to the loop of worker, counts a failure and leaves it null if that fails
+	static void attach(Worker& worker, Connection& connection, const string& url, int epollFd) {
+		WebSocket& socket = *connection.socket;
+		try {
+			socket.open(url, DeflateOptions());
+		} catch(...) {
+			worker.connectFailures++;
+			connection.socket.reset();
+			return;
+		}
+
+		socket.sock.setBlocking(false);
+		socket.epollFd = epollFd;
+		socket.watching = EPOLLIN | EPOLLRDHUP;
+
+		epoll_event event = {0};
+		event.events = socket.watching;
+		event.data.fd = socket.sock.getFd();
+		if(epoll_ctl(epollFd, EPOLL_CTL_ADD, socket.sock.getFd(), &event) < 0) {
+			worker.connectFailures++;
+			connection.socket.reset();
+			return;
+		}
+		worker.sockets[socket.sock.getFd()] = &socket;
+	}
+
+	// reads until the socket runs dry, false once the connection is gone
+	static bool readable(WebSocket& socket, vector<uint8_t>& buffer) {
+		try {
+			while(!socket.closed) {
+				long received = socket.sock.tryReceive(buffer.data(), buffer.size());
+				if(received == 0) return true;
+				if(!socket.process(buffer.data(), received)) return false;
+			}
+		} catch(...) { socket.terminate(); }
+		return false;
+	}
+
+	// waits up to timeout ms for the sockets of worker and handles what they report
+	static void poll(Worker& worker, int epollFd, int timeout, vector<uint8_t>& buffer) {
+		epoll_event events[256];
+		int count = epoll_wait(epollFd, events, 256, timeout);
+
+		for(int i = 0; i < count; i++) {
+			auto it = worker.sockets.find(events[i].data.fd);
+			if(it == worker.sockets.end()) continue;
+			WebSocket& socket = *it->second;
+
+			bool alive = true;
+			try {
+				if(events[i].events & EPOLLOUT) socket.writeQueued();
+			} catch(...) { socket.terminate(); }
+			if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) alive = readable(socket, buffer);
+
+			if(!alive || socket.closed) {
+				worker.connectionsLost++;
+				epoll_ctl(epollFd, EPOLL_CTL_DEL, it->first, 0);
+				worker.sockets.erase(it);
+			}
+		}
+	}
+
+	// closes what is still open, queued frames get one more chance to go out
+	static void finish(Worker& worker, int epollFd) {
+		for(auto& connection : worker.connections) {
+			if(!connection.socket) continue;
+			WebSocket& socket = *connection.socket;
+			worker.queueStats += socket.sendQueueStats();
+			if(!socket.closed) {
+				socket.close();
+				try {
+					socket.writeQueued();
+				} catch(...) {}
+			}
+			socket.sock.disconnect();
+		}
+		::close(epollFd);
+	}
+
+	static void waitForStart(Clock& clock) {
+		clock.ready++;
+		while(!clock.started) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	static void send(Worker& worker, const Clock& clock, WebSocket& socket, uint64_t stamp) {
+		memcpy(worker.payload.data(), &stamp, sizeof(stamp));
+		socket.send(worker.payload);
+		if(measured(clock, stamp)) worker.sent++;
+	}
+
+	static void work(Worker& worker, Clock& clock, const Options& options, size_t first, size_t step) {
+		int epollFd = epoll_create1(0);
+		worker.payload.assign(std::max<size_t>(options.messageSize, sizeof(uint64_t)), 'x');
+
+		for(size_t i = first; i < options.connections; i += step) {
+			Connection connection;
+			connection.socket.reset(new WebSocket());
+			WebSocket& socket = *connection.socket;
+			socket.onMessage([&worker, &clock, &options, &socket](vector<uint8_t>& message, bool) {
+				if(message.size() < sizeof(uint64_t)) return;
+				uint64_t now = bench::nowNs();
+				uint64_t stamp;
+				memcpy(&stamp, message.data(), sizeof(stamp));
+
+				if(measured(clock, stamp)) {
+					worker.latency.record(now - stamp);
+					worker.received++;
+				}
+				if(options.rate == 0 && now < clock.endNs) send(worker, clock, socket, now);
+			});
+
+			attach(worker, connection, options.url, epollFd);
+			if(!connection.socket) continue;
+			// open loop connections are staggered evenly over one interval
+			if(options.rate > 0) connection.intervalNs = (uint64_t)(options.connections / options.rate * 1e9);
+			worker.connections.push_back(std::move(connection));
+		}
+
+		waitForStart(clock);
+
+		// open loop schedule as (due, connection) with the earliest on top
+		typedef std::pair<uint64_t, size_t> Due;
+		std::priority_queue<Due, vector<Due>, std::greater<Due>> schedule;
+		for(size_t i = 0; i < worker.connections.size(); i++) {
+			Connection& connection = worker.connections[i];
+			if(options.rate > 0) {
+				size_t global = first + i * step;
+				schedule.push({clock.startNs + connection.intervalNs * global / options.connections, i});
+			} else {
+				for(size_t k = 0; k < options.inFlight; k++) send(worker, clock, *connection.socket, bench::nowNs());
+			}
+		}
+
+		vector<uint8_t> buffer(64 * 1024);
+
+		while(1) {
+			uint64_t now = bench::nowNs();
+			if(now >= clock.endNs) break;
+
+			while(!schedule.empty() && schedule.top().first <= now) {
+				Due due = schedule.top();
+				schedule.pop();
+				Connection& connection = worker.connections[due.second];
+				if(connection.socket->closed) continue;
+
+				if(measured(clock, due.first)) worker.sendLag.record(now - due.first);
+				send(worker, clock, *connection.socket, due.first);
+				schedule.push({due.first + connection.intervalNs, due.second});
+			}
+
+			uint64_t wakeNs = schedule.empty() ? clock.endNs : std::min(clock.endNs, schedule.top().first);
+			poll(worker, epollFd, (int)std::min<uint64_t>((wakeNs - std::min(wakeNs, now)) / 1000000, 100), buffer);
+		}
+
+		finish(worker, epollFd);
+	}
+
+	typedef std::pair<size_t, FrameCapture::Record> Replayed; // connection of the worker, frame
+
+	/**
+	 * sends frames in capture order, each when its recorded time (scaled by speed) comes up. a connection whose
+	 * queue is backpressured holds back everything behind it so the order stays intact, the delay shows up in the
+	 * send lag.
+	 */
+	static void replayWork(Worker& worker, Clock& clock, const ReplayOptions& options, size_t connections,
+						   const vector<Replayed>& frames, uint64_t firstNs) {
+		int epollFd = epoll_create1(0);
+
+		worker.connections.resize(connections);
+		for(auto& connection : worker.connections) {
+			connection.socket.reset(new WebSocket());
+			connection.socket->onMessage([&worker](vector<uint8_t>& message, bool) {
+				worker.received++;
+				worker.receivedBytes += message.size();
+			});
+			attach(worker, connection, options.url, epollFd);
+		}
+
+		// stands in for payloads the capture did not keep
+		size_t longest = 0;
+		for(auto& frame : frames)
+			if(!frame.second.payload) longest = std::max<size_t>(longest, frame.second.length);
+		worker.payload.assign(longest, 'x');
+
+		waitForStart(clock);
+
+		vector<uint8_t> buffer(64 * 1024);
+		size_t next = 0;
+		worker.doneNs = frames.empty() ? clock.startNs : 0;
+
+		while(1) {
+			uint64_t now = bench::nowNs();
+			uint64_t due = now;
+			bool held = false;
+
+			while(next < frames.size()) {
+				const FrameCapture::Record& record = frames[next].second;
+				if(options.speed > 0) due = clock.startNs + (uint64_t)((record.timeNs - firstNs) / options.speed);
+				if(due > now) break;
+
+				WebSocket* socket = worker.connections[frames[next].first].socket.get();
+				if(socket && !socket->closed) {
+					if((held = socket->isBackpressured())) break;
+					if(options.speed > 0) worker.sendLag.record(now - due);
+					const uint8_t* payload = record.payload ? record.payload : worker.payload.data();
+					// compressed bytes are no utf-8, as text they would get the connection closed with 1007
+					WebSocket::Opcode opcode = (WebSocket::Opcode)record.opcode();
+					if(opcode == WebSocket::Text && record.compressed()) opcode = WebSocket::Binary;
+					socket->sendFrame(opcode, payload, record.length, record.fin());
+					worker.sent++;
+					worker.sentBytes += record.length;
+				}
+				if(++next == frames.size()) worker.doneNs = bench::nowNs();
+			}
+
+			if(worker.doneNs && now >= worker.doneNs + options.drainMs * 1000000ull) break;
+
+			// a held back frame waits for its connection to drain, which EPOLLOUT on its queued socket reports
+			uint64_t wakeNs = next < frames.size() ? due : worker.doneNs + options.drainMs * 1000000ull;
+			int timeout = held ? 100 : (int)std::min<uint64_t>((wakeNs - std::min(wakeNs, now)) / 1000000, 100);
+			poll(worker, epollFd, timeout, buffer);
+		}
+
+		finish(worker, epollFd);
+	}
+
+  public:
+	static string run() { return run(Options()); }
+
+	static string run(Options options) {
+		if(options.connections == 0 || options.threads == 0) throw runtime_error("load needs connections and threads");
+		options.threads = std::min(options.threads, options.connections);
+		bench::raiseFdLimit();
+
+		std::unique_ptr<EchoServer> server;
+		if(options.url.empty()) {
+			server.reset(new EchoServer(options.serverThreads));
+			options.url = server->url;
+		}
+
+		Clock clock;
+		vector<Worker> workers(options.threads);
+		vector<std::thread> threads;
+		for(size_t t = 0; t < options.threads; t++)
+			threads.emplace_back([&, t]() { work(workers[t], clock, options, t, options.threads); });
+
+		uint64_t connectStart = bench::nowNs();
+		while(clock.ready < options.threads) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		double connectSeconds = (bench::nowNs() - connectStart) / 1e9;
+
+		clock.startNs = bench::nowNs();
+		clock.measureNs = clock.startNs + options.warmupMs * 1000000ull;
+		clock.endNs = clock.measureNs + options.durationMs * 1000000ull;
+		clock.started = true;
+		for(auto& worker : threads) worker.join();
+		server.reset();
+
+		Worker total;
+		size_t open = 0;
+		for(auto& worker : workers) {
+			open += worker.connections.size();
+			total.latency.merge(worker.latency);
+			total.sendLag.merge(worker.sendLag);
+			total.sent += worker.sent;
+			total.received += worker.received;
+			total.connectFailures += worker.connectFailures;
+			total.connectionsLost += worker.connectionsLost;
+			total.queueStats += worker.queueStats;
+		}
+
+		double seconds = options.durationMs / 1000.0;
+		size_t messageSize = std::max<size_t>(options.messageSize, sizeof(uint64_t));
+
+		bench::Json report;
+		report.beginObject();
+		report.field("url", options.url);
+		report.field("mode", options.rate > 0 ? "open_loop" : "closed_loop");
+		report.field("connections", options.connections);
+		report.field("connections_open", open);
+		report.field("connect_failures", total.connectFailures);
+		report.field("connections_lost", total.connectionsLost);
+		report.field("connects_per_sec", open / std::max(connectSeconds, 1e-9));
+		report.field("threads", options.threads);
+		report.field("message_size", messageSize);
+		if(options.rate > 0) report.field("target_msgs_s", options.rate);
+		else
+			report.field("in_flight", options.inFlight);
+		report.field("duration_s", seconds);
+		report.field("sent", total.sent);
+		report.field("received", total.received);
+		report.field("msgs_s", total.received / seconds);
+		report.field("mb_s", total.received * messageSize / seconds / 1e6);
+		report.field("latency_ns", total.latency);
+		if(options.rate > 0) report.field("send_lag_ns", total.sendLag);
+		report.field("dropped_frames", total.queueStats.droppedFrames);
+		report.field("send_queue_peak_bytes", total.queueStats.peakBytes);
+		report.endObject();
+
+		return report.str();
+	}
+
+	/**
+	 * replays the data frames one side of a capture received (or sent, see ReplayOptions::outbound). every recorded
+	 * connection gets a connection of its own, all of them are opened before the first frame goes out. payloads the
+	 * capture did not keep are filled with 'x'. compressed frames go out uncompressed with their compressed size,
+	 * the replaying connections do not negotiate permessage-deflate. compressed text messages go as binary ones.
+	 */
+	static string replay(ReplayOptions options) {
+		if(options.threads == 0 || options.speed < 0) throw runtime_error("replay needs threads and a speed >= 0");
+
+		FrameCapture::Reader reader(options.path);
+		unordered_map<uint32_t, size_t> connectionIndex; // recorded id to the order of first appearance
+		vector<vector<Replayed>> frames(options.threads);
+		uint64_t firstNs = 0, lastNs = 0;
+		size_t total = 0;
+
+		FrameCapture::Record record;
+		while(reader.next(record)) {
+			if(record.outbound() != options.outbound || record.opcode() > WebSocket::Binary) continue;
+			size_t index = connectionIndex.emplace(record.connection, connectionIndex.size()).first->second;
+			if(total++ == 0) firstNs = record.timeNs;
+			lastNs = record.timeNs;
+			frames[index % options.threads].push_back({index / options.threads, record});
+		}
+
+		size_t connections = connectionIndex.size();
+		options.threads = std::max<size_t>(1, std::min(options.threads, connections));
+		bench::raiseFdLimit();
+
+		std::unique_ptr<EchoServer> server;
+		if(options.url.empty()) {
+			server.reset(new EchoServer(options.serverThreads));
+			options.url = server->url;
+		}
+
+		Clock clock;
+		vector<Worker> workers(options.threads);
+		vector<std::thread> threads;
+		for(size_t t = 0; t < options.threads; t++) {
+			size_t owned = connections / options.threads + (t < connections % options.threads);
+			threads.emplace_back([&, t, owned]() { replayWork(workers[t], clock, options, owned, frames[t], firstNs); });
+		}
+
+		while(clock.ready < options.threads) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		clock.startNs = bench::nowNs();
+		clock.started = true;
+		for(auto& worker : threads) worker.join();
+		server.reset();
+
+		Worker sum;
+		uint64_t doneNs = clock.startNs;
+		for(auto& worker : workers) {
+			sum.sendLag.merge(worker.sendLag);
+			sum.sent += worker.sent;
+			sum.sentBytes += worker.sentBytes;
+			sum.received += worker.received;
+			sum.receivedBytes += worker.receivedBytes;
+			sum.connectFailures += worker.connectFailures;
+			sum.connectionsLost += worker.connectionsLost;
+			sum.queueStats += worker.queueStats;
+			doneNs = std::max(doneNs, worker.doneNs);
+		}
+		double seconds = std::max((doneNs - clock.startNs) / 1e9, 1e-9);
+
+		bench::Json report;
+		report.beginObject();
+		report.field("capture", options.path);
+		report.field("url", options.url);
+		report.field("speed", options.speed);
+		report.field("connections", connections);
+		report.field("connect_failures", sum.connectFailures);
+		report.field("connections_lost", sum.connectionsLost);
+		report.field("frames", total);
+		report.field("capture_duration_s", (lastNs - firstNs) / 1e9);
+		report.field("replay_duration_s", seconds);
+		report.field("sent", sum.sent);
+		report.field("sent_bytes", sum.sentBytes);
+		report.field("frames_s", sum.sent / seconds);
+		report.field("mb_s", sum.sentBytes / seconds / 1e6);
+		report.field("received", sum.received);
+		report.field("received_bytes", sum.receivedBytes);
+		if(options.speed > 0) report.field("send_lag_ns", sum.sendLag);
+		report.field("dropped_frames", sum.queueStats.droppedFrames);
+		report.endObject();
+
+		return report.str();
+	}
+};
+#endif
+
+#endif
@@ -2,19 +2,73 @@
 #define WEB_SOCKET_SERVER_H_
 
 #include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
 #include <vector>
 #include <string>
 #include <functional>
 #include <stdexcept>
 #include <thread>
 #include <list>
+#include <deque>
 #include <unordered_map>
+#include <map>
 #include <algorithm>
 #include <memory>
+#include <new>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <system_error>
+#include <string_view>
+#include <type_traits>
+
+#ifdef _WIN32
+#include <io.h>
+#include <bcrypt.h>
+#pragma comment(lib, "bcrypt.lib")
+#elif defined(__linux__)
+#include <sys/random.h>
+#include <pthread.h>
+#else
+#include <stdlib.h> // arc4random_buf
+#include <pthread.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define WEBSOCKET_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// lets the compiler emit instructions beyond the build's baseline for a single function
+#if defined(__GNUC__) || defined(__clang__)
+#define WEBSOCKET_TARGET(isa) __attribute__((target(isa)))
+#else
+#define WEBSOCKET_TARGET(isa)
+#endif
 
 #include "TCPSocket.h"
 
+// event loop server mode, see WebSocketServer::runEventLoop
+#ifdef __linux__
+#define WEBSOCKET_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+// frame capture to memory mapped files, see WebSocket::setCapture
+#ifndef _WIN32
+#define WEBSOCKET_CAPTURE
+#include "FrameCapture.h"
+#endif
+
 #define MAGIC_STRING "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 #define WEBSOCKET_SWITCH_PROTOCOLS \
 	"HTTP/1.1 101 Switching Protocols\r\n" \
@@ -27,45 +81,634 @@ using std::function, std::string, std::vector, std::runtime_error, std::thread,
 
 namespace util {
 
-static inline string b64_encode(const vector<uint8_t>& toEncode) {
-	const uint8_t base64_table[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+// monotonic clock for timers and measurements
+static inline uint64_t nowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+struct CpuFeatures {
+	bool sse2 = false;
+	bool ssse3 = false;
+	bool sse41 = false;
+	bool avx2 = false;
+	bool sha = false;
+};
+
+// detected once, every simd path in here is picked at runtime from these
+static inline const CpuFeatures& cpu() {
+	static CpuFeatures features = []() {
+		CpuFeatures f;
+#ifdef WEBSOCKET_X86
+		uint32_t leaf1[4] = {0}, leaf7[4] = {0};
+#ifdef _MSC_VER
+		__cpuid((int*)leaf1, 1);
+		__cpuidex((int*)leaf7, 7, 0);
+#else
+		__get_cpuid(1, &leaf1[0], &leaf1[1], &leaf1[2], &leaf1[3]);
+		__get_cpuid_count(7, 0, &leaf7[0], &leaf7[1], &leaf7[2], &leaf7[3]);
+#endif
+		f.sse2 = leaf1[3] & (1 << 26);
+		f.ssse3 = leaf1[2] & (1 << 9);
+		f.sse41 = leaf1[2] & (1 << 19);
+		f.sha = leaf7[1] & (1 << 29);
+
+		// avx2 also needs the os to save the ymm registers
+		bool osxsave = leaf1[2] & (1 << 27);
+		if(osxsave) {
+#ifdef _MSC_VER
+			uint64_t xcr0 = _xgetbv(0);
+#else
+			uint32_t eax, edx;
+			__asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			uint64_t xcr0 = ((uint64_t)edx << 32) | eax;
+#endif
+			f.avx2 = (xcr0 & 6) == 6 && (leaf7[1] & (1 << 5));
+		}
+#endif
+		return f;
+	}();
+	return features;
+}
+
+// key as it applies to a payload that starts at byte `offset` of the masked stream
+static inline uint32_t rotateMask(const uint8_t key[4], size_t offset) {
+	uint8_t rotated[4] = {key[offset & 3], key[(offset + 1) & 3], key[(offset + 2) & 3], key[(offset + 3) & 3]};
+	uint32_t word;
+	memcpy(&word, rotated, 4);
+	return word;
+}
+
+static inline void maskScalar(uint8_t* data, size_t length, const uint8_t key[4], size_t offset = 0) {
+	uint32_t key32 = rotateMask(key, offset);
+	uint64_t key64 = ((uint64_t)key32 << 32) | key32;
+
+	size_t i = 0;
+	for(; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		word ^= key64;
+		memcpy(data + i, &word, 8);
+	}
+
+	const uint8_t* keyBytes = (const uint8_t*)&key32;
+	for(; i < length; i++) data[i] ^= keyBytes[i & 3];
+}
+
+#ifdef WEBSOCKET_X86
+WEBSOCKET_TARGET("sse2")
+static inline void maskSSE2(uint8_t* data, size_t length, const uint8_t key[4], size_t offset = 0) {
+	uint32_t key32 = rotateMask(key, offset);
+	__m128i keyVec = _mm_set1_epi32((int)key32);
+
+	size_t i = 0;
+	for(; i + 16 <= length; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+		_mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(block, keyVec));
+	}
+
+	maskScalar(data + i, length - i, key, offset + i);
+}
+
+WEBSOCKET_TARGET("avx2")
+static inline void maskAVX2(uint8_t* data, size_t length, const uint8_t key[4], size_t offset = 0) {
+	uint32_t key32 = rotateMask(key, offset);
+	__m256i keyVec = _mm256_set1_epi32((int)key32);
+
+	size_t i = 0;
+	for(; i + 64 <= length; i += 64) {
+		__m256i first = _mm256_loadu_si256((const __m256i*)(data + i));
+		__m256i second = _mm256_loadu_si256((const __m256i*)(data + i + 32));
+		_mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(first, keyVec));
+		_mm256_storeu_si256((__m256i*)(data + i + 32), _mm256_xor_si256(second, keyVec));
+	}
+
+	maskSSE2(data + i, length - i, key, offset + i);
+}
+#endif
+
+/**
+ * xors data in place with the 4 byte websocket masking key. offset is the position of data[0] within the frame
+ * payload, so a payload can be (un)masked in chunks.
+ */
+static inline void mask(uint8_t* data, size_t length, const uint8_t key[4], size_t offset = 0) {
+#ifdef WEBSOCKET_X86
+	static auto kernel = cpu().avx2 ? maskAVX2 : cpu().sse2 ? maskSSE2 : maskScalar;
+	if(length >= 16) return kernel(data, length, key, offset);
+#endif
+	maskScalar(data, length, key, offset);
+}
+
+/**
+ * incremental utf-8 validation for text messages, update() can be fed arbitrary pieces of a message.
+ * characters split between pieces are tracked by a small scalar state machine, everything in between goes through
+ * the lookup based simd check from Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+ */
+class Utf8Validator {
+	// continuation bytes still expected and the allowed range of the next one
+	uint8_t need = 0;
+	uint8_t lo = 0x80;
+	uint8_t hi = 0xBF;
+	bool valid = true;
+
+	bool scalar(const uint8_t* data, size_t length) {
+		for(size_t i = 0; i < length; i++) {
+			uint8_t b = data[i];
+			if(need) {
+				if(b < lo || b > hi) return false;
+				need--;
+				lo = 0x80;
+				hi = 0xBF;
+				continue;
+			}
+
+			if(b < 0x80) continue;
+			else if(b >= 0xC2 && b <= 0xDF)
+				need = 1;
+			else if(b == 0xE0) {
+				need = 2;
+				lo = 0xA0; // overlong
+			} else if(b == 0xED) {
+				need = 2;
+				hi = 0x9F; // surrogates
+			} else if(b >= 0xE1 && b <= 0xEF)
+				need = 2;
+			else if(b == 0xF0) {
+				need = 3;
+				lo = 0x90; // overlong
+			} else if(b >= 0xF1 && b <= 0xF3)
+				need = 3;
+			else if(b == 0xF4) {
+				need = 3;
+				hi = 0x8F; // above U+10FFFF
+			} else
+				return false;
+		}
+		return true;
+	}
+
+	// length of data that only holds complete characters, judged by the last three bytes
+	static size_t completePrefix(const uint8_t* data, size_t length) {
+		for(size_t i = 1; i <= 3 && i <= length; i++) {
+			uint8_t b = data[length - i];
+			if(b < 0x80) break;
+			if(b < 0xC0) continue; // continuation byte
+
+			size_t charLength = b >= 0xF0 ? 4 : b >= 0xE0 ? 3 : 2;
+			if(i < charLength) return length - i;
+			break;
+		}
+		return length;
+	}
+
+#ifdef WEBSOCKET_X86
+	enum : uint8_t {
+		TOO_SHORT = 1 << 0,
+		TOO_LONG = 1 << 1,
+		OVERLONG_3 = 1 << 2,
+		TOO_LARGE = 1 << 3,
+		SURROGATE = 1 << 4,
+		OVERLONG_2 = 1 << 5,
+		TOO_LARGE_1000 = 1 << 6,
+		OVERLONG_4 = 1 << 6,
+		TWO_CONTS = 1 << 7,
+		CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS,
+	};
+
+	// lookup tables indexed by high nibble of the previous byte, its low nibble and the high nibble of the current one
+	static inline const uint8_t byte1High[16] = {
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, // ascii
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,										// continuation
+		TOO_SHORT | OVERLONG_2,															// 1100____
+		TOO_SHORT,																		// 1101____
+		TOO_SHORT | OVERLONG_3 | SURROGATE,												// 1110____
+		TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,							// 1111____
+	};
+
+	static inline const uint8_t byte1Low[16] = {
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+		CARRY | OVERLONG_2,
+		CARRY,
+		CARRY,
+		CARRY | TOO_LARGE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+	};
+
+	static inline const uint8_t byte2High[16] = {
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, // 1000____
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,					// 1001____
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,					// 1010____
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,					// 1011____
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+	};
+
+	// the last three bytes of a block must not start a character that runs past it
+	static inline const uint8_t maxValue[32] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf,
+	};
+#endif
+
+  public:
+#ifdef WEBSOCKET_X86
+	// validates data that starts and ends on character boundaries
+	WEBSOCKET_TARGET("ssse3,sse4.1")
+	static bool validateSSE41(const uint8_t* data, size_t length) {
+		const __m128i table1High = _mm_loadu_si128((const __m128i*)byte1High);
+		const __m128i table1Low = _mm_loadu_si128((const __m128i*)byte1Low);
+		const __m128i table2High = _mm_loadu_si128((const __m128i*)byte2High);
+		const __m128i nibble = _mm_set1_epi8(0x0f);
+		const __m128i max = _mm_loadu_si128((const __m128i*)(maxValue + 16));
+
+		__m128i error = _mm_setzero_si128();
+		__m128i previous = _mm_setzero_si128();
+		__m128i incomplete = _mm_setzero_si128();
+
+		for(size_t i = 0; i < length; i += 16) {
+			__m128i input;
+			if(i + 16 <= length) input = _mm_loadu_si128((const __m128i*)(data + i));
+			else {
+				uint8_t padded[16] = {0};
+				memcpy(padded, data + i, length - i);
+				input = _mm_loadu_si128((const __m128i*)padded);
+			}
+
+			if(_mm_movemask_epi8(input) == 0) {
+				error = _mm_or_si128(error, incomplete);
+				previous = input;
+				continue;
+			}
+
+			__m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+			__m128i b1High = _mm_shuffle_epi8(table1High, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+			__m128i b1Low = _mm_shuffle_epi8(table1Low, _mm_and_si128(prev1, nibble));
+			__m128i b2High = _mm_shuffle_epi8(table2High, _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+			__m128i special = _mm_and_si128(_mm_and_si128(b1High, b1Low), b2High);
+
+			__m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+			__m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+			__m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80)));
+			__m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80)));
+			__m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+
+			error = _mm_or_si128(error, _mm_xor_si128(must23, special));
+			incomplete = _mm_subs_epu8(input, max);
+			previous = input;
+		}
+
+		error = _mm_or_si128(error, incomplete);
+		return _mm_testz_si128(error, error);
+	}
+
+	WEBSOCKET_TARGET("avx2")
+	static bool validateAVX2(const uint8_t* data, size_t length) {
+		const __m256i table1High = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)byte1High));
+		const __m256i table1Low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)byte1Low));
+		const __m256i table2High = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)byte2High));
+		const __m256i nibble = _mm256_set1_epi8(0x0f);
+		const __m256i max = _mm256_loadu_si256((const __m256i*)maxValue);
+
+		__m256i error = _mm256_setzero_si256();
+		__m256i previous = _mm256_setzero_si256();
+		__m256i incomplete = _mm256_setzero_si256();
+
+		for(size_t i = 0; i < length; i += 32) {
+			__m256i input;
+			if(i + 32 <= length) input = _mm256_loadu_si256((const __m256i*)(data + i));
+			else {
+				uint8_t padded[32] = {0};
+				memcpy(padded, data + i, length - i);
+				input = _mm256_loadu_si256((const __m256i*)padded);
+			}
+
+			if(_mm256_movemask_epi8(input) == 0) {
+				error = _mm256_or_si256(error, incomplete);
+				previous = input;
+				continue;
+			}
+
+			// bytes shifted in from the previous block
+			__m256i carried = _mm256_permute2x128_si256(previous, input, 0x21);
+			__m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+			__m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+			__m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+
+			__m256i b1High = _mm256_shuffle_epi8(table1High, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+			__m256i b1Low = _mm256_shuffle_epi8(table1Low, _mm256_and_si256(prev1, nibble));
+			__m256i b2High = _mm256_shuffle_epi8(table2High, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+			__m256i special = _mm256_and_si256(_mm256_and_si256(b1High, b1Low), b2High);
+
+			__m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80)));
+			__m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80)));
+			__m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+
+			error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+			incomplete = _mm256_subs_epu8(input, max);
+			previous = input;
+		}
+
+		error = _mm256_or_si256(error, incomplete);
+		return _mm256_testz_si256(error, error);
+	}
+#endif
+
+	static bool validateScalar(const uint8_t* data, size_t length) {
+		Utf8Validator validator;
+		return validator.scalar(data, length) && validator.need == 0;
+	}
+
+	// one shot check of a complete message
+	static bool validate(const uint8_t* data, size_t length) {
+		Utf8Validator validator;
+		return validator.update(data, length) && validator.finish();
+	}
+
+	// checks the next piece of a message, stays false once anything invalid was seen
+	bool update(const uint8_t* data, size_t length) {
+		if(!valid) return false;
 
-	size_t outLen = toEncode.size() * 4 / 3 + 4;
+		// finish a character left open by the previous piece
+		size_t start = 0;
+		while(need && start < length) {
+			if(!scalar(data + start, 1)) return valid = false;
+			start++;
+		}
+
+		size_t end = start + completePrefix(data + start, length - start);
+
+#ifdef WEBSOCKET_X86
+		static auto region = cpu().avx2 ? validateAVX2 : cpu().sse41 && cpu().ssse3 ? validateSSE41 : validateScalar;
+		if(end - start >= 16) {
+			if(!region(data + start, end - start)) return valid = false;
+		} else
+#endif
+			if(!validateScalar(data + start, end - start))
+			return valid = false;
+
+		// an incomplete character at the end is carried into the next piece
+		if(!scalar(data + end, length - end)) return valid = false;
+		return true;
+	}
+
+	// true if the message was valid and did not stop in the middle of a character, resets for the next one
+	bool finish() {
+		bool complete = valid && need == 0;
+		*this = Utf8Validator();
+		return complete;
+	}
+};
 
-	vector<uint8_t> encoded(outLen);
+static inline const char base64Table[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// 6 bit values of the base64 alphabet, 0xff for everything else
+static inline const uint8_t base64Values[256] = {
+#define B64_X8 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+	B64_X8, B64_X8, B64_X8, B64_X8, B64_X8,
+	0xff, 0xff, 0xff, 62, 0xff, 0xff, 0xff, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46,
+	47, 48, 49, 50, 51, 0xff, 0xff, 0xff, 0xff, 0xff,
+	B64_X8, B64_X8, B64_X8, B64_X8, B64_X8, B64_X8, B64_X8, B64_X8,
+	B64_X8, B64_X8, B64_X8, B64_X8, B64_X8, B64_X8, B64_X8, B64_X8,
+#undef B64_X8
+};
 
-	auto encodeIter = encoded.begin();
-	auto toEncodeIter = toEncode.begin();
+static inline size_t b64_encoded_length(size_t length) { return (length + 2) / 3 * 4; }
 
-	while(toEncode.end() - toEncodeIter >= 3) {
-		uint8_t first = toEncodeIter[0];
-		uint8_t second = toEncodeIter[1];
-		uint8_t third = toEncodeIter[2];
+// upper bound for b64_decode's output, exact for input without padding
+static inline size_t b64_max_decoded_length(size_t length) { return length / 4 * 3; }
 
-		encodeIter[0] = base64_table[first >> 2];
-		encodeIter[1] = base64_table[((first & 0b00000011) << 4) | (second >> 4)];
-		encodeIter[2] = base64_table[((second & 0b00001111) << 2) | (third >> 6)];
-		encodeIter[3] = base64_table[third & 0b00111111];
+static inline size_t b64EncodeScalar(const uint8_t* data, size_t length, char* out) {
+	char* start = out;
+	size_t i = 0;
+	for(; i + 3 <= length; i += 3, out += 4) {
+		uint32_t bits = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+		out[0] = base64Table[bits >> 18];
+		out[1] = base64Table[(bits >> 12) & 63];
+		out[2] = base64Table[(bits >> 6) & 63];
+		out[3] = base64Table[bits & 63];
+	}
 
-		encodeIter += 4;
-		toEncodeIter += 3;
+	if(i < length) {
+		uint32_t bits = (data[i] << 16) | (i + 1 < length ? data[i + 1] << 8 : 0);
+		out[0] = base64Table[bits >> 18];
+		out[1] = base64Table[(bits >> 12) & 63];
+		out[2] = i + 1 < length ? base64Table[(bits >> 6) & 63] : '=';
+		out[3] = '=';
+		out += 4;
 	}
+	return out - start;
+}
 
-	if(toEncode.end() - toEncodeIter > 0) {
-		encodeIter[0] = base64_table[toEncodeIter[0] >> 2];
+// strict: no whitespace, padding only to complete the last quad and no stray bits in it. returns -1 if invalid
+static inline long b64DecodeScalar(const char* data, size_t length, uint8_t* out) {
+	if(length % 4) return -1;
+	uint8_t* start = out;
+
+	for(size_t i = 0; i < length; i += 4) {
+		uint32_t a = base64Values[(uint8_t)data[i]], b = base64Values[(uint8_t)data[i + 1]];
+		uint32_t c = base64Values[(uint8_t)data[i + 2]], d = base64Values[(uint8_t)data[i + 3]];
+
+		if((a | b | c | d) != 0xff && (a | b | c | d) < 64) {
+			uint32_t bits = (a << 18) | (b << 12) | (c << 6) | d;
+			out[0] = bits >> 16;
+			out[1] = bits >> 8;
+			out[2] = bits;
+			out += 3;
+			continue;
+		}
 
-		if(toEncode.end() - toEncodeIter == 2) {
-			encodeIter[1] = base64_table[((toEncodeIter[0] & 0b00000011) << 4) | (toEncodeIter[1] >> 4)];
-			encodeIter[2] = base64_table[((toEncodeIter[1] & 0b00001111) << 2)];
+		// only the last quad may be padded, as xx== or xxx=
+		if(i + 4 != length || a > 63 || b > 63 || data[i + 3] != '=') return -1;
+		if(data[i + 2] == '=') {
+			if(b & 15) return -1;
+			*out++ = (a << 2) | (b >> 4);
 		} else {
-			encodeIter[1] = base64_table[((toEncodeIter[0] & 0b00000011) << 4)];
-			encodeIter[2] = '=';
+			if(c > 63 || (c & 3)) return -1;
+			out[0] = (a << 2) | (b >> 4);
+			out[1] = (b << 4) | (c >> 2);
+			out += 2;
 		}
+	}
+	return out - start;
+}
 
-		encodeIter[3] = '=';
+#ifdef WEBSOCKET_X86
+// 12 input bytes per 128 bit lane to 16 ascii characters, wojciech mula's multiply shift and pshufb lookup
+#define B64_ENCODE_LANES(prefix, bits)                                                                                  \
+	in = prefix##_shuffle_epi8(in, prefix##_setr_epi8(B64_SPREAD_##bits));                                            \
+	__m##bits##i indices = prefix##_or_si##bits(                                                                      \
+		prefix##_mulhi_epu16(prefix##_and_si##bits(in, prefix##_set1_epi32(0x0fc0fc00)), prefix##_set1_epi32(0x04000040)), \
+		prefix##_mullo_epi16(prefix##_and_si##bits(in, prefix##_set1_epi32(0x003f03f0)), prefix##_set1_epi32(0x01000010))); \
+	__m##bits##i offsets = prefix##_subs_epu8(indices, prefix##_set1_epi8(51));                                       \
+	offsets = prefix##_or_si##bits(offsets, prefix##_and_si##bits(prefix##_cmpgt_epi8(prefix##_set1_epi8(26), indices), \
+																   prefix##_set1_epi8(13)));                          \
+	__m##bits##i chars = prefix##_add_epi8(prefix##_shuffle_epi8(prefix##_setr_epi8(B64_SHIFT_##bits), offsets), indices);
+
+#define B64_SPREAD 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+#define B64_SPREAD_128 B64_SPREAD
+#define B64_SPREAD_256 B64_SPREAD, B64_SPREAD
+#define B64_SHIFT 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 65, 0, 0
+#define B64_SHIFT_128 B64_SHIFT
+#define B64_SHIFT_256 B64_SHIFT, B64_SHIFT
+
+WEBSOCKET_TARGET("ssse3")
+static inline size_t b64EncodeSSSE3(const uint8_t* data, size_t length, char* out) {
+	size_t i = 0, o = 0;
+	for(; i + 16 <= length; i += 12, o += 16) {
+		__m128i in = _mm_loadu_si128((const __m128i*)(data + i));
+		B64_ENCODE_LANES(_mm, 128)
+		_mm_storeu_si128((__m128i*)(out + o), chars);
 	}
+	return o + b64EncodeScalar(data + i, length - i, out + o);
+}
+
+WEBSOCKET_TARGET("avx2")
+static inline size_t b64EncodeAVX2(const uint8_t* data, size_t length, char* out) {
+	size_t i = 0, o = 0;
+	for(; i + 28 <= length; i += 24, o += 32) {
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(data + i))),
+											 _mm_loadu_si128((const __m128i*)(data + i + 12)), 1);
+		B64_ENCODE_LANES(_mm256, 256)
+		_mm256_storeu_si256((__m256i*)(out + o), chars);
+	}
+	return o + b64EncodeSSSE3(data + i, length - i, out + o);
+}
+
+/**
+ * 16 characters per 128 bit lane to 12 bytes, also mula's: nibble lookups flag anything outside the alphabet, a
+ * rolled offset maps the rest to 6 bit values which multiply adds pack together. returns false on invalid input.
+ */
+#define B64_DECODE_LANES(prefix, bits)                                                                                  \
+	__m##bits##i high = prefix##_and_si##bits(prefix##_srli_epi32(in, 4), prefix##_set1_epi8(0x0f));                  \
+	__m##bits##i low = prefix##_and_si##bits(in, prefix##_set1_epi8(0x0f));                                          \
+	__m##bits##i invalid = prefix##_and_si##bits(prefix##_shuffle_epi8(prefix##_setr_epi8(B64_LUT_LOW_##bits), low),   \
+												 prefix##_shuffle_epi8(prefix##_setr_epi8(B64_LUT_HIGH_##bits), high)); \
+	if(prefix##_movemask_epi8(prefix##_cmpeq_epi8(invalid, prefix##_setzero_si##bits())) != B64_ALL_##bits) break;     \
+	__m##bits##i roll = prefix##_shuffle_epi8(prefix##_setr_epi8(B64_ROLL_##bits),                                    \
+											  prefix##_add_epi8(prefix##_cmpeq_epi8(in, prefix##_set1_epi8('/')), high)); \
+	__m##bits##i values = prefix##_add_epi8(in, roll);                                                                \
+	__m##bits##i packed = prefix##_madd_epi16(prefix##_maddubs_epi16(values, prefix##_set1_epi32(0x01400140)),        \
+											  prefix##_set1_epi32(0x00011000));                                     \
+	packed = prefix##_shuffle_epi8(packed, prefix##_setr_epi8(B64_PACK_##bits));
+
+#define B64_LUT_LOW 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a
+#define B64_LUT_LOW_128 B64_LUT_LOW
+#define B64_LUT_LOW_256 B64_LUT_LOW, B64_LUT_LOW
+#define B64_LUT_HIGH 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define B64_LUT_HIGH_128 B64_LUT_HIGH
+#define B64_LUT_HIGH_256 B64_LUT_HIGH, B64_LUT_HIGH
+#define B64_ROLL 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define B64_ROLL_128 B64_ROLL
+#define B64_ROLL_256 B64_ROLL, B64_ROLL
+#define B64_PACK 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+#define B64_PACK_128 B64_PACK
+#define B64_PACK_256 B64_PACK, B64_PACK
+#define B64_ALL_128 0xffff
+#define B64_ALL_256 -1
+
+// the scalar decoder takes the last quads, they may carry padding. a block with invalid characters is left to it too
+WEBSOCKET_TARGET("ssse3")
+static inline long b64DecodeSSSE3(const char* data, size_t length, uint8_t* out) {
+	if(length % 4) return -1;
+	size_t i = 0, o = 0;
+	for(; i + 24 <= length; i += 16, o += 12) {
+		__m128i in = _mm_loadu_si128((const __m128i*)(data + i));
+		B64_DECODE_LANES(_mm, 128)
+		_mm_storeu_si128((__m128i*)(out + o), packed);
+	}
+	long rest = b64DecodeScalar(data + i, length - i, out + o);
+	return rest < 0 ? -1 : o + rest;
+}
+
+WEBSOCKET_TARGET("avx2")
+static inline long b64DecodeAVX2(const char* data, size_t length, uint8_t* out) {
+	if(length % 4) return -1;
+	size_t i = 0, o = 0;
+	for(; i + 48 <= length; i += 32, o += 24) {
+		__m256i in = _mm256_loadu_si256((const __m256i*)(data + i));
+		B64_DECODE_LANES(_mm256, 256)
+		_mm256_storeu_si256((__m256i*)(out + o), _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7)));
+	}
+	long rest = b64DecodeSSSE3(data + i, length - i, out + o);
+	return rest < 0 ? -1 : o + rest;
+}
+
+#undef B64_ENCODE_LANES
+#undef B64_DECODE_LANES
+#undef B64_SPREAD
+#undef B64_SPREAD_128
+#undef B64_SPREAD_256
+#undef B64_SHIFT
+#undef B64_SHIFT_128
+#undef B64_SHIFT_256
+#undef B64_LUT_LOW
+#undef B64_LUT_LOW_128
+#undef B64_LUT_LOW_256
+#undef B64_LUT_HIGH
+#undef B64_LUT_HIGH_128
+#undef B64_LUT_HIGH_256
+#undef B64_ROLL
+#undef B64_ROLL_128
+#undef B64_ROLL_256
+#undef B64_PACK
+#undef B64_PACK_128
+#undef B64_PACK_256
+#undef B64_ALL_128
+#undef B64_ALL_256
+#endif
+
+// writes b64_encoded_length(length) characters to out, returns that count
+static inline size_t b64_encode(const uint8_t* data, size_t length, char* out) {
+#ifdef WEBSOCKET_X86
+	static auto kernel = cpu().avx2 ? b64EncodeAVX2 : cpu().ssse3 ? b64EncodeSSSE3 : b64EncodeScalar;
+	return kernel(data, length, out);
+#else
+	return b64EncodeScalar(data, length, out);
+#endif
+}
 
-	return string((char*)encoded.data());
+static inline string b64_encode(const uint8_t* data, size_t length) {
+	string encoded(b64_encoded_length(length), '\0');
+	b64_encode(data, length, encoded.data());
+	return encoded;
+}
+
+static inline string b64_encode(const vector<uint8_t>& toEncode) { return b64_encode(toEncode.data(), toEncode.size()); }
+
+/**
+ * strict rfc 4648 decoding into out, which needs room for b64_max_decoded_length(length) bytes. returns the decoded
+ * length or -1 for anything but canonical padded base64.
+ */
+static inline long b64_decode(const char* data, size_t length, uint8_t* out) {
+#ifdef WEBSOCKET_X86
+	static auto kernel = cpu().avx2 ? b64DecodeAVX2 : cpu().ssse3 ? b64DecodeSSSE3 : b64DecodeScalar;
+	return kernel(data, length, out);
+#else
+	return b64DecodeScalar(data, length, out);
+#endif
+}
+
+static inline bool b64_decode(std::string_view encoded, vector<uint8_t>& out) {
+	out.resize(b64_max_decoded_length(encoded.size()));
+	long length = b64_decode(encoded.data(), encoded.size(), out.data());
+	if(length < 0) {
+		out.clear();
+		return false;
+	}
+	out.resize(length);
+	return true;
 }
 
 struct URL {
@@ -138,13 +781,31 @@ struct URL {
 	z += (w ^ x ^ y) + blk(i) + 0xCA62C1D6 + rol(v, 5); \
 	w = rol(w, 30);
 
+#ifdef WEBSOCKET_X86
+#define SHANI_LOAD(i) msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), byteSwap)
+
+// one group of four sha-ni rounds, the message schedule for later groups is computed alongside
+#define SHANI_ROUNDS(g) \
+	e[g & 1] = _mm_sha1nexte_epu32(e[g & 1], msg[g & 3]); \
+	e[(g + 1) & 1] = abcd; \
+	msg[(g + 1) & 3] = _mm_sha1msg2_epu32(msg[(g + 1) & 3], msg[g & 3]); \
+	abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], g / 5); \
+	msg[(g + 3) & 3] = _mm_sha1msg1_epu32(msg[(g + 3) & 3], msg[g & 3]); \
+	msg[(g + 2) & 3] = _mm_xor_si128(msg[(g + 2) & 3], msg[g & 3]);
+#endif
+
+/**
+ * sha-1 for the handshake. update/final work on caller buffers and never allocate, blocks go through sha-ni where
+ * the cpu has it. hashMany runs up to 8 short independent messages through avx2 lanes side by side.
+ */
 class SHA1 {
 
 	uint32_t state[5];
-	uint32_t count[2];
+	uint64_t length = 0;
 	uint8_t buffer[64];
 
-	void transform(const uint8_t buffer[64]) {
+  public:
+	static void transformScalar(uint32_t state[5], const uint8_t* data, size_t blocks) {
 		uint32_t a, b, c, d, e;
 
 		typedef union {
@@ -154,157 +815,333 @@ class SHA1 {
 
 		CHAR64LONG16 block[1];
 
-		memcpy(block, buffer, 64);
-
-		/* Copy context->state[] to working vars */
-		a = state[0];
-		b = state[1];
-		c = state[2];
-		d = state[3];
-		e = state[4];
-		/* 4 rounds of 20 operations each. Loop unrolled. */
-		R0(a, b, c, d, e, 0);
-		R0(e, a, b, c, d, 1);
-		R0(d, e, a, b, c, 2);
-		R0(c, d, e, a, b, 3);
-		R0(b, c, d, e, a, 4);
-		R0(a, b, c, d, e, 5);
-		R0(e, a, b, c, d, 6);
-		R0(d, e, a, b, c, 7);
-		R0(c, d, e, a, b, 8);
-		R0(b, c, d, e, a, 9);
-		R0(a, b, c, d, e, 10);
-		R0(e, a, b, c, d, 11);
-		R0(d, e, a, b, c, 12);
-		R0(c, d, e, a, b, 13);
-		R0(b, c, d, e, a, 14);
-		R0(a, b, c, d, e, 15);
-		R1(e, a, b, c, d, 16);
-		R1(d, e, a, b, c, 17);
-		R1(c, d, e, a, b, 18);
-		R1(b, c, d, e, a, 19);
-		R2(a, b, c, d, e, 20);
-		R2(e, a, b, c, d, 21);
-		R2(d, e, a, b, c, 22);
-		R2(c, d, e, a, b, 23);
-		R2(b, c, d, e, a, 24);
-		R2(a, b, c, d, e, 25);
-		R2(e, a, b, c, d, 26);
-		R2(d, e, a, b, c, 27);
-		R2(c, d, e, a, b, 28);
-		R2(b, c, d, e, a, 29);
-		R2(a, b, c, d, e, 30);
-		R2(e, a, b, c, d, 31);
-		R2(d, e, a, b, c, 32);
-		R2(c, d, e, a, b, 33);
-		R2(b, c, d, e, a, 34);
-		R2(a, b, c, d, e, 35);
-		R2(e, a, b, c, d, 36);
-		R2(d, e, a, b, c, 37);
-		R2(c, d, e, a, b, 38);
-		R2(b, c, d, e, a, 39);
-		R3(a, b, c, d, e, 40);
-		R3(e, a, b, c, d, 41);
-		R3(d, e, a, b, c, 42);
-		R3(c, d, e, a, b, 43);
-		R3(b, c, d, e, a, 44);
-		R3(a, b, c, d, e, 45);
-		R3(e, a, b, c, d, 46);
-		R3(d, e, a, b, c, 47);
-		R3(c, d, e, a, b, 48);
-		R3(b, c, d, e, a, 49);
-		R3(a, b, c, d, e, 50);
-		R3(e, a, b, c, d, 51);
-		R3(d, e, a, b, c, 52);
-		R3(c, d, e, a, b, 53);
-		R3(b, c, d, e, a, 54);
-		R3(a, b, c, d, e, 55);
-		R3(e, a, b, c, d, 56);
-		R3(d, e, a, b, c, 57);
-		R3(c, d, e, a, b, 58);
-		R3(b, c, d, e, a, 59);
-		R4(a, b, c, d, e, 60);
-		R4(e, a, b, c, d, 61);
-		R4(d, e, a, b, c, 62);
-		R4(c, d, e, a, b, 63);
-		R4(b, c, d, e, a, 64);
-		R4(a, b, c, d, e, 65);
-		R4(e, a, b, c, d, 66);
-		R4(d, e, a, b, c, 67);
-		R4(c, d, e, a, b, 68);
-		R4(b, c, d, e, a, 69);
-		R4(a, b, c, d, e, 70);
-		R4(e, a, b, c, d, 71);
-		R4(d, e, a, b, c, 72);
-		R4(c, d, e, a, b, 73);
-		R4(b, c, d, e, a, 74);
-		R4(a, b, c, d, e, 75);
-		R4(e, a, b, c, d, 76);
-		R4(d, e, a, b, c, 77);
-		R4(c, d, e, a, b, 78);
-		R4(b, c, d, e, a, 79);
-		/* Add the working vars back into context.state[] */
-		state[0] += a;
-		state[1] += b;
-		state[2] += c;
-		state[3] += d;
-		state[4] += e;
+		for(; blocks; blocks--, data += 64) {
+			memcpy(block, data, 64);
+
+			/* Copy context->state[] to working vars */
+			a = state[0];
+			b = state[1];
+			c = state[2];
+			d = state[3];
+			e = state[4];
+			/* 4 rounds of 20 operations each. Loop unrolled. */
+			R0(a, b, c, d, e, 0);
+			R0(e, a, b, c, d, 1);
+			R0(d, e, a, b, c, 2);
+			R0(c, d, e, a, b, 3);
+			R0(b, c, d, e, a, 4);
+			R0(a, b, c, d, e, 5);
+			R0(e, a, b, c, d, 6);
+			R0(d, e, a, b, c, 7);
+			R0(c, d, e, a, b, 8);
+			R0(b, c, d, e, a, 9);
+			R0(a, b, c, d, e, 10);
+			R0(e, a, b, c, d, 11);
+			R0(d, e, a, b, c, 12);
+			R0(c, d, e, a, b, 13);
+			R0(b, c, d, e, a, 14);
+			R0(a, b, c, d, e, 15);
+			R1(e, a, b, c, d, 16);
+			R1(d, e, a, b, c, 17);
+			R1(c, d, e, a, b, 18);
+			R1(b, c, d, e, a, 19);
+			R2(a, b, c, d, e, 20);
+			R2(e, a, b, c, d, 21);
+			R2(d, e, a, b, c, 22);
+			R2(c, d, e, a, b, 23);
+			R2(b, c, d, e, a, 24);
+			R2(a, b, c, d, e, 25);
+			R2(e, a, b, c, d, 26);
+			R2(d, e, a, b, c, 27);
+			R2(c, d, e, a, b, 28);
+			R2(b, c, d, e, a, 29);
+			R2(a, b, c, d, e, 30);
+			R2(e, a, b, c, d, 31);
+			R2(d, e, a, b, c, 32);
+			R2(c, d, e, a, b, 33);
+			R2(b, c, d, e, a, 34);
+			R2(a, b, c, d, e, 35);
+			R2(e, a, b, c, d, 36);
+			R2(d, e, a, b, c, 37);
+			R2(c, d, e, a, b, 38);
+			R2(b, c, d, e, a, 39);
+			R3(a, b, c, d, e, 40);
+			R3(e, a, b, c, d, 41);
+			R3(d, e, a, b, c, 42);
+			R3(c, d, e, a, b, 43);
+			R3(b, c, d, e, a, 44);
+			R3(a, b, c, d, e, 45);
+			R3(e, a, b, c, d, 46);
+			R3(d, e, a, b, c, 47);
+			R3(c, d, e, a, b, 48);
+			R3(b, c, d, e, a, 49);
+			R3(a, b, c, d, e, 50);
+			R3(e, a, b, c, d, 51);
+			R3(d, e, a, b, c, 52);
+			R3(c, d, e, a, b, 53);
+			R3(b, c, d, e, a, 54);
+			R3(a, b, c, d, e, 55);
+			R3(e, a, b, c, d, 56);
+			R3(d, e, a, b, c, 57);
+			R3(c, d, e, a, b, 58);
+			R3(b, c, d, e, a, 59);
+			R4(a, b, c, d, e, 60);
+			R4(e, a, b, c, d, 61);
+			R4(d, e, a, b, c, 62);
+			R4(c, d, e, a, b, 63);
+			R4(b, c, d, e, a, 64);
+			R4(a, b, c, d, e, 65);
+			R4(e, a, b, c, d, 66);
+			R4(d, e, a, b, c, 67);
+			R4(c, d, e, a, b, 68);
+			R4(b, c, d, e, a, 69);
+			R4(a, b, c, d, e, 70);
+			R4(e, a, b, c, d, 71);
+			R4(d, e, a, b, c, 72);
+			R4(c, d, e, a, b, 73);
+			R4(b, c, d, e, a, 74);
+			R4(a, b, c, d, e, 75);
+			R4(e, a, b, c, d, 76);
+			R4(d, e, a, b, c, 77);
+			R4(c, d, e, a, b, 78);
+			R4(b, c, d, e, a, 79);
+			/* Add the working vars back into context.state[] */
+			state[0] += a;
+			state[1] += b;
+			state[2] += c;
+			state[3] += d;
+			state[4] += e;
+		}
 	}
 
-  public:
+#ifdef WEBSOCKET_X86
+	WEBSOCKET_TARGET("sha,ssse3,sse4.1")
+	static void transformSHANI(uint32_t state[5], const uint8_t* data, size_t blocks) {
+		const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ull, 0x08090a0b0c0d0e0full);
+		__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1b);
+		__m128i e[2] = {_mm_set_epi32(state[4], 0, 0, 0), _mm_setzero_si128()};
+
+		for(; blocks; blocks--, data += 64) {
+			__m128i abcdSave = abcd;
+			__m128i eSave = e[0];
+			__m128i msg[4] = {_mm_setzero_si128()};
+
+			SHANI_LOAD(0);
+			e[0] = _mm_add_epi32(e[0], msg[0]);
+			e[1] = abcd;
+			abcd = _mm_sha1rnds4_epu32(abcd, e[0], 0);
+
+			// the first groups also update words that are loaded only afterwards, the loads overwrite that
+			SHANI_LOAD(1);
+			SHANI_ROUNDS(1)
+			SHANI_LOAD(2);
+			SHANI_ROUNDS(2)
+			SHANI_LOAD(3);
+			SHANI_ROUNDS(3)
+			SHANI_ROUNDS(4) SHANI_ROUNDS(5)
+			SHANI_ROUNDS(6) SHANI_ROUNDS(7) SHANI_ROUNDS(8) SHANI_ROUNDS(9) SHANI_ROUNDS(10)
+			SHANI_ROUNDS(11) SHANI_ROUNDS(12) SHANI_ROUNDS(13) SHANI_ROUNDS(14) SHANI_ROUNDS(15)
+			SHANI_ROUNDS(16) SHANI_ROUNDS(17) SHANI_ROUNDS(18) SHANI_ROUNDS(19)
+
+			e[0] = _mm_sha1nexte_epu32(e[0], eSave);
+			abcd = _mm_add_epi32(abcd, abcdSave);
+		}
+
+		_mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+		state[4] = _mm_extract_epi32(e[0], 3);
+	}
+
+	WEBSOCKET_TARGET("avx2")
+	static inline __m256i rol8x(__m256i value, int bits) {
+		return _mm256_or_si256(_mm256_slli_epi32(value, bits), _mm256_srli_epi32(value, 32 - bits));
+	}
+
+	/**
+	 * eight messages, one per 32 bit lane. lane i reads its padded message from lanes + i * LANE_BYTES and runs for
+	 * blocks[i] blocks, lanes that are done keep their state.
+	 */
+	WEBSOCKET_TARGET("avx2")
+	static void transformAVX2x8(uint32_t states[8][5], const uint8_t* lanes, const size_t blocks[8]) {
+		const __m256i byteSwap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8,
+												 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+		const __m256i laneOffsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i wordIndex = _mm256_mullo_epi32(laneOffsets, _mm256_set1_epi32(LANE_BYTES / 4));
+		const __m256i blockCounts = _mm256_setr_epi32(blocks[0], blocks[1], blocks[2], blocks[3], blocks[4], blocks[5],
+													  blocks[6], blocks[7]);
+
+		__m256i st[5];
+		for(int i = 0; i < 5; i++)
+			st[i] = _mm256_setr_epi32(states[0][i], states[1][i], states[2][i], states[3][i], states[4][i], states[5][i],
+									  states[6][i], states[7][i]);
+
+		size_t most = *std::max_element(blocks, blocks + 8);
+		for(size_t k = 0; k < most; k++) {
+			__m256i w[16];
+			for(int t = 0; t < 16; t++)
+				w[t] = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*)(lanes + k * 64 + t * 4), wordIndex, 4),
+										   byteSwap);
+
+			__m256i a = st[0], b = st[1], c = st[2], d = st[3], e = st[4];
+			for(int t = 0; t < 80; t++) {
+				if(t >= 16)
+					w[t & 15] = rol8x(_mm256_xor_si256(_mm256_xor_si256(w[(t + 13) & 15], w[(t + 8) & 15]),
+													   _mm256_xor_si256(w[(t + 2) & 15], w[t & 15])),
+									  1);
+
+				__m256i f, k;
+				if(t < 20) {
+					f = _mm256_xor_si256(_mm256_and_si256(b, _mm256_xor_si256(c, d)), d);
+					k = _mm256_set1_epi32(0x5A827999);
+				} else if(t < 40) {
+					f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+					k = _mm256_set1_epi32(0x6ED9EBA1);
+				} else if(t < 60) {
+					f = _mm256_or_si256(_mm256_and_si256(_mm256_or_si256(b, c), d), _mm256_and_si256(b, c));
+					k = _mm256_set1_epi32(0x8F1BBCDC);
+				} else {
+					f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+					k = _mm256_set1_epi32(0xCA62C1D6);
+				}
+
+				__m256i temp = _mm256_add_epi32(_mm256_add_epi32(rol8x(a, 5), f),
+												_mm256_add_epi32(_mm256_add_epi32(e, k), w[t & 15]));
+				e = d;
+				d = c;
+				c = rol8x(b, 30);
+				b = a;
+				a = temp;
+			}
+
+			// lanes past their last block keep what they had
+			__m256i active = _mm256_cmpgt_epi32(blockCounts, _mm256_set1_epi32((int)k));
+			__m256i next[5] = {a, b, c, d, e};
+			for(int i = 0; i < 5; i++) st[i] = _mm256_blendv_epi8(st[i], _mm256_add_epi32(st[i], next[i]), active);
+		}
+
+		alignas(32) uint32_t words[8];
+		for(int i = 0; i < 5; i++) {
+			_mm256_store_si256((__m256i*)words, st[i]);
+			for(int lane = 0; lane < 8; lane++) states[lane][i] = words[lane];
+		}
+	}
+#endif
+
+	static constexpr size_t LANE_BYTES = 256;
+	// longest message hashMany runs through simd lanes, padding has to fit LANE_BYTES
+	static constexpr size_t MAX_LANE_MESSAGE = LANE_BYTES - 9;
+
 	SHA1() {
 		state[0] = 0x67452301;
 		state[1] = 0xEFCDAB89;
 		state[2] = 0x98BADCFE;
 		state[3] = 0x10325476;
 		state[4] = 0xC3D2E1F0;
-		count[0] = count[1] = 0;
 	}
 
-	SHA1& update(std::vector<uint8_t>& data) {
-		uint32_t i;
-		size_t len = data.size();
+	static void compress(uint32_t state[5], const uint8_t* data, size_t blocks) {
+#ifdef WEBSOCKET_X86
+		static auto kernel = cpu().sha && cpu().sse41 ? transformSHANI : transformScalar;
+		kernel(state, data, blocks);
+#else
+		transformScalar(state, data, blocks);
+#endif
+	}
 
-		uint32_t j;
+	SHA1& update(const uint8_t* data, size_t len) {
+		size_t used = length & 63;
+		length += len;
+
+		if(used) {
+			size_t take = std::min(64 - used, len);
+			memcpy(buffer + used, data, take);
+			if(used + take < 64) return *this;
+			compress(state, buffer, 1);
+			data += take;
+			len -= take;
+		}
 
-		j = count[0];
-		if((count[0] += len << 3) < j) count[1]++;
-		count[1] += (len >> 29);
-		j = (j >> 3) & 63;
-		if((j + len) > 63) {
-			memcpy(&buffer[j], data.data(), (i = 64 - j));
-			transform(buffer);
-			for(; i + 63 < len; i += 64) transform(&data[i]);
-			j = 0;
-		} else
-			i = 0;
-		memcpy(&buffer[j], &data[i], len - i);
+		compress(state, data, len / 64);
+		if(len % 64) memcpy(buffer, data + len / 64 * 64, len % 64);
 		return *this;
 	}
 
-	std::vector<uint8_t> final() {
+	SHA1& update(std::string_view data) { return update((const uint8_t*)data.data(), data.size()); }
+	SHA1& update(const std::vector<uint8_t>& data) { return update(data.data(), data.size()); }
 
-		std::vector<uint8_t> digest(20);
-		std::vector<uint8_t> finalcount(8);
+	// pads the last block and writes the 20 byte digest
+	void final(uint8_t digest[20]) {
+		size_t used = length & 63;
+		uint64_t bits = length * 8;
+
+		buffer[used++] = 0x80;
+		if(used > 56) {
+			memset(buffer + used, 0, 64 - used);
+			compress(state, buffer, 1);
+			used = 0;
+		}
+		memset(buffer + used, 0, 56 - used);
+		for(int i = 0; i < 8; i++) buffer[56 + i] = (uint8_t)(bits >> (56 - i * 8));
+		compress(state, buffer, 1);
 
-		std::vector<uint8_t> c(1);
+		for(int i = 0; i < 20; i++) digest[i] = (uint8_t)(state[i >> 2] >> ((3 - (i & 3)) * 8));
+	}
 
-		for(int i = 0; i < 8; i++) finalcount[i] = (uint8_t)((count[(i >= 4 ? 0 : 1)] >> ((3 - (i & 3)) * 8)) & 255);
+	std::vector<uint8_t> final() {
+		std::vector<uint8_t> digest(20);
+		final(digest.data());
+		return digest;
+	}
 
-		c[0] = 0200;
-		update(c);
+	/**
+	 * hashes count independent messages into digests[i]. with avx2 and without sha-ni, messages of at most
+	 * MAX_LANE_MESSAGE bytes go eight at a time through simd lanes, the rest one by one.
+	 */
+	static void hashMany(const uint8_t* const data[], const size_t lengths[], uint8_t (*digests)[20], size_t count) {
+		size_t i = 0;
+#ifdef WEBSOCKET_X86
+		static bool lanes = cpu().avx2 && !cpu().sha;
+		while(lanes && i < count) {
+			alignas(32) uint8_t padded[8 * LANE_BYTES];
+			uint32_t states[8][5];
+			size_t blocks[8] = {0};
+			size_t laneMessage[8];
+			size_t used = 0;
+
+			for(; i < count && used < 8; i++) {
+				if(lengths[i] > MAX_LANE_MESSAGE) {
+					SHA1().update(data[i], lengths[i]).final(digests[i]);
+					continue;
+				}
+				blocks[used] = pad(data[i], lengths[i], padded + used * LANE_BYTES) / 64;
+				memcpy(states[used], SHA1().state, sizeof(states[used]));
+				laneMessage[used++] = i;
+			}
 
-		while((count[0] & 504) != 448) {
-			c[0] = 0000;
-			update(c);
+			transformAVX2x8(states, padded, blocks);
+			for(size_t lane = 0; lane < used; lane++) {
+				uint8_t* digest = digests[laneMessage[lane]];
+				for(int j = 0; j < 20; j++) digest[j] = (uint8_t)(states[lane][j >> 2] >> ((3 - (j & 3)) * 8));
+			}
 		}
+#endif
+		for(; i < count; i++) SHA1().update(data[i], lengths[i]).final(digests[i]);
+	}
 
-		update(finalcount);
-
-		for(int i = 0; i < 20; i++) digest[i] = (uint8_t)((state[i >> 2] >> ((3 - (i & 3)) * 8)) & 255);
-		return digest;
+	// message plus sha-1 padding, returns the padded length
+	static size_t pad(const uint8_t* data, size_t len, uint8_t* out) {
+		size_t total = (len + 8) / 64 * 64 + 64;
+		if(len) memcpy(out, data, len);
+		out[len] = 0x80;
+		memset(out + len + 1, 0, total - len - 9);
+		uint64_t bits = (uint64_t)len * 8;
+		for(int i = 0; i < 8; i++) out[total - 8 + i] = (uint8_t)(bits >> (56 - i * 8));
+		return total;
 	}
 };
+#ifdef WEBSOCKET_X86
+#undef SHANI_LOAD
+#undef SHANI_ROUNDS
+#endif
 #undef R0
 #undef R1
 #undef R2
@@ -314,186 +1151,2324 @@ class SHA1 {
 #undef blk
 #undef blk0
 
-} // namespace util
-
-class WebSocket {
-	friend class WebSocketServer;
+/**
+ * per thread chacha20 generator for masking keys and handshake nonces, seeded from the os. keystream is produced a
+ * batch of blocks at a time, the first 32 bytes of each batch become the next key and are never handed out, so a
+ * leaked state does not reveal earlier output. forked children reseed before their first use.
+ */
+class SecureRandom {
+	static constexpr size_t BLOCKS = 5;
 
-  private:
-	static inline vector<uint8_t> pingData = {'p', 'i', 'n', 'g', 'd', 'a', 't', 'a'};
+	uint32_t key[8];
+	uint8_t buffer[BLOCKS * 64];
+	size_t pos = sizeof(buffer);
+	uint32_t generation;
 
-	function<void(vector<uint8_t>&, bool)> messageHandler = 0;
-	function<void()> closeHandler = 0;
-	bool clientMode = true;
-	TCPSocket sock;
+	inline static std::atomic<uint32_t> forks = 0;
 
-	enum Opcode {
-		Continuation = 0x00, ///< %x0 denotes a continuation frame
-		Text = 0x01,		 ///< %x1 denotes a text frame
-		Binary = 0x02,		 ///< %x2 denotes a binary frame
-							 ///< %x3-7 are reserved for further non-control frames
-		Close = 0x08,		 ///< %x8 denotes a connection close
-		Ping = 0x09,		 ///< %x9 denotes a ping
-		Pong = 0x0A			 ///< %xA denotes a pong
-							 ///< %xB-F are reserved for further control frames
-	};
+	static void osEntropy(void* out, size_t length) {
+#ifdef _WIN32
+		if(BCryptGenRandom(0, (PUCHAR)out, (ULONG)length, BCRYPT_USE_SYSTEM_PREFERRED_RNG) != 0)
+			throw runtime_error("BCryptGenRandom failed");
+#elif defined(__linux__)
+		for(size_t done = 0; done < length;) {
+			ssize_t got = getrandom((uint8_t*)out + done, length - done, 0);
+			if(got < 0 && errno != EINTR) throw runtime_error("getrandom failed");
+			if(got > 0) done += got;
+		}
+#else
+		arc4random_buf(out, length);
+#endif
+	}
 
-	struct Frame {
-		bool fin;
-		Opcode opcode;
-		bool masked;
-		uint8_t maskingKey[4];
-		uint64_t payloadLength;
-		vector<uint8_t> payload;
-	};
+	static inline uint32_t rotl(uint32_t v, int n) { return (v << n) | (v >> (32 - n)); }
 
-	inline void terminate() {
-		sock.disconnect();
-		if(closeHandler) closeHandler();
+	static inline void quarterRound(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) {
+		a += b, d = rotl(d ^ a, 16);
+		c += d, b = rotl(b ^ c, 12);
+		a += b, d = rotl(d ^ a, 8);
+		c += d, b = rotl(b ^ c, 7);
 	}
 
-	inline Frame readFrame() {
-		Frame frame;
-		try {
-			uint8_t flags = sock.receiveByte();
-
-			frame.fin = flags >> 7;
-			frame.opcode = (Opcode)(flags & 0x0f);
+	// one 64 byte keystream block, zero nonce. the key changes every batch so the counter never wraps
+	void block(uint32_t counter, uint8_t* out) {
+		uint32_t input[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574, key[0], key[1], key[2], key[3],
+							  key[4],	  key[5],	  key[6],	  key[7],	  counter, 0,	   0,	   0};
+		uint32_t x[16];
+		memcpy(x, input, sizeof(x));
+
+		for(int i = 0; i < 10; i++) {
+			quarterRound(x[0], x[4], x[8], x[12]);
+			quarterRound(x[1], x[5], x[9], x[13]);
+			quarterRound(x[2], x[6], x[10], x[14]);
+			quarterRound(x[3], x[7], x[11], x[15]);
+			quarterRound(x[0], x[5], x[10], x[15]);
+			quarterRound(x[1], x[6], x[11], x[12]);
+			quarterRound(x[2], x[7], x[8], x[13]);
+			quarterRound(x[3], x[4], x[9], x[14]);
+		}
 
-			uint8_t payloadInf = sock.receiveByte();
-			frame.masked = payloadInf >> 7;
+		for(int i = 0; i < 16; i++) {
+			uint32_t word = x[i] + input[i];
+			out[i * 4] = word;
+			out[i * 4 + 1] = word >> 8;
+			out[i * 4 + 2] = word >> 16;
+			out[i * 4 + 3] = word >> 24;
+		}
+	}
 
-			frame.payloadLength = payloadInf & 0x7f;
+	void reseed() {
+		osEntropy(key, sizeof(key));
+		generation = forks;
+		pos = sizeof(buffer);
+	}
 
-			if(frame.payloadLength == 126) {
-				frame.payloadLength = sock.receiveShort();
-			} else if(frame.payloadLength == 127) {
-				frame.payloadLength = sock.receiveLongInt();
-			}
+	void refill() {
+		if(generation != forks) reseed();
+		for(size_t i = 0; i < BLOCKS; i++) block(i, buffer + i * 64);
+		memcpy(key, buffer, sizeof(key));
+		pos = sizeof(key);
+	}
 
-			if(frame.masked) {
-				frame.payload = sock.receive(4);
-				memcpy(frame.maskingKey, frame.payload.data(), 4);
-				frame.payload = vector<uint8_t>();
-			}
+	SecureRandom() { reseed(); }
 
-			if(frame.payloadLength == 0) return frame;
+  public:
+	SecureRandom(const SecureRandom&) = delete;
 
-			frame.payload = sock.receive(frame.payloadLength);
+	// the calling thread's generator, threads never contend for it
+	static SecureRandom& local() {
+#ifndef _WIN32
+		static bool registered = pthread_atfork(0, 0, []() { forks++; }) == 0;
+		(void)registered;
+#endif
+		thread_local SecureRandom instance;
+		return instance;
+	}
 
-			return frame;
-		} catch(...) { throw; }
+	void bytes(void* out, size_t length) {
+		uint8_t* dest = (uint8_t*)out;
+		while(length) {
+			if(pos == sizeof(buffer) || generation != forks) refill();
+			size_t take = std::min(length, sizeof(buffer) - pos);
+			memcpy(dest, buffer + pos, take);
+			memset(buffer + pos, 0, take);
+			pos += take;
+			dest += take;
+			length -= take;
+		}
 	}
+};
 
-#define SAFE_SEND(args) \
-	do { \
-		try { \
-			sock.send(args); \
-		} catch(...) { \
-			terminate(); \
-			return; \
-		} \
-	} while(0)
+// fills a websocket masking key from the thread's SecureRandom
+static inline void maskingKey(uint8_t key[4]) { SecureRandom::local().bytes(key, 4); }
 
-	mutex sendLock;
+static inline char lower(char c) { return c >= 'A' && c <= 'Z' ? c + 32 : c; }
 
-	inline void sendFrame(Opcode opcode, vector<uint8_t>& data) {
+static inline bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+	if(a.size() != b.size()) return false;
+	for(size_t i = 0; i < a.size(); i++)
+		if(lower(a[i]) != lower(b[i])) return false;
+	return true;
+}
 
-		lock_guard<mutex> lock(sendLock);
+// whether a comma separated header value like "keep-alive, Upgrade" lists token
+static inline bool hasToken(std::string_view list, std::string_view token) {
+	while(!list.empty()) {
+		size_t comma = list.find(',');
+		std::string_view item = list.substr(0, comma);
+		while(!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+		while(!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+		if(equalsIgnoreCase(item, token)) return true;
+		if(comma == std::string_view::npos) break;
+		list.remove_prefix(comma + 1);
+	}
+	return false;
+}
 
-		uint8_t flags = 0b10000000 | opcode; // fin = 1, opcode is lower 4 bits
+/**
+ * head of an http/1.1 request or response, parsed in one pass without allocating. names, values and the start line
+ * are views into the parsed buffer and only valid as long as it is.
+ */
+class HttpHead {
+	// position of the next '\n' at or after from, or length if there is none
+	static size_t findNewline(const char* data, size_t from, size_t length) {
+#ifdef WEBSOCKET_X86
+		// skips 16 bytes at a time, memchr then pins down the exact spot within the block
+		const __m128i newline = _mm_set1_epi8('\n');
+		for(; from + 16 <= length; from += 16)
+			if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + from)), newline))) break;
+#endif
+		const void* found = memchr(data + from, '\n', length - from);
+		return found ? (const char*)found - data : length;
+	}
 
-		SAFE_SEND(flags);
+	static std::string_view trim(std::string_view value) {
+		while(!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+		while(!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+		return value;
+	}
 
-		uint8_t payloadInf;
-		if(data.size() > 125) {
-			payloadInf = (data.size() > 0xffff) ? 127 : 126; // 127 if > uint16 else len is < 65535 byte
+	bool parseStartLine(std::string_view line, bool response) {
+		size_t first = line.find(' ');
+		if(first == std::string_view::npos) return false;
+		size_t second = line.find(' ', first + 1);
+
+		if(response) {
+			// HTTP/1.1 101 Switching Protocols
+			version = line.substr(0, first);
+			std::string_view code = line.substr(first + 1, second == std::string_view::npos ? second : second - first - 1);
+			if(code.size() != 3) return false;
+			status = 0;
+			for(char c : code) {
+				if(c < '0' || c > '9') return false;
+				status = status * 10 + (c - '0');
+			}
 		} else {
-			payloadInf = data.size();
+			// GET /path HTTP/1.1
+			if(second == std::string_view::npos) return false;
+			method = line.substr(0, first);
+			target = line.substr(first + 1, second - first - 1);
+			version = line.substr(second + 1);
+			if(method.empty() || target.empty()) return false;
 		}
+		return version.size() == 8 && version.compare(0, 5, "HTTP/") == 0;
+	}
+
+  public:
+	static constexpr size_t MAX_HEADERS = 32;
+	static constexpr size_t MAX_SIZE = 16 * 1024;
 
-		if(clientMode) payloadInf |= 0b10000000; // set masking bit
+	enum Result { Incomplete = 0, Invalid = -1 };
 
-		SAFE_SEND(payloadInf);
+	struct Header {
+		std::string_view name;
+		std::string_view value;
+	};
 
-		if(data.size() > 125) {
-			if(data.size() > 0xffff) SAFE_SEND((uint64_t)data.size());
-			else
-				SAFE_SEND((uint16_t)data.size());
-		}
+	std::string_view method;
+	std::string_view target;
+	std::string_view version;
+	int status = 0;
+
+	Header headers[MAX_HEADERS];
+	size_t headerCount = 0;
+
+	/**
+	 * parses the head at the start of data. returns its length including the empty line, Incomplete if more
+	 * data is needed and Invalid for malformed heads, more than MAX_HEADERS headers or heads above maxSize.
+	 * bare '\n' line ends are accepted like most servers do.
+	 */
+	long parse(std::string_view data, bool response = false, size_t maxSize = MAX_SIZE) {
+		headerCount = 0;
+		size_t length = std::min(data.size(), maxSize);
+		size_t pos = 0;
+		bool startLine = true;
 
-		if(clientMode) {
-			vector<uint8_t> copy(data.begin(), data.end());
-			vector<uint8_t> maskingKey(4);
-			(*(uint32_t*)maskingKey.data()) = rand(); // TODO: use strong entropy source
-			for(size_t i = 0; i < copy.size(); i++) copy[i] ^= maskingKey[i % 4];
+		while(1) {
+			size_t end = findNewline(data.data(), pos, length);
+			if(end == length) return data.size() >= maxSize ? Invalid : Incomplete;
 
-			SAFE_SEND(maskingKey);
+			std::string_view line = data.substr(pos, end - pos);
+			if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+			pos = end + 1;
 
-			if(copy.size() == 0) return;
-			SAFE_SEND(copy);
+			if(startLine) {
+				if(!parseStartLine(line, response)) return Invalid;
+				startLine = false;
+				continue;
+			}
 
-		} else {
-			SAFE_SEND(data);
+			if(line.empty()) return pos;
+
+			// folded continuation lines are obsolete, rfc 9112 lets us reject them
+			size_t colon = line.find(':');
+			if(colon == 0 || colon == std::string_view::npos || line[0] == ' ' || line[0] == '\t') return Invalid;
+			std::string_view name = line.substr(0, colon);
+			if(name.back() == ' ' || name.back() == '\t') return Invalid;
+
+			if(headerCount == MAX_HEADERS) return Invalid;
+			headers[headerCount++] = {name, trim(line.substr(colon + 1))};
 		}
 	}
 
-#undef SAFE_SEND
+	// value of the first header called name (any case), empty if there is none
+	std::string_view get(std::string_view name) const {
+		for(size_t i = 0; i < headerCount; i++)
+			if(equalsIgnoreCase(headers[i].name, name)) return headers[i].value;
+		return {};
+	}
 
-	void receiveLoop() {
-		while(1) {
+	bool has(std::string_view name) const {
+		for(size_t i = 0; i < headerCount; i++)
+			if(equalsIgnoreCase(headers[i].name, name)) return true;
+		return false;
+	}
+};
 
-			Frame frame;
+} // namespace util
+
+// permessage-deflate (RFC 7692), needs zlib and WEBSOCKET_DEFLATE defined before including this header
+struct DeflateOptions {
+	bool enabled = false;
+	int maxWindowBits = 15;				 // window of our own deflate stream, 9 to 15
+	bool noContextTakeover = false;		 // reset our compressor after every message
+	bool peerNoContextTakeover = false;	 // ask the peer to reset theirs, saves memory on the peer
+	size_t threshold = 64;				 // messages below this many bytes are sent uncompressed
+	int level = 6;
+	int memLevel = 8;
+};
+
+struct DeflateStats {
+	uint64_t messagesCompressed = 0;
+	uint64_t messagesSkipped = 0; // below threshold
+	uint64_t bytesBeforeCompression = 0;
+	uint64_t bytesAfterCompression = 0;
+	uint64_t compressNs = 0;
+	uint64_t messagesInflated = 0;
+	uint64_t bytesBeforeInflate = 0;
+	uint64_t bytesAfterInflate = 0;
+	uint64_t inflateNs = 0;
+
+	double ratio() const { return bytesBeforeCompression ? (double)bytesAfterCompression / bytesBeforeCompression : 0; }
+};
+
+// thrown for corrupt compressed payloads and text that is not utf-8, the connection fails with 1007
+struct InvalidPayloadException : runtime_error {
+	InvalidPayloadException(string what) : runtime_error(what) {}
+};
+
+// a frame or message above MessageLimits or a receive past the server's MemoryBudget, the connection fails with 1009
+struct MessageTooBigException : runtime_error {
+	enum Limit { Frame, Message, Budget } limit;
+	MessageTooBigException(Limit limit) : runtime_error("message too big"), limit(limit) {}
+};
+
+// negotiated permessage-deflate parameters, names follow the extension parameters
+struct DeflateParams {
+	bool serverNoContextTakeover = false;
+	bool clientNoContextTakeover = false;
+	int serverMaxWindowBits = 15;
+	int clientMaxWindowBits = 15;
+
+	/**
+	 * finds the first usable permessage-deflate entry in a Sec-WebSocket-Extensions value. window sizes below 9
+	 * are treated as unusable since zlib can not produce raw deflate streams with a 256 byte window.
+	 */
+	bool parse(const string& header) {
+		size_t pos = 0;
+		while(pos <= header.size()) {
+			size_t end = header.find(',', pos);
+			if(end == string::npos) end = header.size();
+
+			*this = DeflateParams();
+			bool valid = true;
+			bool isDeflate = false;
+			size_t partStart = pos;
+
+			while(partStart <= end) {
+				size_t partEnd = header.find(';', partStart);
+				if(partEnd == string::npos || partEnd > end) partEnd = end;
+
+				string part = header.substr(partStart, partEnd - partStart);
+				part.erase(0, part.find_first_not_of(" \t"));
+				part.erase(part.find_last_not_of(" \t") + 1);
+
+				string value;
+				size_t eq = part.find('=');
+				if(eq != string::npos) {
+					value = part.substr(eq + 1);
+					part = part.substr(0, eq);
+					part.erase(part.find_last_not_of(" \t") + 1);
+					value.erase(0, value.find_first_not_of(" \t\""));
+					value.erase(value.find_last_not_of(" \t\"") + 1);
+				}
+
+				if(partStart == pos) isDeflate = part == "permessage-deflate";
+				else if(part == "server_no_context_takeover")
+					serverNoContextTakeover = true;
+				else if(part == "client_no_context_takeover")
+					clientNoContextTakeover = true;
+				else if(part == "server_max_window_bits" || part == "client_max_window_bits") {
+					int bits = value.empty() ? 15 : atoi(value.c_str());
+					if(bits < 9 || bits > 15) valid = false;
+					(part[0] == 's' ? serverMaxWindowBits : clientMaxWindowBits) = bits;
+				} else if(!part.empty())
+					valid = false;
+
+				partStart = partEnd + 1;
+			}
+
+			if(isDeflate && valid) return true;
+			pos = end + 1;
+		}
+		return false;
+	}
+};
+
+#ifdef WEBSOCKET_DEFLATE
+#include <zlib.h>
+
+// one compressor and one decompressor per connection
+class PerMessageDeflate {
+	z_stream deflater = {0};
+	z_stream inflater = {0};
+	bool resetDeflater;
+	bool resetInflater;
+	size_t threshold;
+	uint8_t block[16 * 1024];
+
+	void inflateInput(const uint8_t* data, size_t length, const function<void(const uint8_t*, size_t)>& out) {
+		inflater.next_in = (Bytef*)data;
+		inflater.avail_in = length;
+
+		do {
+			inflater.next_out = block;
+			inflater.avail_out = sizeof(block);
+
+			int ret = inflate(&inflater, Z_SYNC_FLUSH);
+			if(ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) throw InvalidPayloadException("invalid deflate data");
+
+			size_t produced = sizeof(block) - inflater.avail_out;
+			stats.bytesAfterInflate += produced;
+			if(produced) out(block, produced);
+
+			// a final deflate block ends the stream, whatever follows belongs to a fresh one
+			if(ret == Z_STREAM_END) inflateReset(&inflater);
+			if(ret == Z_BUF_ERROR) break;
+		} while(inflater.avail_in > 0 || inflater.avail_out == 0);
+	}
+
+  public:
+	DeflateStats stats;
+
+	/**
+	 * windowBits and resetDeflater apply to our own compressor. resetInflater is only a hint, the decompressor can
+	 * always take a 15 bit window.
+	 */
+	PerMessageDeflate(const DeflateOptions& options, int windowBits, bool resetDeflater, bool resetInflater)
+		: resetDeflater(resetDeflater), resetInflater(resetInflater), threshold(options.threshold) {
+		if(deflateInit2(&deflater, options.level, Z_DEFLATED, -windowBits, options.memLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw runtime_error("deflateInit2 failed");
+		if(inflateInit2(&inflater, -15) != Z_OK) {
+			deflateEnd(&deflater);
+			throw runtime_error("inflateInit2 failed");
+		}
+	}
+
+	~PerMessageDeflate() {
+		deflateEnd(&deflater);
+		inflateEnd(&inflater);
+	}
+
+	PerMessageDeflate(const PerMessageDeflate&) = delete;
+	PerMessageDeflate& operator=(const PerMessageDeflate&) = delete;
+
+	// compresses a whole message into out, returns false if it is too small to be worth it
+	bool compress(const uint8_t* data, size_t length, vector<uint8_t>& out) {
+		if(length < threshold) {
+			stats.messagesSkipped++;
+			return false;
+		}
+
+		uint64_t start = util::nowNs();
+
+		deflater.next_in = (Bytef*)data;
+		deflater.avail_in = length;
+
+		out.resize(deflateBound(&deflater, length) + 8);
+		size_t used = 0;
+		do {
+			if(used == out.size()) out.resize(out.size() * 2);
+			deflater.next_out = out.data() + used;
+			deflater.avail_out = out.size() - used;
+			deflate(&deflater, Z_SYNC_FLUSH);
+			used = out.size() - deflater.avail_out;
+		} while(deflater.avail_out == 0);
+
+		// every message ends with an empty stored block, peers add it back before inflating
+		used -= 4;
+		out.resize(used);
+
+		if(resetDeflater) deflateReset(&deflater);
+
+		stats.messagesCompressed++;
+		stats.bytesBeforeCompression += length;
+		stats.bytesAfterCompression += used;
+		stats.compressNs += util::nowNs() - start;
+		return true;
+	}
+
+	// inflates the next piece of a compressed message, out receives the output in blocks of up to 16 KiB
+	void decompress(const uint8_t* data, size_t length, bool last, const function<void(const uint8_t*, size_t)>& out) {
+		static const uint8_t tail[4] = {0x00, 0x00, 0xff, 0xff};
+
+		uint64_t start = util::nowNs();
+		stats.bytesBeforeInflate += length;
+
+		inflateInput(data, length, out);
+		if(last) {
+			inflateInput(tail, 4, out);
+			if(resetInflater) inflateReset(&inflater);
+			stats.messagesInflated++;
+		}
+
+		stats.inflateNs += util::nowNs() - start;
+	}
+};
+#endif
+
+// what happens once a connection's outbound queue would grow past SendQueueOptions::maxBytes
+enum class SlowConsumerPolicy {
+	DropOldest, // drop the oldest whole messages that did not start going out yet
+	Coalesce,	// a newer broadcast on the same topic replaces queued ones first, then like DropOldest
+	Disconnect	// drop the connection
+};
+
+// outbound queue limits of event loop connections
+struct SendQueueOptions {
+	size_t highWaterMark = 1024 * 1024; // queued bytes above which onBackpressure fires
+	size_t lowWaterMark = 256 * 1024;	// onDrain fires once the queue got back below this
+	size_t maxBytes = 8 * 1024 * 1024;	// hard limit, the policy decides which messages give way. control frames and
+										// fragments can't, the connection is dropped if they don't fit
+	SlowConsumerPolicy policy = SlowConsumerPolicy::DropOldest;
+};
+
+struct SendQueueStats {
+	size_t queuedBytes = 0;
+	size_t queuedFrames = 0;
+	size_t peakBytes = 0;
+	uint64_t droppedFrames = 0;
+	uint64_t droppedBytes = 0;
+	uint64_t coalescedFrames = 0;
+	uint64_t backpressureEvents = 0;
+	uint64_t disconnects = 0;
+
+	SendQueueStats& operator+=(const SendQueueStats& other) {
+		queuedBytes += other.queuedBytes;
+		queuedFrames += other.queuedFrames;
+		peakBytes = std::max(peakBytes, other.peakBytes);
+		droppedFrames += other.droppedFrames;
+		droppedBytes += other.droppedBytes;
+		coalescedFrames += other.coalescedFrames;
+		backpressureEvents += other.backpressureEvents;
+		disconnects += other.disconnects;
+		return *this;
+	}
+};
+
+// pings go out only after idleMs without anything received, a peer that then stays silent for pongTimeoutMs is
+// considered dead and dropped
+struct KeepaliveOptions {
+	uint32_t idleMs = 15 * 1000; // 0 disables keepalive, blocking connections then wait forever for data
+	uint32_t pongTimeoutMs = 10 * 1000;
+};
+
+// round trip times come from the timestamp our pings carry, pongs echo it back
+struct KeepaliveStats {
+	uint64_t pingsSent = 0;
+	uint64_t pongsReceived = 0;
+	uint64_t lastRttUs = 0;
+	uint64_t smoothedRttUs = 0; // moving average with 1/8 gain like tcp's srtt
+	uint64_t minRttUs = 0;
+	bool timedOut = false;
+};
+
+/**
+ * how much a peer can make a connection buffer, 0 disables a limit. frames are checked on their header before anything
+ * is allocated for them, messages while they are reassembled and inflated. streamed data (onMessageChunk) is never
+ * buffered and not limited.
+ */
+struct MessageLimits {
+	uint64_t maxFrameSize = 16 * 1024 * 1024;
+	uint64_t maxMessageSize = 64 * 1024 * 1024; // after inflating
+};
+
+struct MemoryStats {
+	size_t limit = 0;
+	size_t receiveBytes = 0; // read, frame and reassembly buffers
+	size_t sendBytes = 0;	 // event loop send queues
+	size_t peakBytes = 0;
+	uint64_t oversizedFrames = 0;
+	uint64_t oversizedMessages = 0;
+	uint64_t budgetCloses = 0; // connections closed because their receive buffers would have gone past the limit
+};
+
+/**
+ * memory all connections of a server hold in receive buffers and send queues together. a receive buffer that would
+ * grow past the limit closes its connection with 1009, a send past it is handled like a full send queue and counts as
+ * backpressure. broadcast frames are shared, but every queue holding one counts it.
+ */
+class MemoryBudget {
+	std::atomic<size_t> used = 0;
+	std::atomic<size_t> receive = 0;
+	std::atomic<size_t> send = 0;
+	std::atomic<size_t> peak = 0;
+	std::atomic<uint64_t> oversizedFrames = 0;
+	std::atomic<uint64_t> oversizedMessages = 0;
+	std::atomic<uint64_t> budgetCloses = 0;
+
+  public:
+	std::atomic<size_t> limit = 0; // 0 only keeps count
+
+	// whether extra more bytes would stay within the limit, extra may be negative for what is about to be released
+	bool fits(ptrdiff_t extra) { return !limit || (ptrdiff_t)used + extra <= (ptrdiff_t)limit; }
+	bool full() { return limit && used >= limit; }
+
+	// moves a buffer's share from before to after bytes. growing past the limit fails unless forced
+	bool charge(bool sending, size_t before, size_t after, bool force = false) {
+		if(after > before) {
+			size_t grown = after - before;
+			size_t total = used.fetch_add(grown) + grown;
+			if(!force && limit && total > limit) {
+				used -= grown;
+				return false;
+			}
+			size_t highest = peak;
+			while(total > highest && !peak.compare_exchange_weak(highest, total)) {}
+		} else
+			used -= before - after;
+
+		(sending ? send : receive) += after - before;
+		return true;
+	}
+
+	void rejected(MessageTooBigException::Limit limit) {
+		if(limit == MessageTooBigException::Frame) oversizedFrames++;
+		else if(limit == MessageTooBigException::Message)
+			oversizedMessages++;
+		else
+			budgetCloses++;
+	}
+
+	MemoryStats stats() {
+		MemoryStats stats;
+		stats.limit = limit;
+		stats.receiveBytes = receive;
+		stats.sendBytes = send;
+		stats.peakBytes = peak;
+		stats.oversizedFrames = oversizedFrames;
+		stats.oversizedMessages = oversizedMessages;
+		stats.budgetCloses = budgetCloses;
+		return stats;
+	}
+};
+
+// message traffic of a connection, or of all connections of a server added up
+struct ConnectionStats {
+	uint64_t messagesIn = 0;
+	uint64_t framesIn = 0;
+	uint64_t bytesIn = 0; // payload bytes as they came off the wire, control frames included
+	uint64_t messagesOut = 0;
+	uint64_t framesOut = 0;
+	uint64_t bytesOut = 0;
+	uint64_t writes = 0; // socket writes that carried frames
+
+	double framesPerWrite() const { return writes ? (double)framesOut / writes : 0; }
+
+	ConnectionStats& operator+=(const ConnectionStats& other) {
+		messagesIn += other.messagesIn;
+		framesIn += other.framesIn;
+		bytesIn += other.bytesIn;
+		messagesOut += other.messagesOut;
+		framesOut += other.framesOut;
+		bytesOut += other.bytesOut;
+		writes += other.writes;
+		return *this;
+	}
+};
+
+/**
+ * live counters behind ConnectionStats. every connection has its own, they are only ever bumped by the threads that
+ * read from or send on that connection, so no cache line is shared with other connections.
+ */
+struct ConnectionCounters {
+	std::atomic<uint64_t> messagesIn = 0;
+	std::atomic<uint64_t> framesIn = 0;
+	std::atomic<uint64_t> bytesIn = 0;
+	std::atomic<uint64_t> messagesOut = 0;
+	std::atomic<uint64_t> framesOut = 0;
+	std::atomic<uint64_t> bytesOut = 0;
+	std::atomic<uint64_t> writes = 0;
+
+	static inline void add(std::atomic<uint64_t>& counter, uint64_t amount) {
+		counter.fetch_add(amount, std::memory_order_relaxed);
+	}
+
+	void received(bool frameStart, size_t bytes) {
+		if(frameStart) add(framesIn, 1);
+		add(bytesIn, bytes);
+	}
+
+	void sent(bool messageEnd, size_t bytes) {
+		if(messageEnd) add(messagesOut, 1);
+		add(framesOut, 1);
+		add(bytesOut, bytes);
+	}
+
+	ConnectionStats snapshot() const {
+		ConnectionStats stats;
+		stats.messagesIn = messagesIn.load(std::memory_order_relaxed);
+		stats.framesIn = framesIn.load(std::memory_order_relaxed);
+		stats.bytesIn = bytesIn.load(std::memory_order_relaxed);
+		stats.messagesOut = messagesOut.load(std::memory_order_relaxed);
+		stats.framesOut = framesOut.load(std::memory_order_relaxed);
+		stats.bytesOut = bytesOut.load(std::memory_order_relaxed);
+		stats.writes = writes.load(std::memory_order_relaxed);
+		return stats;
+	}
+};
+
+struct LatencyStats {
+	uint64_t count = 0;
+	uint64_t p50 = 0;
+	uint64_t p99 = 0;
+	uint64_t p999 = 0;
+	uint64_t max = 0;
+};
+
+/**
+ * log-linear histogram of durations in ns, every power of two is split into 8 sub buckets (~6% error at the bucket
+ * midpoint). a single thread records into it, other threads may merge or summarize it at any time - buckets are
+ * bumped with a relaxed load and store, no locked instruction.
+ */
+class LatencyHistogram {
+	static constexpr int SUB_BITS = 3;
+	static constexpr int BUCKETS = 64 << SUB_BITS;
+
+	std::atomic<uint64_t> buckets[BUCKETS] = {};
+	std::atomic<uint64_t> maxValue = 0;
+
+	static inline int bucketOf(uint64_t value) {
+		if(value < (1 << SUB_BITS)) return (int)value;
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		int exponent = (int)index;
+#else
+		int exponent = 63 - __builtin_clzll(value);
+#endif
+		int sub = (int)(value >> (exponent - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+		return (exponent - SUB_BITS + 1) * (1 << SUB_BITS) + sub;
+	}
+
+	static inline uint64_t lowerBound(int bucket) {
+		if(bucket < (1 << SUB_BITS)) return bucket;
+		int exponent = bucket / (1 << SUB_BITS) + SUB_BITS - 1;
+		return ((uint64_t)(1 << SUB_BITS) | (bucket % (1 << SUB_BITS))) << (exponent - SUB_BITS);
+	}
+
+	static inline void bump(std::atomic<uint64_t>& counter, uint64_t amount) {
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+  public:
+	inline void record(uint64_t ns) {
+		bump(buckets[bucketOf(ns)], 1);
+		if(ns > maxValue.load(std::memory_order_relaxed)) maxValue.store(ns, std::memory_order_relaxed);
+	}
+
+	// adds other to this one, this one has to be written by the calling thread only (or under a lock)
+	void merge(const LatencyHistogram& other) {
+		for(int i = 0; i < BUCKETS; i++) bump(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+		uint64_t otherMax = other.maxValue.load(std::memory_order_relaxed);
+		if(otherMax > maxValue.load(std::memory_order_relaxed)) maxValue.store(otherMax, std::memory_order_relaxed);
+	}
+
+	// percentiles over histograms, each reported as the midpoint of its bucket
+	static LatencyStats summarize(const vector<const LatencyHistogram*>& histograms) {
+		vector<uint64_t> counts(BUCKETS);
+		LatencyStats stats;
+		for(auto histogram : histograms) {
+			for(int i = 0; i < BUCKETS; i++) counts[i] += histogram->buckets[i].load(std::memory_order_relaxed);
+			stats.max = std::max(stats.max, histogram->maxValue.load(std::memory_order_relaxed));
+		}
+		for(uint64_t count : counts) stats.count += count;
+		if(stats.count == 0) return stats;
+
+		auto percentile = [&](double p) {
+			uint64_t rank = (uint64_t)(p / 100.0 * (stats.count - 1)) + 1;
+			uint64_t seen = 0;
+			for(int i = 0; i < BUCKETS - 1; i++) {
+				seen += counts[i];
+				if(seen < rank) continue;
+				return std::min(lowerBound(i) + (lowerBound(i + 1) - lowerBound(i)) / 2, stats.max);
+			}
+			return stats.max;
+		};
+		stats.p50 = percentile(50);
+		stats.p99 = percentile(99);
+		stats.p999 = percentile(99.9);
+		return stats;
+	}
+};
+
+// what GET /stats reports, see WebSocketServer::enableStats
+struct ServerStats {
+	uint64_t uptimeMs = 0;
+	size_t connections = 0; // open right now
+	uint64_t accepted = 0;	// upgraded since the start
+	ConnectionStats traffic;
+	SendQueueStats sendQueue;
+	MemoryStats memory;
+	LatencyStats handlerNs; // message handler run times
+};
+
+// corking holds small frames back for up to delayUs and writes them together, trading latency for fewer packets
+struct CorkOptions {
+	uint32_t delayUs = 0;		 // 0 disables corking
+	size_t maxBytes = 16 * 1024; // written once this much is held back, frames this large are never held back
+};
+
+/**
+ * runs the delayed writes of corked connections on a thread of its own, started with the first one. writes run
+ * without the timer's lock held, a blocking one only holds up those due after it.
+ */
+class FlushTimer {
+	struct Entry {
+		const void* owner;
+		function<void()> flush;
+	};
+
+	std::multimap<uint64_t, Entry> due; // by deadline
+	mutex lock;
+	std::condition_variable wake;
+	const void* running = 0; // owner of the flush that is running right now
+	bool stopping = false;
+	thread worker;
+
+	void loop() {
+		std::unique_lock<mutex> guard(lock);
+		while(!stopping) {
+			if(due.empty()) {
+				wake.wait(guard);
+				continue;
+			}
+
+			uint64_t now = util::nowNs();
+			auto first = due.begin();
+			if(first->first > now) {
+				wake.wait_for(guard, std::chrono::nanoseconds(first->first - now));
+				continue;
+			}
+
+			Entry entry = std::move(first->second);
+			due.erase(first);
+			running = entry.owner;
+			guard.unlock();
+			entry.flush();
+			guard.lock();
+			running = 0;
+			wake.notify_all();
+		}
+	}
+
+  public:
+	FlushTimer() {}
+	FlushTimer(const FlushTimer&) = delete;
+	FlushTimer& operator=(const FlushTimer&) = delete;
+
+	~FlushTimer() {
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		if(worker.joinable()) worker.join();
+	}
+
+	// calls flush, which must not throw, once util::nowNs() reached deadlineNs
+	void schedule(const void* owner, uint64_t deadlineNs, function<void()> flush) {
+		lock_guard<mutex> guard(lock);
+		if(!worker.joinable()) worker = thread([this]() { loop(); });
+		bool earliest = due.empty() || deadlineNs < due.begin()->first;
+		due.insert({deadlineNs, {owner, std::move(flush)}});
+		if(earliest) wake.notify_all();
+	}
+
+	// drops what owner scheduled and waits for its flush if one is running, never call it from a flush
+	void cancel(const void* owner) {
+		std::unique_lock<mutex> guard(lock);
+		for(auto it = due.begin(); it != due.end();) it = it->second.owner == owner ? due.erase(it) : std::next(it);
+		wake.wait(guard, [&]() { return running != owner; });
+	}
+};
+
+/**
+ * recycles the buffers behind Message. buffers come in power of two size classes from 64 bytes to 64 KB, released ones
+ * go on a free list of their class (up to MAX_CACHED bytes in all) and are handed out again, larger ones go straight
+ * back to the allocator. every connection that hands out Messages has its own pool, which lives on while messages
+ * from it are retained anywhere.
+ */
+class MessagePool {
+  public:
+	static constexpr size_t HEADROOM = 16; // fits the longest unmasked frame header and keeps payloads aligned
+	static constexpr int MIN_SHIFT = 6;
+	static constexpr int CLASSES = 11;
+	static constexpr size_t MAX_CACHED = 64 * 1024;
+
+	struct Block {
+		std::atomic<uint32_t> refs;
+		int sizeClass; // -1 for blocks above the classes
+		bool binary;
+		uint8_t headerSize; // of the frame header in front of the payload, 0 until the message is sealed
+		MessagePool* pool;	// null for blocks that are not recycled
+		size_t capacity;
+		size_t size;
+		Block* next; // on the free list
+
+		uint8_t* payload() { return (uint8_t*)(this + 1) + HEADROOM; }
+	};
+
+  private:
+	mutex lock;
+	Block* freeLists[CLASSES] = {};
+	size_t cached = 0;
+	bool ownerGone = false;
+	std::atomic<size_t> refs = 1; // the owner and every block out of the pool
+
+	MessagePool() {}
+
+	~MessagePool() {
+		for(Block* list : freeLists) {
+			while(list) {
+				Block* next = list->next;
+				::operator delete(list);
+				list = next;
+			}
+		}
+	}
+
+	static int classOf(size_t capacity) {
+		int sizeClass = 0;
+		while(sizeClass < CLASSES && ((size_t)1 << (sizeClass + MIN_SHIFT)) < capacity) sizeClass++;
+		return sizeClass < CLASSES ? sizeClass : -1;
+	}
+
+	void unrefPool() {
+		if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+	}
+
+  public:
+	MessagePool(const MessagePool&) = delete;
+	MessagePool& operator=(const MessagePool&) = delete;
+
+	static MessagePool* create() { return new MessagePool(); }
+
+	// the owner is done with the pool, cached buffers are freed and the pool goes with its last block
+	void release() {
+		{
+			lock_guard<mutex> guard(lock);
+			ownerGone = true;
+			for(Block*& list : freeLists) {
+				while(list) {
+					Block* next = list->next;
+					cached -= list->capacity;
+					::operator delete(list);
+					list = next;
+				}
+			}
+		}
+		unrefPool();
+	}
+
+	// a block with room for capacity payload bytes holding one reference, from pool unless that is null
+	static Block* allocate(MessagePool* pool, size_t capacity) {
+		int sizeClass = pool ? classOf(capacity) : -1;
+		Block* block = 0;
+		if(sizeClass >= 0) {
+			lock_guard<mutex> guard(pool->lock);
+			block = pool->freeLists[sizeClass];
+			if(block) {
+				pool->freeLists[sizeClass] = block->next;
+				pool->cached -= block->capacity;
+			}
+		}
+
+		if(!block) {
+			size_t rounded = sizeClass >= 0 ? (size_t)1 << (sizeClass + MIN_SHIFT) : capacity;
+			block = new(::operator new(sizeof(Block) + HEADROOM + rounded)) Block;
+			block->sizeClass = sizeClass;
+			block->capacity = rounded;
+		}
+
+		block->refs.store(1, std::memory_order_relaxed);
+		block->binary = true;
+		block->headerSize = 0;
+		block->pool = pool;
+		block->size = 0;
+		if(pool) pool->refs.fetch_add(1, std::memory_order_relaxed);
+		return block;
+	}
+
+	// drops a reference, the last one puts the block back on its free list or frees it
+	static void unref(Block* block) {
+		if(block->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+		MessagePool* pool = block->pool;
+		bool kept = false;
+		if(pool && block->sizeClass >= 0) {
+			lock_guard<mutex> guard(pool->lock);
+			if(!pool->ownerGone && pool->cached + block->capacity <= MAX_CACHED) {
+				block->next = pool->freeLists[block->sizeClass];
+				pool->freeLists[block->sizeClass] = block;
+				pool->cached += block->capacity;
+				kept = true;
+			}
+		}
+		if(!kept) ::operator delete(block);
+		if(pool) pool->unrefPool();
+	}
+};
+
+/**
+ * an immutable, reference counted message. copies share one buffer, so a message can be kept, queued or sent to any
+ * number of connections without copying its payload, from any thread. received messages come out of their connection's
+ * MessagePool, the buffer carries the frame header a server sends the message with right in front of the payload.
+ */
+class Message {
+	template <class> friend class BasicWebSocket;
+	template <class> friend class BasicWebSocketServer;
+
+	MessagePool::Block* block = 0;
+
+	// the rest is for the connection filling a message, only while nobody else holds it
+
+	// room for capacity payload bytes, keeping those already in
+	void reserve(MessagePool* pool, size_t capacity) {
+		if(block && block->capacity >= capacity) return;
+		MessagePool::Block* grown = MessagePool::allocate(pool, capacity);
+		if(block) {
+			memcpy(grown->payload(), block->payload(), block->size);
+			grown->size = block->size;
+			MessagePool::unref(block);
+		}
+		block = grown;
+	}
+
+	// appends length bytes, growing the buffer by doubling up to limit
+	void append(MessagePool* pool, const uint8_t* data, size_t length, uint64_t limit) {
+		size_t needed = size() + length;
+		if(!block || needed > block->capacity)
+			reserve(pool, std::max<uint64_t>(needed, std::min<uint64_t>(capacity() * 2, limit)));
+		if(length) memcpy(block->payload() + block->size, data, length);
+		block->size = needed;
+	}
+
+	uint8_t* writable() { return block->payload(); }
+	size_t capacity() const { return block ? block->capacity : 0; }
+
+	void clear() {
+		if(block) block->size = 0;
+	}
+
+	// makes the message final and puts the unmasked frame header for it in front of the payload
+	void seal(bool binary) {
+		if(!block) block = MessagePool::allocate(0, 0);
+		block->binary = binary;
+
+		uint8_t header[MessagePool::HEADROOM];
+		size_t headerSize = 2;
+		header[0] = 0b10000000 | (binary ? 0x02 : 0x01);
+		if(block->size > 0xffff) {
+			header[1] = 127;
+			uint64_t networkLength = htonll((uint64_t)block->size);
+			memcpy(header + 2, &networkLength, 8);
+			headerSize += 8;
+		} else if(block->size > 125) {
+			header[1] = 126;
+			uint16_t networkLength = htons((uint16_t)block->size);
+			memcpy(header + 2, &networkLength, 2);
+			headerSize += 2;
+		} else
+			header[1] = (uint8_t)block->size;
+
+		memcpy(block->payload() - headerSize, header, headerSize);
+		block->headerSize = (uint8_t)headerSize;
+	}
+
+	// header and payload as a server sends them
+	const uint8_t* frame() const { return block->payload() - block->headerSize; }
+	size_t frameSize() const { return block->headerSize + block->size; }
+
+  public:
+	Message() {}
+
+	// a copy of data, not from any pool
+	Message(const uint8_t* data, size_t length, bool binary = true) {
+		block = MessagePool::allocate(0, length);
+		if(length) memcpy(block->payload(), data, length);
+		block->size = length;
+		seal(binary);
+	}
+
+	explicit Message(const string& text) : Message((const uint8_t*)text.data(), text.size(), false) {}
+
+	Message(const Message& other) : block(other.block) {
+		if(block) block->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	Message(Message&& other) : block(other.block) { other.block = 0; }
+
+	Message& operator=(Message other) {
+		std::swap(block, other.block);
+		return *this;
+	}
+
+	~Message() {
+		if(block) MessagePool::unref(block);
+	}
+
+	const uint8_t* data() const { return block ? block->payload() : 0; }
+	size_t size() const { return block ? block->size : 0; }
+	bool empty() const { return size() == 0; }
+	bool binary() const { return block ? block->binary : true; }
+	std::string_view text() const { return std::string_view((const char*)data(), size()); }
+
+	const uint8_t* begin() const { return data(); }
+	const uint8_t* end() const { return data() + size(); }
+};
+
+class SSLSocket;
+class UnixSocket;
+
+/**
+ * what a connection needs to know about its transport beyond the socket calls: the url scheme it serves, how a url
+ * maps to the address it connects to and whether the event loop can drive it. the primary template covers plain tcp
+ * and anything else that connects to host and port.
+ */
+template <class Transport> struct WebSocketTransport {
+	static constexpr const char* scheme = "ws";
+	static constexpr bool eventLoop = true; // reads and writes go straight to the fd, see runEventLoop
+
+	// address is what Transport::connect gets as host, url keeps the host header and request target
+	static void resolve(util::URL& url, string& address) { address = url.host; }
+};
+
+template <> struct WebSocketTransport<SSLSocket> : WebSocketTransport<TCPSocket> {
+	static constexpr const char* scheme = "wss";
+	static constexpr bool eventLoop = false; // records need tls_read/tls_write, connections are served by run()
+};
+
+template <> struct WebSocketTransport<UnixSocket> : WebSocketTransport<TCPSocket> {
+	static constexpr const char* scheme = "ws+unix";
+
+	// ws+unix:///run/app.sock:/chat, the socket path ends at the first colon and the request target follows it
+	static void resolve(util::URL& url, string& address) {
+		size_t colon = url.path.find(':');
+		address = url.path.substr(0, colon);
+		url.path = colon == string::npos || colon + 1 == url.path.size() ? "/" : url.path.substr(colon + 1);
+		url.host = "localhost";
+	}
+};
+
+// the connection type for a url scheme, for errors about urls given to the wrong one
+static inline string webSocketFor(const string& scheme) {
+	if(scheme == "wss") return "SSLWebSocket from SSLSocket.h";
+	if(scheme == "ws+unix") return "UnixWebSocket from UnixSocket.h";
+	return "WebSocket";
+}
+
+/**
+ * a websocket connection over Transport, see the WebSocket, SSLWebSocket and UnixWebSocket aliases below. the
+ * transport is a member of its concrete type, so socket calls on the frame path are never virtual.
+ */
+template <class Transport> class BasicWebSocket {
+	template <class> friend class BasicWebSocketServer;
+	friend class WebSocketBench;
+	friend class WebSocketLoad;
+
+  private:
+	function<void(vector<uint8_t>&, bool)> messageHandler = 0;
+	function<void(const Message&)> sharedMessageHandler = 0;
+	function<void(const uint8_t*, size_t, bool, bool, bool)> chunkHandler = 0;
+	function<void()> closeHandler = 0;
+	function<void(size_t)> backpressureHandler = 0;
+	function<void()> drainHandler = 0;
+
+	// outbound queue of event loop connections, guarded by sendLock
+	SendQueueOptions sendQueueOptions;
+	SendQueueStats queueStats;
+	bool backpressured = false;
+
+	MessageLimits limits;
+	shared_ptr<MemoryBudget> budget; // the server's, clients have none
+#ifdef WEBSOCKET_CAPTURE
+	shared_ptr<FrameCapture> capture; // records frames in and out when set
+	uint32_t captureId = 0;
+#endif
+	ConnectionCounters counters;
+	LatencyHistogram* handlerLatency = 0; // the reading thread's while the server collects stats
+
+	// frames held back by corking, guarded by sendLock
+	CorkOptions cork;
+	shared_ptr<FlushTimer> flushTimer; // the server's, or the connection's own once a client corks
+	vector<uint8_t> corked;
+	uint64_t corkedSinceNs = 0; // when the first frame in corked was held back
+	bool corkedDroppable = true; // only whole data messages, the event loop may drop them all together
+	size_t receiveCharged = 0;		 // what the receive buffers took from budget, reading thread only
+	size_t sendCharged = 0;			 // what the send queue took from budget, guarded by sendLock
+
+	KeepaliveOptions keepalive;
+	uint64_t lastReceiveNs = 0; // only touched by the thread reading the socket
+	// guarded by sendLock
+	KeepaliveStats pingStats;
+	uint64_t pingSeq = 0;
+	uint64_t ackedSeq = 0;
+	uint64_t unansweredSinceNs = 0; // when the oldest unanswered ping went out, 0 if none is
+	bool clientMode = true;
+	std::atomic<bool> closed = false;
+	// calls on the frame path are qualified (sock.Transport::send), the type is known and they skip the vtable
+	Transport sock;
+
+	enum Opcode {
+		Continuation = 0x00, ///< %x0 denotes a continuation frame
+		Text = 0x01,		 ///< %x1 denotes a text frame
+		Binary = 0x02,		 ///< %x2 denotes a binary frame
+							 ///< %x3-7 are reserved for further non-control frames
+		Close = 0x08,		 ///< %x8 denotes a connection close
+		Ping = 0x09,		 ///< %x9 denotes a ping
+		Pong = 0x0A			 ///< %xA denotes a pong
+							 ///< %xB-F are reserved for further control frames
+	};
+
+	struct Frame {
+		bool fin;
+		uint8_t rsv; // rsv1-3, rsv1 marks compressed messages
+		Opcode opcode;
+		bool masked;
+		uint8_t maskingKey[4];
+		uint64_t payloadLength;
+		uint8_t* payload; // already unmasked, valid until the next frame is parsed
+		uint64_t offset;  // position of payload within the frame, only non zero when streaming
+		size_t available; // bytes at payload, payloadLength unless streaming
+	};
+
+	// longest possible header: flags, length byte, 64 bit length, masking key
+	static constexpr size_t MAX_HEADER_SIZE = 14;
+
+	/**
+	 * resumable frame parser, feed() takes whatever bytes are at hand and picks up where the last call stopped.
+	 * payloads that are fully inside the fed buffer are handed out in place, only frames spanning several
+	 * buffers get copied together - unless streaming is set, then data frames are handed out piece by piece
+	 * as they come in and never buffered. with a pool data frames are copied together in a pooled Message, the
+	 * rest of a large one can be received right into it (directTarget).
+	 */
+	struct FrameParser {
+		Frame frame;
+		bool streaming = false;
+		uint64_t maxFrameSize = MessageLimits().maxFrameSize; // for frames that get copied together, 0 for none
+		MessagePool* pool = 0;
+
+		// below this much missing payload receiving in bulk to the read buffer beats receiving right into the message
+		static constexpr size_t DIRECT_MIN = 16 * 1024;
+
+		uint8_t header[MAX_HEADER_SIZE];
+		size_t headerUsed = 0;
+		uint64_t payloadUsed = 0;
+		bool inPayload = false;
+		bool collecting = false; // the current frame goes to pooled instead of spill
+		vector<uint8_t> spill;
+		Message pooled;
+
+		// control frames are at most 125 bytes and always delivered whole
+		bool isControl() { return frame.opcode & 0x08; }
+
+		static size_t headerSize(const uint8_t* header) {
+			size_t size = 2;
+			if((header[1] & 0x7f) == 126) size += 2;
+			else if((header[1] & 0x7f) == 127)
+				size += 8;
+			if(header[1] >> 7) size += 4;
+			return size;
+		}
+
+		void parseHeader() {
+			frame.fin = header[0] >> 7;
+			frame.rsv = (header[0] >> 4) & 0x07;
+			frame.opcode = (Opcode)(header[0] & 0x0f);
+			frame.masked = header[1] >> 7;
+			frame.payloadLength = header[1] & 0x7f;
+
+			size_t pos = 2;
+			if(frame.payloadLength == 126) {
+				uint16_t length;
+				memcpy(&length, header + pos, 2);
+				frame.payloadLength = ntohs(length);
+				pos += 2;
+			} else if(frame.payloadLength == 127) {
+				uint64_t length;
+				memcpy(&length, header + pos, 8);
+				frame.payloadLength = ntohll(length);
+				pos += 8;
+			}
+
+			if(frame.masked) memcpy(frame.maskingKey, header + pos, 4);
+		}
+
+		/**
+		 * consumes bytes of data and returns how many were used. ready is set once a complete frame is available
+		 * in frame, data must stay untouched while that frame is in use.
+		 */
+		size_t feed(uint8_t* data, size_t length, bool& ready) {
+			size_t consumed = 0;
+			ready = false;
+
+			if(!inPayload) {
+				// flags and length byte are needed to know how long the header is
+				while(headerUsed < 2 && consumed < length) header[headerUsed++] = data[consumed++];
+				if(headerUsed < 2) return consumed;
+
+				size_t needed = headerSize(header);
+				size_t take = std::min(needed - headerUsed, length - consumed);
+				memcpy(header + headerUsed, data + consumed, take);
+				headerUsed += take;
+				consumed += take;
+				if(headerUsed < needed) return consumed;
+
+				parseHeader();
+				if(maxFrameSize && frame.payloadLength > maxFrameSize && (!streaming || isControl()))
+					throw MessageTooBigException(MessageTooBigException::Frame);
+				headerUsed = 0;
+				payloadUsed = 0;
+				inPayload = true;
+
+				// whole payload in this buffer, hand it out in place
+				if(length - consumed >= frame.payloadLength) {
+					frame.payload = data + consumed;
+					frame.offset = 0;
+					frame.available = frame.payloadLength;
+					if(frame.masked) util::mask(frame.payload, frame.payloadLength, frame.maskingKey);
+					consumed += frame.payloadLength;
+					inPayload = false;
+					ready = true;
+					return consumed;
+				}
+
+				// the spill buffer grows with what actually arrives, not with what the header claims
+				collecting = pool && !isControl() && !streaming;
+				if(collecting) {
+					if(pooled.capacity() > 1024 * 1024 && frame.payloadLength <= 1024 * 1024) pooled = Message();
+					pooled.clear();
+				} else if(!streaming || isControl()) {
+					if(spill.capacity() > 1024 * 1024 && frame.payloadLength <= 1024 * 1024) vector<uint8_t>().swap(spill);
+					spill.clear();
+				}
+			}
+
+			size_t take = std::min<uint64_t>(frame.payloadLength - payloadUsed, length - consumed);
+
+			if(streaming && !isControl()) {
+				if(take == 0) return consumed;
+
+				frame.payload = data + consumed;
+				frame.offset = payloadUsed;
+				frame.available = take;
+				if(frame.masked) util::mask(frame.payload, take, frame.maskingKey, payloadUsed);
+				payloadUsed += take;
+				consumed += take;
+
+				inPayload = payloadUsed < frame.payloadLength;
+				ready = true;
+				return consumed;
+			}
+
+			if(collecting) pooled.append(pool, data + consumed, take, frame.payloadLength);
+			else
+				spill.insert(spill.end(), data + consumed, data + consumed + take);
+			uint8_t* collected = collecting ? pooled.writable() : spill.data();
+			if(frame.masked) util::mask(collected + payloadUsed, take, frame.maskingKey, payloadUsed);
+			payloadUsed += take;
+			consumed += take;
+			complete(ready);
+
+			return consumed;
+		}
+
+		// hands out a frame that got copied together once all of it is there
+		void complete(bool& ready) {
+			if(payloadUsed < frame.payloadLength) return;
+			frame.payload = collecting ? pooled.writable() : spill.data();
+			frame.offset = 0;
+			frame.available = frame.payloadLength;
+			inPayload = false;
+			ready = true;
+		}
+
+		// whether frame is the one collected in pooled, the message can then be taken as it is
+		bool pooledFrame() { return collecting && pooled.block && frame.payload == pooled.writable(); }
+
+		/**
+		 * where the payload of a frame that is collected in a pooled message can be received to, skipping the read
+		 * buffer. null unless at least DIRECT_MIN bytes are missing, room is set to what fits. it grows like the
+		 * spill buffer, with what arrives.
+		 */
+		uint8_t* directTarget(size_t& room) {
+			if(!inPayload || !collecting || frame.payloadLength - payloadUsed < DIRECT_MIN) return 0;
+			uint64_t missing = frame.payloadLength - payloadUsed;
+			pooled.reserve(pool, payloadUsed + std::min<uint64_t>(missing, std::max<uint64_t>(payloadUsed, 64 * 1024)));
+			room = std::min<uint64_t>(missing, pooled.capacity() - payloadUsed);
+			return pooled.writable() + payloadUsed;
+		}
+
+		// takes length bytes received to directTarget
+		void receivedDirect(size_t length, bool& ready) {
+			ready = false;
+			if(frame.masked) util::mask(pooled.writable() + payloadUsed, length, frame.maskingKey, payloadUsed);
+			payloadUsed += length;
+			pooled.block->size = payloadUsed;
+			complete(ready);
+		}
+	};
+
+	FrameParser parser;
+	vector<uint8_t> readBuffer;
+	size_t readPos = 0;
+	size_t readEnd = 0;
+
+	// the fd is only released by whoever reads from it (receiveLoop or the event loop), closing it here could pull
+	// it away from under a blocked read and hand a reused fd to that thread
+	inline void terminate() {
+		if(closed.exchange(true)) return;
+#ifdef WEBSOCKET_EPOLL
+		// the event loop notices the shutdown, sends what is still queued and closes the socket itself
+		if(evented()) {
+			shutdown(sock.getFd(), SHUT_RD);
+			// waiting writers check closed under sendLock
+			{ lock_guard<mutex> lock(sendLock); }
+			drained.notify_all();
+		} else
+#endif
+			sock.interrupt();
+		if(closeHandler) closeHandler();
+	}
+
+	// closes with a status code as the reason, see RFC 6455 7.4.1
+	inline void fail(uint16_t code) {
+		uint8_t payload[2] = {(uint8_t)(code >> 8), (uint8_t)code};
+		sendFrame(Close, payload, 2);
+		terminate();
+	}
+
+	inline void fail(const MessageTooBigException& e) {
+		if(budget) budget->rejected(e.limit);
+		fail(1009);
+	}
+
+	Opcode messageOpcode = Continuation; // opcode of the message being received, Continuation if there is none
+	bool messageCompressed = false;
+	bool chunkFirst = false;
+	vector<uint8_t> assembly;
+	util::Utf8Validator utf8;
+	// messages for sharedMessageHandler come out of pool, fragmented ones are reassembled in assembledMessage
+	MessagePool* pool = 0;
+	Message assembledMessage;
+
+#ifdef WEBSOCKET_DEFLATE
+	std::unique_ptr<PerMessageDeflate> deflate;
+#endif
+
+	// rsv1 on the first frame of a message marks it compressed, anything else is a protocol error
+	bool validRsv(const Frame& frame) {
+		if(frame.rsv == 0) return true;
+#ifdef WEBSOCKET_DEFLATE
+		return deflate && frame.rsv == 0b100 && frame.opcode != Continuation && !(frame.opcode & 0x08);
+#else
+		return false;
+#endif
+	}
+
+	// appends the payload of a data frame to out, inflating it first for compressed messages. text is checked to be
+	// utf-8 before it reaches out, a character may be split across frames
+	void collect(Frame& frame, bool last, const function<void(const uint8_t*, size_t)>& out) {
+		auto validated = [&](const uint8_t* data, size_t length) {
+			if(messageOpcode == Text) {
+				bool valid = utf8.update(data, length);
+				if(valid && last && !messageCompressed) valid = utf8.finish();
+				if(!valid) throw InvalidPayloadException("text message is not valid utf-8");
+			}
+			out(data, length);
+		};
+
+#ifdef WEBSOCKET_DEFLATE
+		if(messageCompressed) {
+			deflate->decompress(frame.payload, frame.available, last, validated);
+			if(last && messageOpcode == Text && !utf8.finish())
+				throw InvalidPayloadException("text message is not valid utf-8");
+			return;
+		}
+#endif
+		validated(frame.payload, frame.available);
+	}
+
+	// runs a user handler, timed if the server collects stats
+	template <class F> inline void timed(F handler) {
+		if(!handlerLatency) return handler();
+		uint64_t start = util::nowNs();
+		handler();
+		handlerLatency->record(util::nowNs() - start);
+	}
+
+	// hands a data frame (or a piece of one when streaming) to the handlers, returns false if the connection failed
+	bool deliver(Frame& frame) {
+		bool continuation = frame.opcode == Continuation;
+		bool frameStart = frame.offset == 0;
+
+		if(frameStart) {
+			// continuations need an open message and no message may start while another one is open
+			if(continuation == (messageOpcode == Continuation)) {
+				fail(1002);
+				return false;
+			}
+			if(!continuation) {
+				messageOpcode = frame.opcode;
+				messageCompressed = frame.rsv & 0b100;
+				chunkFirst = true;
+			}
+		}
+
+		bool binary = messageOpcode == Binary;
+		bool last = frame.fin && frame.offset + frame.available == frame.payloadLength;
+
+		try {
+			if(chunkHandler) {
+				collect(frame, last, [&](const uint8_t* data, size_t length) {
+					timed([&]() { chunkHandler(data, length, binary, chunkFirst, last && !messageCompressed); });
+					chunkFirst = false;
+				});
+				// inflated output can end anywhere, so compressed messages get closed by an empty chunk
+				if(last && messageCompressed) timed([&]() { chunkHandler(0, 0, binary, chunkFirst, true); });
+			} else if(frame.fin && !continuation && !messageCompressed) {
+				if(limits.maxMessageSize && frame.available > limits.maxMessageSize)
+					throw MessageTooBigException(MessageTooBigException::Message);
+				if(!binary && !util::Utf8Validator::validate(frame.payload, frame.available))
+					throw InvalidPayloadException("text message is not valid utf-8");
+				if(sharedMessageHandler) {
+					// a frame that spanned reads already sits in a pooled message, one that came in whole is copied
+					Message message;
+					if(parser.pooledFrame()) message = std::move(parser.pooled);
+					else
+						message.append(pool, frame.payload, frame.available, frame.available);
+					message.seal(binary);
+					timed([&]() { sharedMessageHandler(message); });
+				} else if(messageHandler) {
+					// copied into the reassembly buffer, so its capacity is reused from message to message
+					assembly.assign(frame.payload, frame.payload + frame.available);
+					chargeReceive();
+					timed([&]() { messageHandler(assembly, binary); });
+				}
+			} else if(sharedMessageHandler) {
+				uint64_t maxSize = limits.maxMessageSize ? limits.maxMessageSize : UINT64_MAX;
+				if(!continuation) {
+					size_t capacity = std::min(frame.payloadLength * 2, maxSize);
+					chargeAhead(capacity, assembledMessage.capacity());
+					assembledMessage.reserve(pool, capacity);
+				}
+
+				collect(frame, last, [&](const uint8_t* data, size_t length) {
+					if(assembledMessage.size() + length > maxSize)
+						throw MessageTooBigException(MessageTooBigException::Message);
+					assembledMessage.append(pool, data, length, maxSize);
+				});
+				chargeReceive();
+
+				if(last) {
+					Message message = std::move(assembledMessage);
+					message.seal(binary);
+					chargeReceive();
+					timed([&]() { sharedMessageHandler(message); });
+				}
+			} else {
+				uint64_t maxSize = limits.maxMessageSize ? limits.maxMessageSize : UINT64_MAX;
+
+				// fragments tend to be equally sized, start with room for two and double from there
+				if(!continuation) {
+					size_t capacity = std::min(frame.payloadLength * 2, maxSize);
+					chargeAhead(capacity, assembly.capacity());
+					assembly.reserve(capacity);
+				}
+
+				collect(frame, last, [&](const uint8_t* data, size_t length) {
+					size_t needed = assembly.size() + length;
+					if(needed > maxSize) throw MessageTooBigException(MessageTooBigException::Message);
+					if(needed > assembly.capacity())
+						assembly.reserve(std::min<uint64_t>(std::max(needed, assembly.capacity() * 2), maxSize));
+					assembly.insert(assembly.end(), data, data + length);
+				});
+				chargeReceive();
+
+				if(last && messageHandler) timed([&]() { messageHandler(assembly, binary); });
+			}
+		} catch(InvalidPayloadException&) {
+			fail(1007);
+			return false;
+		} catch(MessageTooBigException& e) {
+			fail(e);
+			return false;
+		}
+
+		if(last) {
+			messageOpcode = Continuation;
+			ConnectionCounters::add(counters.messagesIn, 1);
+
+			assembledMessage = Message();
+			// keep the reassembly buffer around unless a huge message left it oversized
+			if(assembly.capacity() > 1024 * 1024) {
+				vector<uint8_t>().swap(assembly);
+				chargeReceive();
+			} else
+				assembly.clear();
+		}
+
+		return true;
+	}
+
+	// charges a receive buffer growing from capacity to wanted before it is allocated, throws if that does not fit.
+	// nothing has been received into the room yet, so the budget has to see it before the peer sends anything
+	void chargeAhead(size_t wanted, size_t capacity) {
+		if(!budget || wanted <= capacity) return;
+		if(!budget->charge(false, receiveCharged, receiveCharged + wanted - capacity))
+			throw MessageTooBigException(MessageTooBigException::Budget);
+		receiveCharged += wanted - capacity;
+	}
+
+	// brings the budget in line with what the receive buffers hold, throws if they outgrew it
+	void chargeReceive() {
+		if(!budget) return;
+		size_t held = readBuffer.capacity() + parser.spill.capacity() + assembly.capacity() + parser.pooled.capacity() +
+					  assembledMessage.capacity();
+		if(held == receiveCharged) return;
+
+		if(!budget->charge(false, receiveCharged, held)) {
+			vector<uint8_t>().swap(parser.spill);
+			vector<uint8_t>().swap(assembly);
+			parser.pooled = Message();
+			assembledMessage = Message();
+			budget->charge(false, receiveCharged, readBuffer.capacity());
+			receiveCharged = readBuffer.capacity();
+			throw MessageTooBigException(MessageTooBigException::Budget);
+		}
+		receiveCharged = held;
+	}
+
+	// parses from the read buffer and only goes to the socket once it ran dry, so one recv can yield many frames
+	inline Frame& readFrame() {
+		if(readBuffer.empty()) readBuffer.resize(16 * 1024);
+
+		while(1) {
+			if(readPos < readEnd) {
+				bool ready;
+				readPos += parser.feed(readBuffer.data() + readPos, readEnd - readPos, ready);
+				chargeReceive();
+				if(ready) return parser.frame;
+				continue;
+			}
+
+			size_t room;
+			if(uint8_t* target = parser.directTarget(room)) {
+				bool ready;
+				parser.receivedDirect(sock.Transport::receiveAvailable(target, room), ready);
+				lastReceiveNs = util::nowNs();
+				chargeReceive();
+				if(ready) return parser.frame;
+				continue;
+			}
+
+			readPos = readEnd = 0;
+			readEnd = sock.Transport::receiveAvailable(readBuffer.data(), readBuffer.size());
+			lastReceiveNs = util::nowNs();
+		}
+	}
+
+	// pong payloads are ours when they echo the sequence number and timestamp of a ping we sent
+	void pong(const uint8_t* data, size_t length) {
+		if(length != 16) return; // unsolicited pongs are allowed and ignored
+
+		uint64_t seq, sentNs;
+		memcpy(&seq, data, 8);
+		memcpy(&sentNs, data + 8, 8);
+		seq = ntohll(seq);
+		sentNs = ntohll(sentNs);
+
+		uint64_t now = util::nowNs();
+		lock_guard<mutex> lock(sendLock);
+		if(seq <= ackedSeq || seq > pingSeq || sentNs > now) return;
+
+		ackedSeq = seq;
+		if(seq == pingSeq) unansweredSinceNs = 0;
+
+		uint64_t rtt = (now - sentNs) / 1000;
+		pingStats.pongsReceived++;
+		pingStats.lastRttUs = rtt;
+		pingStats.smoothedRttUs = pingStats.smoothedRttUs ? (pingStats.smoothedRttUs * 7 + rtt) / 8 : rtt;
+		pingStats.minRttUs = pingStats.minRttUs ? std::min(pingStats.minRttUs, rtt) : rtt;
+	}
+
+	/**
+	 * runs the keepalive timer on the thread reading the socket: pings once the connection went idle and reports a
+	 * missed pong deadline. returns the milliseconds until it wants to run again, 0 if keepalive is off and -1 once
+	 * the peer is considered dead. anything received pushes the deadline back, a pong may be stuck behind a large
+	 * message.
+	 */
+	long keepaliveTimer(uint64_t now) {
+		if(!keepalive.idleMs) return 0;
+
+		uint64_t waitNs;
+		{
+			lock_guard<mutex> lock(sendLock);
+			if(unansweredSinceNs) {
+				uint64_t since = std::max(unansweredSinceNs, lastReceiveNs);
+				uint64_t deadline = since + keepalive.pongTimeoutMs * 1000000ull;
+				if(now >= deadline) {
+					pingStats.timedOut = true;
+					return -1;
+				}
+				waitNs = deadline - now;
+			} else {
+				uint64_t idle = now - std::min(now, lastReceiveNs);
+				waitNs = idle < keepalive.idleMs * 1000000ull ? keepalive.idleMs * 1000000ull - idle : 0;
+			}
+		}
+
+		if(!waitNs) {
+			ping();
+			waitNs = keepalive.pongTimeoutMs * 1000000ull;
+		}
+		return std::max<long>(1, (waitNs + 999999) / 1000000);
+	}
+
+	// writes a frame header to out, returns its size. maskingKey is 0 for unmasked frames
+	static size_t encodeHeader(uint8_t* out, bool fin, Opcode opcode, uint64_t length, const uint8_t* maskingKey,
+							   bool compressed = false) {
+		size_t size = 2;
+		out[0] = (fin ? 0b10000000 : 0) | (compressed ? 0b01000000 : 0) | opcode; // opcode is lower 4 bits
+
+		if(length > 0xffff) { // 127 if > uint16 else len is < 65535 byte
+			out[1] = 127;
+			uint64_t networkLength = htonll(length);
+			memcpy(out + size, &networkLength, 8);
+			size += 8;
+		} else if(length > 125) {
+			out[1] = 126;
+			uint16_t networkLength = htons((uint16_t)length);
+			memcpy(out + size, &networkLength, 2);
+			size += 2;
+		} else {
+			out[1] = (uint8_t)length;
+		}
+
+		if(maskingKey) {
+			out[1] |= 0b10000000; // set masking bit
+			memcpy(out + size, maskingKey, 4);
+			size += 4;
+		}
+
+		return size;
+	}
+
+	// an unmasked, uncompressed frame ready to go out on any server side connection
+	static shared_ptr<const vector<uint8_t>> encodeFrame(Opcode opcode, const uint8_t* data, size_t length) {
+		uint8_t header[MAX_HEADER_SIZE];
+		size_t headerSize = encodeHeader(header, true, opcode, length, 0);
+
+		auto frame = std::make_shared<vector<uint8_t>>(headerSize + length);
+		memcpy(frame->data(), header, headerSize);
+		if(length) memcpy(frame->data() + headerSize, data, length);
+		return frame;
+	}
+
+	// a frame or what is left of it, broadcast frames and messages share one buffer between all connections
+	struct Outgoing {
+		shared_ptr<const vector<uint8_t>> data;
+		size_t pos;
+		bool droppable; // a whole data message, it may go as long as nothing of it was sent
+		size_t key;		// coalescing key, 0 for none
+		Message message; // holds the frame instead of data for messages sent as they are
+
+		const uint8_t* bytes() const { return data ? data->data() : message.frame(); }
+		size_t size() const { return data ? data->size() : message.frameSize(); }
+	};
+
+	// sends a frame from encodeFrame, event loop connections queue the buffer itself for their loop to write.
+	// queued frames with the same non zero key may get coalesced, see SlowConsumerPolicy
+	void sendEncoded(const shared_ptr<const vector<uint8_t>>& frame, size_t key = 0) {
+		sendEncoded(Outgoing{frame, 0, true, key});
+	}
+
+	// sends a sealed message with the frame header in front of its payload, never copied unless corked
+	void sendEncoded(const Message& message, size_t key = 0) { sendEncoded(Outgoing{0, 0, true, key, message}); }
+
+	/**
+	 * never waits for messageLock, a broadcast must not stall behind one subscriber's streamed message. while a
+	 * message is going out the frame is held back and sent by whoever releases messageLock, see MessageLock. held
+	 * frames count towards SendQueueOptions::maxBytes, what does not fit is dropped.
+	 */
+	void sendEncoded(Outgoing frame) {
+		if(closed) return;
+		const uint8_t* encoded = frame.bytes();
+		size_t size = frame.size();
+		size_t headerSize = FrameParser::headerSize(encoded);
+		counters.sent((encoded[0] & 0x80) && !(encoded[0] & 0x08), size - headerSize);
+#ifdef WEBSOCKET_CAPTURE
+		if(capture)
+			capture->record(captureId, true, encoded[0] & 0x0f, encoded[0] & 0x80, encoded[0] & 0x40,
+							encoded + headerSize, size - headerSize);
+#endif
+		// messageLock is only ever released under sendLock, so a frame held back here can't be missed
+		{
+			lock_guard<mutex> lock(sendLock);
+			if(closed) return;
+			if(!messageLock.try_lock()) {
+				if(queueStats.queuedBytes + heldBytes + size > sendQueueOptions.maxBytes) {
+					queueStats.droppedFrames++;
+					queueStats.droppedBytes += size;
+					return;
+				}
+				heldBytes += size;
+				heldBack.push_back(std::move(frame));
+				return;
+			}
+		}
+		MessageLock message(*this, std::adopt_lock);
+		writeEncoded(std::move(frame));
+	}
+
+	// messageLock must be held
+	void writeEncoded(Outgoing frame) {
+		const uint8_t* encoded = frame.bytes();
+		size_t size = frame.size();
+		try {
+			// corked copies lose the coalescing key, the batch is dropped as a whole instead
+			bool control = encoded[0] & 0x08;
+			if(cork.delayUs && corkFrame(encoded, size, 0, 0, (Opcode)(encoded[0] & 0x0f), !control)) return;
+
+#ifdef WEBSOCKET_EPOLL
+			if(evented()) {
+				QueueEvent event;
+				{
+					lock_guard<mutex> lock(sendLock);
+					if(closed) return;
+					event = enqueue(std::move(frame));
+				}
+				return notify(event);
+			}
+#endif
+			lock_guard<mutex> lock(sendLock);
+			if(closed) return;
+			sock.Transport::send(encoded, size);
+			ConnectionCounters::add(counters.writes, 1);
+		} catch(...) { terminate(); }
+	}
+
+	// sendLock is held per frame, messageLock for a whole data message so control frames can go out in between
+	mutex sendLock;
+	mutex messageLock;
+	// whole frames sendEncoded got while messageLock was taken, guarded by sendLock
+	vector<Outgoing> heldBack;
+	size_t heldBytes = 0;
+
+	// messageLock for one data message, frames held back meanwhile go out right behind it once it is released
+	class MessageLock {
+		BasicWebSocket& ws;
+		std::unique_lock<mutex> lock;
+
+	  public:
+		MessageLock(BasicWebSocket& ws) : ws(ws), lock(ws.messageLock) {}
+		MessageLock(BasicWebSocket& ws, std::adopt_lock_t) : ws(ws), lock(ws.messageLock, std::adopt_lock) {}
+		~MessageLock() { unlock(); }
+
+		void unlock() {
+			if(!lock.owns_lock()) return;
+			while(1) {
+				vector<Outgoing> held;
+				{
+					lock_guard<mutex> guard(ws.sendLock);
+					if(ws.heldBack.empty()) {
+						lock.unlock();
+						return;
+					}
+					held.swap(ws.heldBack);
+					ws.heldBytes = 0;
+				}
+				for(auto& frame : held) ws.writeEncoded(std::move(frame));
+			}
+		}
+	};
+
+	// what queueing a frame did to an event loop connection's send queue, blocking connections always report QueueOk
+	enum QueueEvent { QueueOk, QueueBackpressure, QueueOverflow };
+
+	// runs callbacks for what enqueue reported, must be called without holding sendLock
+	void notify(QueueEvent event) {
+		if(event == QueueBackpressure && backpressureHandler) backpressureHandler(queueStats.queuedBytes);
+		if(event == QueueOverflow) terminate();
+	}
+
+	// writes everything corked in one go, sendLock must be held
+	QueueEvent writeCorked() {
+		if(corked.empty()) return QueueOk;
+
+		QueueEvent event = QueueOk;
+#ifdef WEBSOCKET_EPOLL
+		if(evented()) event = queue(corked.data(), corked.size(), 0, 0, corkedDroppable);
+		else
+#endif
+		{
+			sock.Transport::send(corked.data(), corked.size());
+			ConnectionCounters::add(counters.writes, 1);
+		}
+		corked.clear();
+		corkedDroppable = true;
+		return event;
+	}
+
+	/**
+	 * holds a frame back until the cork buffer is full, a control frame comes along or the delay runs out. returns
+	 * false for frames of maxBytes or more, what was held back is written and the caller sends the frame itself.
+	 */
+	bool corkFrame(const uint8_t* header, size_t headerSize, const uint8_t* data, size_t length, Opcode opcode,
+				   bool droppable) {
+		bool held = headerSize + length < cork.maxBytes;
+		uint64_t startNs = 0;
+		QueueEvent event = QueueOk;
+		{
+			lock_guard<mutex> lock(sendLock);
+			if(closed) return true;
+
+			if(held) {
+				if(corked.empty()) startNs = corkedSinceNs = util::nowNs();
+				corked.insert(corked.end(), header, header + headerSize);
+				if(length) corked.insert(corked.end(), data, data + length);
+				corkedDroppable = corkedDroppable && droppable;
+			}
+
+			// a pong is waited for and a close has to reach the peer before the connection goes, neither waits
+			if(!held || (opcode & 0x08) || corked.size() >= cork.maxBytes) {
+				event = writeCorked();
+				startNs = 0;
+			}
+		}
+		notify(event);
+
+		if(startNs) flushTimer->schedule(this, startNs + cork.delayUs * 1000ull, [this]() { flushCorked(true); });
+		return held;
+	}
+
+	// writes what corking held back, due only does so once the delay of the current batch ran out
+	void flushCorked(bool due) {
+		QueueEvent event = QueueOk;
+		try {
+			lock_guard<mutex> lock(sendLock);
+			if(closed) return;
+			// earlier batches that filled up before their delay leave timers behind, they must not cut this one short
+			if(due && util::nowNs() < corkedSinceNs + cork.delayUs * 1000ull) return;
+			event = writeCorked();
+		} catch(...) {
+			terminate();
+			return;
+		}
+		notify(event);
+	}
+
+	inline void sendFrame(Opcode opcode, vector<uint8_t>& data) { sendFrame(opcode, data.data(), data.size()); }
+
+	inline void sendFrame(Opcode opcode, const uint8_t* data, size_t length, bool fin = true, bool compressed = false) {
+		uint8_t header[MAX_HEADER_SIZE];
+		if(!closed) counters.sent(fin && !(opcode & 0x08), length);
+#ifdef WEBSOCKET_CAPTURE
+		if(capture && !closed) capture->record(captureId, true, opcode, fin, compressed, data, length);
+#endif
+		// complete uncompressed messages can be dropped without the peer noticing anything but the gap
+		bool droppable = fin && (opcode == Text || opcode == Binary) && !compressed;
+
+		try {
+			if(clientMode) {
+				uint8_t maskingKey[4];
+				util::maskingKey(maskingKey);
+
+				// masking needs a copy anyway, so header and payload share one buffer
+				size_t headerSize = encodeHeader(header, fin, opcode, length, maskingKey, compressed);
+				vector<uint8_t> frame(headerSize + length);
+				memcpy(frame.data(), header, headerSize);
+				if(length) memcpy(frame.data() + headerSize, data, length);
+				util::mask(frame.data() + headerSize, length, maskingKey);
+				if(cork.delayUs && corkFrame(frame.data(), frame.size(), 0, 0, opcode, droppable)) return;
+
+#ifdef WEBSOCKET_EPOLL
+				if(evented()) {
+					QueueEvent event;
+					{
+						lock_guard<mutex> lock(sendLock);
+						if(closed) return;
+						event = queue(frame.data(), frame.size(), 0, 0, droppable);
+					}
+					return notify(event);
+				}
+#endif
+				lock_guard<mutex> lock(sendLock);
+				if(closed) return;
+				sock.Transport::send(frame.data(), frame.size());
+				ConnectionCounters::add(counters.writes, 1);
+			} else {
+				size_t headerSize = encodeHeader(header, fin, opcode, length, 0, compressed);
+				if(cork.delayUs && corkFrame(header, headerSize, data, length, opcode, droppable)) return;
+
+#ifdef WEBSOCKET_EPOLL
+				if(evented()) {
+					QueueEvent event;
+					{
+						lock_guard<mutex> lock(sendLock);
+						if(closed) return;
+						event = queue(header, headerSize, data, length, droppable);
+					}
+					return notify(event);
+				}
+#endif
+				lock_guard<mutex> lock(sendLock);
+				if(closed) return;
+				sock.Transport::sendv(header, headerSize, data, length);
+				ConnectionCounters::add(counters.writes, 1);
+			}
+		} catch(...) { terminate(); }
+	}
+
+	// close codes a peer may send: 1004-1006 and 1015 are reserved and never go on the wire, 1016-2999 are unassigned,
+	// 3000-4999 belong to libraries and applications
+	static bool validCloseCode(uint16_t code) {
+		return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+	}
+
+	// checks and dispatches a frame, returns false once the connection is done
+	bool handleFrame(Frame& frame) {
+#ifdef WEBSOCKET_CAPTURE
+		// streamed frames are recorded once, with their payload only if it came in whole
+		if(capture && frame.offset == 0)
+			capture->record(captureId, false, frame.opcode, frame.fin, frame.rsv & 0b100,
+							frame.available == frame.payloadLength ? frame.payload : 0, frame.payloadLength);
+#endif
+		counters.received(frame.offset == 0, frame.available);
+
+		// reserved opcodes, fragmented or long control frames and masking the wrong way round, RFC 6455 5.1-5.5.
+		// clients mask everything they send, servers nothing
+		bool reserved = (frame.opcode > Binary && frame.opcode < Close) || frame.opcode > Pong;
+		bool badControl = (frame.opcode & 0x08) && (!frame.fin || frame.payloadLength > 125);
+		if(reserved || badControl || frame.masked == clientMode) {
+			fail(1002);
+			return false;
+		}
+
+		// the reply echoes the status code. a single byte is not one, RFC 6455 7.4 rules out codes the peer must not
+		// send and reasons that are no utf-8
+		if(frame.opcode == Close) {
+			bool badCode = frame.payloadLength >= 2 && !validCloseCode(frame.payload[0] << 8 | frame.payload[1]);
+			if(frame.payloadLength == 1 || badCode) {
+				fail(1002);
+				return false;
+			}
+			if(frame.payloadLength > 2 && !util::Utf8Validator::validate(frame.payload + 2, frame.payloadLength - 2)) {
+				fail(1007);
+				return false;
+			}
+			sendFrame(Close, frame.payload, std::min<uint64_t>(frame.payloadLength, 2));
+			terminate();
+			return false;
+		}
+
+		if(!validRsv(frame)) {
+			fail(1002);
+			return false;
+		}
+
+		if(frame.opcode == Ping) sendFrame(Pong, frame.payload, frame.payloadLength);
+		if(frame.opcode == Pong) pong(frame.payload, frame.payloadLength);
+
+		if(frame.opcode == Text || frame.opcode == Binary || frame.opcode == Continuation) return deliver(frame);
+		return true;
+	}
+
+	void receiveLoop() {
+		lastReceiveNs = util::nowNs();
+		long timer = keepaliveTimer(lastReceiveNs);
+
+		while(1) {
+
+			Frame* frame;
 
 			try {
-				frame = readFrame();
-			} catch(TCPSocket::TimeoutException&) {
-				if(clientMode) {
+				// receives wait until the keepalive timer is due, data arriving restarts the wait
+				sock.setReceiveTimeout(timer);
+				frame = &readFrame();
+			} catch(typename Transport::TimeoutException&) {
+				timer = keepaliveTimer(util::nowNs());
+				if(timer < 0) {
 					terminate();
-					return;
+					break;
 				}
-				ping();
 				continue;
+			} catch(MessageTooBigException& e) {
+				fail(e);
+				break;
 			} catch(...) {
 				terminate();
-				return;
+				break;
 			}
 
-			if(frame.opcode == Close) {
-				terminate();
-				return;
+			bool wasPong = frame->opcode == Pong;
+			if(!handleFrame(*frame)) break;
+			// the receive timeout was the pong deadline, go back to waiting for idleness
+			if(wasPong) timer = keepaliveTimer(lastReceiveNs);
+		}
+
+		// senders check closed under sendLock, so none of them is still using the fd
+		lock_guard<mutex> lock(sendLock);
+		sock.disconnect();
+	}
+
+#ifdef WEBSOCKET_EPOLL
+	/**
+	 * event loop mode: the socket is non blocking and owned by an epoll loop. sends never wait, whatever the socket
+	 * does not take right away is kept in outbound and written once the loop reports it writable.
+	 */
+	int epollFd = -1;
+	bool upgraded = false;
+	string upgradeRequest;
+	uint32_t watching = 0;
+	std::deque<Outgoing> outbound;
+	std::condition_variable drained; // writers of streamed messages wait here for room in outbound
+	thread::id loopThreadId;		 // of the loop serving the connection, its handlers must not wait for it
+
+	bool evented() { return epollFd >= 0; }
+
+	// adjusts the epoll interest to the queue state, sendLock must be held
+	void watch() {
+		uint32_t events = closed ? 0u : (uint32_t)(EPOLLIN | EPOLLRDHUP);
+		if(!outbound.empty()) events |= EPOLLOUT;
+		if(events == watching) return;
+
+		epoll_event event = {0};
+		event.events = events;
+		event.data.fd = sock.getFd();
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, sock.getFd(), &event);
+		watching = events;
+	}
+
+	// sendLock must be held
+	typename std::deque<Outgoing>::iterator drop(typename std::deque<Outgoing>::iterator item) {
+		queueStats.queuedBytes -= item->size();
+		queueStats.droppedFrames++;
+		queueStats.droppedBytes += item->size();
+		return outbound.erase(item);
+	}
+
+	// whether size more bytes fit the queue limit and the server's budget, sendLock must be held
+	bool fits(size_t size) {
+		if(queueStats.queuedBytes + size > sendQueueOptions.maxBytes) return false;
+		return !budget || budget->fits((ptrdiff_t)(queueStats.queuedBytes + size) - (ptrdiff_t)sendCharged);
+	}
+
+	/**
+	 * blocks a streamed message's writer while size more bytes would not fit the queue, until the loop wrote it down
+	 * to the low water mark or the connection closed. handlers on the connection's own loop never wait, a fragment
+	 * that does not fit drops the connection there.
+	 */
+	void awaitRoom(size_t size) {
+		if(!evented() || std::this_thread::get_id() == loopThreadId) return;
+		std::unique_lock<mutex> lock(sendLock);
+		if(fits(size)) return;
+		drained.wait(lock, [&]() { return closed || queueStats.queuedBytes <= sendQueueOptions.lowWaterMark; });
+	}
+
+	// settles the budget with the queue, sendLock must be held
+	void chargeSend() {
+		if(!budget || sendCharged == queueStats.queuedBytes) return;
+		budget->charge(true, sendCharged, queueStats.queuedBytes, true);
+		sendCharged = queueStats.queuedBytes;
+	}
+
+	// applies the slow consumer policy before size more bytes get queued, false if they still do not fit.
+	// sendLock must be held
+	bool makeRoom(size_t size, size_t key) {
+		auto fits = [&]() { return this->fits(size); };
+		if(sendQueueOptions.policy == SlowConsumerPolicy::Disconnect) return fits();
+
+		if(sendQueueOptions.policy == SlowConsumerPolicy::Coalesce && key) {
+			for(auto it = outbound.begin(); it != outbound.end();) {
+				if(it->key == key && it->droppable && it->pos == 0) {
+					queueStats.queuedBytes -= it->size();
+					queueStats.coalescedFrames++;
+					it = outbound.erase(it);
+				} else
+					it++;
 			}
+		}
 
-			if(frame.masked) {
-				if(clientMode) {
-					terminate();
-					return;
+		for(auto it = outbound.begin(); it != outbound.end() && !fits();) {
+			if(it->droppable && it->pos == 0)
+				it = drop(it);
+			else
+				it++;
+		}
+		return fits();
+	}
+
+	// drops the queue along with the connection, sendLock must be held
+	QueueEvent overflow() {
+		for(auto& queued : outbound) queueStats.droppedBytes += queued.size();
+		queueStats.droppedFrames += outbound.size();
+		queueStats.queuedBytes = 0;
+		queueStats.disconnects++;
+		outbound.clear();
+		chargeSend();
+		return QueueOverflow;
+	}
+
+	// sendLock must be held
+	QueueEvent enqueue(Outgoing item) {
+		if(closed) return QueueOk;
+
+		size_t size = item.size() - item.pos;
+		if(!fits(size) && !makeRoom(size, item.key)) {
+			if(sendQueueOptions.policy == SlowConsumerPolicy::Disconnect) return overflow();
+
+			// whole messages can just be skipped
+			if(item.droppable) {
+				queueStats.droppedFrames++;
+				queueStats.droppedBytes += item.size();
+				chargeSend();
+				return pressure();
+			}
+
+			// control frames and fragments can't be, the connection goes instead of the limit. an empty queue still
+			// takes the rest of a frame that only partly went out, the caller holds all of it in memory anyway
+			if(!outbound.empty()) return overflow();
+		}
+
+		outbound.push_back(item);
+		queueStats.queuedBytes += size;
+		queueStats.peakBytes = std::max(queueStats.peakBytes, queueStats.queuedBytes);
+		chargeSend();
+		watch();
+
+		return pressure();
+	}
+
+	// the queue is above the high water mark or the server ran out of memory budget, sendLock must be held
+	QueueEvent pressure() {
+		bool over = queueStats.queuedBytes > sendQueueOptions.highWaterMark || (budget && budget->full());
+		if(backpressured || !over) return QueueOk;
+		backpressured = true;
+		queueStats.backpressureEvents++;
+		return QueueBackpressure;
+	}
+
+	// sendLock must be held. writes right away if nothing is waiting, only the rest gets copied into the queue
+	QueueEvent queue(const uint8_t* header, size_t headerLength, const uint8_t* data, size_t length, bool droppable = false) {
+		if(closed) return QueueOk;
+
+		size_t sent = outbound.empty() ? sock.trySendv(header, headerLength, data, length) : 0;
+		if(sent) ConnectionCounters::add(counters.writes, 1);
+		if(sent == headerLength + length) return QueueOk;
+
+		auto rest = std::make_shared<vector<uint8_t>>();
+		rest->reserve(headerLength + length - sent);
+		if(sent < headerLength) rest->insert(rest->end(), header + sent, header + headerLength);
+		size_t payloadSent = sent > headerLength ? sent - headerLength : 0;
+		rest->insert(rest->end(), data + payloadSent, data + length);
+
+		return enqueue({rest, 0, droppable && sent == 0, 0});
+	}
+
+	// writes queued frames with gathered writes until the socket is full, returns true once nothing is left
+	bool writeQueued() {
+		bool empty = false;
+		bool room = false;
+		bool resumed = false;
+		{
+			lock_guard<mutex> lock(sendLock);
+			while(!outbound.empty()) {
+				iovec parts[64];
+				size_t count = std::min<size_t>(outbound.size(), 64);
+				for(size_t i = 0; i < count; i++) {
+					parts[i].iov_base = (void*)(outbound[i].bytes() + outbound[i].pos);
+					parts[i].iov_len = outbound[i].size() - outbound[i].pos;
 				}
-				// decode XOR
-				for(size_t i = 0; i < frame.payloadLength; i++) frame.payload[i] ^= frame.maskingKey[i % 4];
+
+				size_t sent = sock.trySendv(parts, count);
+				if(sent == 0) break;
+				ConnectionCounters::add(counters.writes, 1);
+				queueStats.queuedBytes -= sent;
+
+				while(sent) {
+					Outgoing& front = outbound.front();
+					size_t left = front.size() - front.pos;
+					if(sent < left) {
+						front.pos += sent;
+						break;
+					}
+					sent -= left;
+					outbound.pop_front();
+				}
+			}
+			chargeSend();
+			watch();
+
+			empty = outbound.empty();
+			room = queueStats.queuedBytes <= sendQueueOptions.lowWaterMark;
+			if(backpressured && room) {
+				backpressured = false;
+				resumed = !closed;
 			}
+		}
 
-			if(frame.opcode == Ping) { sendFrame(Pong, frame.payload); }
+		if(room) drained.notify_all();
+		if(resumed && drainHandler) drainHandler();
+		return empty;
+	}
 
-			// also close if ping data does not match pong response
-			if(frame.opcode == Pong && pingData != frame.payload) {
-				terminate();
-				return;
+	// handles everything read from the socket, returns false once the connection is done
+	bool process(uint8_t* data, size_t length) {
+		for(size_t pos = 0; pos < length;) {
+			bool ready;
+			try {
+				pos += parser.feed(data + pos, length - pos, ready);
+				chargeReceive();
+			} catch(MessageTooBigException& e) {
+				fail(e);
+				return false;
 			}
+			if(ready && !handleFrame(parser.frame)) return false;
+		}
+		return true;
+	}
 
-			if(frame.opcode == Text || frame.opcode == Binary) {
-				if(messageHandler) messageHandler(frame.payload, frame.opcode == Binary);
-				if(!clientMode) ping(); // send ping after every received frame for good measure
-			}
+	// handles length bytes received to parser.directTarget, returns false once the connection is done
+	bool processDirect(size_t length) {
+		bool ready;
+		try {
+			parser.receivedDirect(length, ready);
+			chargeReceive();
+		} catch(MessageTooBigException& e) {
+			fail(e);
+			return false;
 		}
+		return !ready || handleFrame(parser.frame);
 	}
+#endif
 
-	WebSocket() {}
+	BasicWebSocket() {}
 
-  public:
-	WebSocket(string url, function<void(WebSocket&)> onOpen = 0, bool backgroundThread = false) {
+	// connects and runs the client side of the upgrade, the url scheme has to be the one of Transport
+	void open(const string& url, const DeflateOptions& deflateOptions) {
+#ifndef WEBSOCKET_DEFLATE
+		if(deflateOptions.enabled) throw runtime_error("permessage-deflate needs zlib and WEBSOCKET_DEFLATE defined");
+#endif
 		util::URL uri = url;
-		sock.connect(uri.host, uri.port);
+		if(uri.protocol != WebSocketTransport<Transport>::scheme)
+			throw runtime_error(uri.protocol + ":// urls need " + webSocketFor(uri.protocol));
+
+		string address;
+		WebSocketTransport<Transport>::resolve(uri, address);
+		if(!sock.connect(address, uri.port)) throw runtime_error("failed to connect to " + address);
+
 		string request = "GET ";
 		request += uri.path;
 		request += uri.queryString;
@@ -506,62 +3481,75 @@ class WebSocket {
 			request += std::to_string(uri.port);
 		}
 
-		vector<uint8_t> secKey(16);
-		for(int i = 0; i < 4; i++) (*(uint32_t*)&secKey[i * 4]) = rand();
-		string b64Key = util::b64_encode(secKey);
+		uint8_t secKey[16];
+		char b64Key[24];
+		util::SecureRandom::local().bytes(secKey, sizeof(secKey));
+		util::b64_encode(secKey, sizeof(secKey), b64Key);
 
 		request += "\r\n";
 		request += "Connection: Upgrade\r\n";
 		request += "Upgrade: websocket\r\n";
 		request += "Sec-WebSocket-Version: 13\r\n";
 		request += "Sec-WebSocket-Key: ";
-		request += b64Key;
-		request += "\r\n\r\n";
-
-		vector<uint8_t> outgoingRequest(request.begin(), request.end());
-		sock.send(outgoingRequest);
-
-		auto binResponse = sock.receiveUntil({'\r', '\n', '\r', '\n'});
-		string response(binResponse.begin(), binResponse.end());
-
-		string firstline = response.substr(0, response.find("\r\n"));
-
-		int status;
-		int httpMajor;
-		int httpMinor;
-		sscanf(firstline.c_str(), "HTTP/%d.%d %d", &httpMajor, &httpMinor, &status);
-
-		if(status != 101) throw runtime_error("http response code was != 101");
-
-		string headersRaw = response.substr(response.find("\r\n") + 2);
-		headersRaw = headersRaw.substr(0, headersRaw.find("\r\n\r\n") + 2);
-		unordered_map<string, string> headers;
-
-		size_t pos;
-		while((pos = headersRaw.find("\r\n")) != string::npos) {
-			auto header = headersRaw.substr(0, pos);
-
-			size_t delim = header.find(": ");
-			auto headerName = header.substr(0, delim);
-			std::transform(headerName.begin(), headerName.end(), headerName.begin(), tolower);
-			headers[headerName] = header.substr(delim + 2);
+		request.append(b64Key, sizeof(b64Key));
+		request += "\r\n";
 
-			headersRaw = headersRaw.substr(pos + 2);
+		if(deflateOptions.enabled) {
+			request += "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits";
+			if(deflateOptions.maxWindowBits < 15) request += "=" + std::to_string(deflateOptions.maxWindowBits);
+			if(deflateOptions.peerNoContextTakeover) request += "; server_no_context_takeover";
+			request += "\r\n";
 		}
 
-		if(headers.count("upgrade") == 0 || headers["upgrade"] != "websocket") throw runtime_error("invalid upgrade header");
+		request += "\r\n";
 
-		if(headers.count("connection") == 0 || headers["connection"] != "Upgrade")
-			throw runtime_error("invalid connection header");
+		vector<uint8_t> outgoingRequest(request.begin(), request.end());
+		sock.send(outgoingRequest);
 
-		if(headers.count("sec-websocket-accept") == 0) throw runtime_error("invalid sec-websocket-accept header");
+		auto binResponse = sock.receiveUntil({'\r', '\n', '\r', '\n'}, util::HttpHead::MAX_SIZE);
+		util::HttpHead head;
+		if(head.parse(std::string_view((const char*)binResponse.data(), binResponse.size()), true) <= 0)
+			throw runtime_error("malformed http response");
+
+		if(head.status != 101) throw runtime_error("http response code was != 101");
+
+		if(!util::hasToken(head.get("upgrade"), "websocket")) throw runtime_error("invalid upgrade header");
+		if(!util::hasToken(head.get("connection"), "upgrade")) throw runtime_error("invalid connection header");
+		if(!head.has("sec-websocket-accept")) throw runtime_error("invalid sec-websocket-accept header");
+
+		uint8_t digest[20];
+		char compareKey[28];
+		util::SHA1().update(std::string_view(b64Key, sizeof(b64Key))).update(MAGIC_STRING).final(digest);
+		util::b64_encode(digest, sizeof(digest), compareKey);
+
+		if(std::string_view(compareKey, sizeof(compareKey)) != head.get("sec-websocket-accept")) throw runtime_error("sec-websocket-accept header != computed key");
+
+		if(head.has("sec-websocket-extensions")) {
+			DeflateParams params;
+			if(!deflateOptions.enabled || !params.parse(string(head.get("sec-websocket-extensions"))))
+				throw runtime_error("server accepted an extension that was not offered");
+#ifdef WEBSOCKET_DEFLATE
+			deflate = std::make_unique<PerMessageDeflate>(deflateOptions,
+														  std::min(deflateOptions.maxWindowBits, params.clientMaxWindowBits),
+														  deflateOptions.noContextTakeover || params.clientNoContextTakeover,
+														  params.serverNoContextTakeover);
+#endif
+		}
+	}
 
-		string tmp = b64Key + MAGIC_STRING;
-		vector<uint8_t> tmpBin(tmp.begin(), tmp.end());
-		tmpBin = util::SHA1().update(tmpBin).final();
-		string compareKey = util::b64_encode(tmpBin);
+  public:
+	~BasicWebSocket() {
+		if(flushTimer) flushTimer->cancel(this);
+		if(pool) pool->release();
+		if(!budget) return;
+		budget->charge(false, receiveCharged, 0);
+		budget->charge(true, sendCharged, 0);
+	}
 
-		if(compareKey != headers["sec-websocket-accept"]) throw runtime_error("sec-websocket-accept header != computed key");
+	// a wss:// url never goes out in plaintext, it needs an SSLWebSocket
+	BasicWebSocket(string url, function<void(BasicWebSocket&)> onOpen = 0, bool backgroundThread = false,
+				   DeflateOptions deflateOptions = DeflateOptions()) {
+		open(url, deflateOptions);
 
 		if(onOpen) onOpen(*this);
 		thread receiverThread([&]() { receiveLoop(); });
@@ -572,11 +3560,34 @@ class WebSocket {
 	void close() {
 		vector<uint8_t> nullData;
 		sendFrame(Close, nullData);
-		sock.disconnect();
-		if(closeHandler) closeHandler();
+		terminate();
 	}
 
+	// complete messages, fragmented ones are reassembled first. the vector is reused for the next message, so a
+	// handler keeping the payload has to copy or swap it out
 	void onMessage(function<void(vector<uint8_t>&, bool)> handler) { messageHandler = handler; }
+
+	/**
+	 * complete messages as shared buffers, takes the place of the vector handler. a handler can keep the message or
+	 * send it on to other connections without copying it. payloads are received into buffers from a pool of this
+	 * connection, the rest of a large frame right from the socket. set it before messages arrive.
+	 */
+	void onMessage(function<void(const Message&)> handler) {
+		sharedMessageHandler = handler;
+		if(handler && !pool) pool = MessagePool::create();
+		parser.pool = handler ? pool : 0;
+	}
+
+	/**
+	 * streams messages as they arrive instead of buffering them, replaces onMessage.
+	 * handler(data, length, binary, first, last) - first/last mark the start and end of a message, data is only
+	 * valid during the call. memory stays bounded by the read buffer no matter how large a message is.
+	 */
+	void onMessageChunk(function<void(const uint8_t*, size_t, bool, bool, bool)> handler) {
+		chunkHandler = handler;
+		parser.streaming = (bool)handler;
+	}
+
 	void onClose(function<void()> handler) { closeHandler = handler; }
 
 	void send(string message) {
@@ -584,16 +3595,241 @@ class WebSocket {
 		send(toSend, false);
 	}
 
-	void send(vector<uint8_t>& data, bool binary = true) { sendFrame(binary ? Binary : Text, data); }
+	void send(vector<uint8_t>& data, bool binary = true) { send(data.data(), data.size(), binary); }
+
+	void send(const uint8_t* data, size_t length, bool binary = true) {
+		MessageLock lock(*this);
+#ifdef WEBSOCKET_DEFLATE
+		vector<uint8_t> compressed;
+		if(deflate && deflate->compress(data, length, compressed))
+			return sendFrame(binary ? Binary : Text, compressed.data(), compressed.size(), true, true);
+#endif
+		sendFrame(binary ? Binary : Text, data, length);
+	}
+
+	// servers send the message's own buffer, event loop connections queue a reference to it. clients have to mask
+	// and compressed connections to deflate, both work on a copy
+	void send(const Message& message) {
+		bool shared = !clientMode && message.block;
+#ifdef WEBSOCKET_DEFLATE
+		if(deflate) shared = false;
+#endif
+		if(shared) sendEncoded(message);
+		else
+			send(message.data(), message.size(), message.binary());
+	}
+
+	// compression counters, all zero unless permessage-deflate got negotiated
+	DeflateStats deflateStats() {
+#ifdef WEBSOCKET_DEFLATE
+		if(deflate) return deflate->stats;
+#endif
+		return DeflateStats();
+	}
+
+	/**
+	 * connections of an event loop server never block on send, frames the socket does not take are queued.
+	 * onBackpressure(queuedBytes) fires when the queue grows past the high water mark, onDrain once it fell back to
+	 * the low water mark. blocking connections write directly and never call either.
+	 */
+	void onBackpressure(function<void(size_t)> handler) { backpressureHandler = handler; }
+	void onDrain(function<void()> handler) { drainHandler = handler; }
+
+	void setSendQueue(SendQueueOptions options) {
+		if(options.lowWaterMark > options.highWaterMark) throw runtime_error("low water mark above high water mark");
+		lock_guard<mutex> lock(sendLock);
+		sendQueueOptions = options;
+	}
+
+	// true while the queue is above the high water mark (or the server's memory budget is used up) and has not
+	// drained since
+	bool isBackpressured() {
+		lock_guard<mutex> lock(sendLock);
+		return backpressured;
+	}
+
+	// limits for what arrives from now on, best set from the connection/open handler
+	void setMessageLimits(MessageLimits options) {
+		limits = options;
+		parser.maxFrameSize = options.maxFrameSize;
+	}
+
+#ifdef WEBSOCKET_CAPTURE
+	// records every frame sent and received from now on into recorder, null stops recording. set it from the
+	// open/connection handler, before any traffic
+	void setCapture(shared_ptr<FrameCapture> recorder) {
+		captureId = recorder ? recorder->connection() : 0;
+		capture = recorder;
+	}
+#endif
+
+	// messages, frames and payload bytes in both directions so far
+	ConnectionStats stats() { return counters.snapshot(); }
+
+	SendQueueStats sendQueueStats() {
+		lock_guard<mutex> lock(sendLock);
+		SendQueueStats stats = queueStats;
+#ifdef WEBSOCKET_EPOLL
+		stats.queuedFrames = outbound.size();
+#endif
+		return stats;
+	}
+
+	/**
+	 * sends one message as a series of frames of at most fragmentSize bytes, so it never has to be in memory as a
+	 * whole. other data messages wait until finish(), pings/pongs/close still go out between fragments.
+	 * streamed messages are never compressed. on event loop connections the writer waits while the send queue is
+	 * full, unless it runs on the connection's own loop.
+	 */
+	class MessageWriter {
+		BasicWebSocket& ws;
+		MessageLock lock;
+		Opcode opcode;
+		size_t fragmentSize;
+		vector<uint8_t> pending;
+		bool finished = false;
+
+		void emit(const uint8_t* data, size_t length, bool fin) {
+#ifdef WEBSOCKET_EPOLL
+			ws.awaitRoom(MAX_HEADER_SIZE + length);
+#endif
+			ws.sendFrame(opcode, data, length, fin);
+			opcode = Continuation;
+		}
+
+		// sends to a closed connection go nowhere, the rest of the message need not be produced
+		void ensureOpen() {
+			if(ws.closed) throw typename Transport::CloseException("connection closed during a streamed message");
+		}
+
+	  public:
+		MessageWriter(BasicWebSocket& ws, bool binary, size_t fragmentSize)
+			: ws(ws), lock(ws), opcode(binary ? Binary : Text), fragmentSize(std::max<size_t>(fragmentSize, 1)) {
+			pending.reserve(this->fragmentSize);
+		}
+
+		~MessageWriter() { finish(); }
+
+		// data is copied only while it does not fill a whole fragment, everything else is sent straight from data.
+		// throws CloseException once the connection is closed, nothing would reach the peer anymore
+		MessageWriter& write(const uint8_t* data, size_t length) {
+			ensureOpen();
+			if(!pending.empty()) {
+				size_t take = std::min(fragmentSize - pending.size(), length);
+				pending.insert(pending.end(), data, data + take);
+				data += take;
+				length -= take;
+
+				if(pending.size() < fragmentSize) return *this;
+				emit(pending.data(), pending.size(), false);
+				pending.clear();
+			}
+
+			// hold the last full fragment back, it might have to carry fin
+			while(length > fragmentSize) {
+				ensureOpen();
+				emit(data, fragmentSize, false);
+				data += fragmentSize;
+				length -= fragmentSize;
+			}
+
+			pending.insert(pending.end(), data, data + length);
+			return *this;
+		}
+
+		MessageWriter& write(vector<uint8_t>& data) { return write(data.data(), data.size()); }
+
+		// streams everything up to eof, memory use stays at one fragment
+		MessageWriter& writeFile(int fd) {
+			vector<uint8_t> buffer(fragmentSize);
+			while(1) {
+#ifndef _WIN32
+				long readBytes = ::read(fd, buffer.data(), buffer.size());
+#else
+				long readBytes = _read(fd, buffer.data(), (unsigned int)buffer.size());
+#endif
+				if(readBytes < 0 && errno == EINTR) continue;
+				if(readBytes < 0) throw runtime_error("failed to read file for sending");
+				if(readBytes == 0) return *this;
+				write(buffer.data(), readBytes);
+			}
+		}
+
+		// sends the final frame, also done by the destructor
+		void finish() {
+			if(finished) return;
+			finished = true;
+			emit(pending.data(), pending.size(), true);
+			vector<uint8_t>().swap(pending);
+			lock.unlock();
+		}
+	};
+
+	MessageWriter beginMessage(bool binary = true, size_t fragmentSize = 64 * 1024) {
+		return MessageWriter(*this, binary, fragmentSize);
+	}
 
+	// sends a ping carrying a sequence number and timestamp, its pong updates keepaliveStats()
 	void ping() {
-		// debugging stuff
-		// printf("%s\n", "sending ping");
-		sendFrame(Ping, pingData);
+		uint8_t payload[16];
+		{
+			lock_guard<mutex> lock(sendLock);
+			if(closed) return;
+
+			uint64_t now = util::nowNs();
+			if(!unansweredSinceNs) unansweredSinceNs = now;
+			pingStats.pingsSent++;
+
+			uint64_t seq = htonll(++pingSeq);
+			uint64_t sentNs = htonll(now);
+			memcpy(payload, &seq, 8);
+			memcpy(payload + 8, &sentNs, 8);
+		}
+		sendFrame(Ping, payload, sizeof(payload));
+	}
+
+	// takes effect on the next timer run, best set from the connection/open handler
+	void setKeepalive(KeepaliveOptions options) { keepalive = options; }
+
+	KeepaliveStats keepaliveStats() {
+		lock_guard<mutex> lock(sendLock);
+		return pingStats;
+	}
+
+	// how long blocking sends may wait for the socket before the connection is dropped, 0 waits forever
+	void setSendTimeout(uint32_t ms) { sock.setSendTimeout(ms); }
+
+	/**
+	 * holds small frames back for up to delayUs, or until maxBytes piled up, and writes them in one go. control frames
+	 * write what is held back right away. stats().framesPerWrite() shows what it gains. a delay of 0 turns it off and
+	 * writes what is held back. best set from the connection/open handler, before sending starts.
+	 */
+	void setCork(CorkOptions options) {
+		{
+			lock_guard<mutex> lock(sendLock);
+			cork = options;
+			if(cork.delayUs && !flushTimer) flushTimer = std::make_shared<FlushTimer>();
+		}
+		if(!options.delayUs) flush();
 	}
+
+	// writes frames held back by corking now instead of waiting for the delay
+	void flush() { flushCorked(false); }
 };
 
-class WebSocketServer {
+using WebSocket = BasicWebSocket<TCPSocket>;
+using SSLWebSocket = BasicWebSocket<SSLSocket>;
+using UnixWebSocket = BasicWebSocket<UnixSocket>;
+
+/**
+ * accepts connections over Transport. tls needs an acceptor that does the handshake, see setAcceptor, and is
+ * served by run() only.
+ */
+template <class Transport> class BasicWebSocketServer {
+	typedef BasicWebSocket<Transport> WebSocket;
+
+	friend class WebSocketBench;
+	friend class WebSocketLoad;
 
 #ifdef _WIN32
 	inline static bool wsaReady = false;
@@ -607,45 +3843,207 @@ class WebSocketServer {
 	}
 #endif
 
-	list<const WebSocket*> clients;
+	typedef vector<shared_ptr<WebSocket>> Subscribers;
+
+	struct Client {
+		shared_ptr<WebSocket> socket;
+		vector<string> topics;
+		uint64_t id; // in order of acceptance
+	};
+
+	// members change under clientsLock, broadcasts take a snapshot that is rebuilt after changes and then send
+	// without holding the lock
+	struct Topic {
+		Subscribers members;
+		shared_ptr<const Subscribers> snapshot;
+	};
+
+	mutex clientsLock;
+	unordered_map<WebSocket*, Client> clients;
+	SendQueueStats closedQueueStats;
+	ConnectionStats closedTraffic;
+	uint64_t accepted = 0;
+	unordered_map<string, Topic> topics;
+
+	// the current snapshot of topic's subscribers, null if it has none
+	shared_ptr<const Subscribers> subscribersOf(const string& topic) {
+		lock_guard<mutex> lock(clientsLock);
+		auto it = topics.find(topic);
+		if(it == topics.end()) return 0;
+		if(!it->second.snapshot) it->second.snapshot = std::make_shared<const Subscribers>(it->second.members);
+		return it->second.snapshot;
+	}
+
+	void addClient(const shared_ptr<WebSocket>& client) {
+		lock_guard<mutex> lock(clientsLock);
+		clients[client.get()] = {client, {}, ++accepted};
+	}
+
+	// clientsLock must be held
+	void leave(WebSocket* client, const string& name) {
+		auto topic = topics.find(name);
+		if(topic == topics.end()) return;
+
+		auto& members = topic->second.members;
+		members.erase(std::remove_if(members.begin(), members.end(), [&](auto& member) { return member.get() == client; }),
+					  members.end());
+		topic->second.snapshot.reset();
+		if(members.empty()) topics.erase(topic);
+	}
+
+	void removeClient(WebSocket* client) {
+		lock_guard<mutex> lock(clientsLock);
+		auto it = clients.find(client);
+		if(it == clients.end()) return;
+		for(auto& topic : it->second.topics) leave(client, topic);
+
+		// keep the counters of closed connections, nothing of their queues is left to report
+		SendQueueStats stats = client->sendQueueStats();
+		stats.queuedBytes = stats.queuedFrames = 0;
+		closedQueueStats += stats;
+		closedTraffic += client->stats();
+		clients.erase(it);
+	}
 
 	sockaddr_in server;
 	uint32_t socketPtr = 0;
 
-	bool running = false;
+	std::atomic<bool> running = false;
 
 	function<void(WebSocket&)> connectionHandler;
+	DeflateOptions deflateOptions;
+	SendQueueOptions sendQueueOptions;
+	KeepaliveOptions keepaliveOptions;
+	MessageLimits messageLimits;
+	shared_ptr<MemoryBudget> memoryBudget = std::make_shared<MemoryBudget>();
+	CorkOptions corkOptions;
+	shared_ptr<FlushTimer> flushTimer; // one thread runs the delayed writes of all corked connections
+#ifdef WEBSOCKET_CAPTURE
+	shared_ptr<FrameCapture> capture;
+#endif
 
-	void tryUpgrade(uint32_t fd) {
+	// GET statsPath answers with statsJson(), connections time their handlers into the histogram of the thread
+	// reading them. every thread has its own, the ones of finished threads are merged into retiredHandlerTimes
+	string statsPath;
+	uint64_t startNs = util::nowNs();
+	mutex statsLock;
+	vector<const LatencyHistogram*> handlerTimes;
+	LatencyHistogram retiredHandlerTimes;
+
+	void addHandlerTimes(const LatencyHistogram* histogram) {
+		lock_guard<mutex> lock(statsLock);
+		handlerTimes.push_back(histogram);
+	}
 
-		TCPSocket sock(fd);
+	void retireHandlerTimes(const LatencyHistogram* histogram) {
+		lock_guard<mutex> lock(statsLock);
+		handlerTimes.erase(std::find(handlerTimes.begin(), handlerTimes.end(), histogram));
+		retiredHandlerTimes.merge(*histogram);
+	}
 
-		unordered_map<string, string> headers;
+	// true and the http response in response if request asks for the stats endpoint
+	bool statsRequest(const util::HttpHead& request, string& response) {
+		if(statsPath.empty() || request.method != "GET") return false;
+		size_t query = request.target.find('?');
+		if(request.target.substr(0, query) != statsPath) return false;
+
+		bool perConnection = query != std::string_view::npos &&
+							 request.target.find("connections", query) != std::string_view::npos;
+		string body = statsJson(perConnection);
+		response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nCache-Control: no-store\r\nConnection: close\r\n";
+		response += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+		response += body;
+		return true;
+	}
 
-		try {
-			auto request = sock.receiveUntil({'\r', '\n', '\r', '\n'});
-			string httpRequest(request.begin(), request.end());
+	/**
+	 * checks a parsed http upgrade request and prepares client for it. returns false if the request has to be dropped,
+	 * otherwise response holds the 101 answer.
+	 */
+	bool upgrade(const util::HttpHead& request, WebSocket& client, string& response) {
+		// only GET requests that ask for a websocket, anything else is dropped
+		if(request.method != "GET" || !util::hasToken(request.get("connection"), "upgrade") ||
+		   !util::hasToken(request.get("upgrade"), "websocket"))
+			return false;
+
+		// so is one whose key isn't a base64 encoded 16 byte nonce
+		std::string_view key = request.get("sec-websocket-key");
+		uint8_t nonce[18];
+		if(key.size() != 24 || util::b64_decode(key.data(), key.size(), nonce) != 16) return false;
+
+		uint8_t digest[20];
+		char signedKey[28];
+		util::SHA1().update(key).update(MAGIC_STRING).final(digest);
+		util::b64_encode(digest, sizeof(digest), signedKey);
+
+		response = WEBSOCKET_SWITCH_PROTOCOLS;
+		response.append(signedKey, sizeof(signedKey));
+		response += "\r\n";
+
+#ifdef WEBSOCKET_DEFLATE
+		DeflateParams offer;
+		if(deflateOptions.enabled && request.has("sec-websocket-extensions") &&
+		   offer.parse(string(request.get("sec-websocket-extensions")))) {
+			int windowBits = std::min(deflateOptions.maxWindowBits, offer.serverMaxWindowBits);
+			bool noContextTakeover = deflateOptions.noContextTakeover || offer.serverNoContextTakeover;
+
+			response += "Sec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=";
+			response += std::to_string(windowBits);
+			if(noContextTakeover) response += "; server_no_context_takeover";
+			if(deflateOptions.peerNoContextTakeover) response += "; client_no_context_takeover";
+			response += "\r\n";
+
+			client.deflate = std::make_unique<PerMessageDeflate>(deflateOptions, windowBits, noContextTakeover,
+																 deflateOptions.peerNoContextTakeover);
+		}
+#endif
 
-			auto requestMethod = httpRequest.substr(0, httpRequest.find(" "));
+		response += "\r\n";
+
+		client.clientMode = false;
+		client.keepalive = keepaliveOptions;
+		client.setMessageLimits(messageLimits);
+		client.budget = memoryBudget;
+		client.cork = corkOptions;
+		client.flushTimer = flushTimer;
+#ifdef WEBSOCKET_CAPTURE
+		if(capture) client.setCapture(capture);
+#endif
+		return true;
+	}
 
-			auto path = httpRequest.substr(httpRequest.find(requestMethod) + requestMethod.length() + 1);
-			path = path.substr(0, path.find(" HTTP"));
+	// turns an accepted fd into a connected transport, closes fd if it throws
+	function<Transport(int)> acceptor = [](int fd) -> Transport {
+		if constexpr(std::is_constructible_v<Transport, int>) return Transport(fd);
+		else {
+			closeSocket(fd);
+			throw runtime_error("this transport needs an acceptor, see setAcceptor");
+		}
+	};
 
-			auto headersRaw = httpRequest.substr(httpRequest.find("\r\n") + 2);
-			headersRaw = headersRaw.substr(0, headersRaw.find("\r\n\r\n") + 2);
+	void tryUpgrade(uint32_t fd) {
 
-			size_t pos;
-			while((pos = headersRaw.find("\r\n")) != string::npos) {
-				auto header = headersRaw.substr(0, pos);
+		Transport sock;
+		shared_ptr<WebSocket> newClient(new WebSocket());
+		string response;
 
-				size_t delim = header.find(": ");
-				auto headerName = header.substr(0, delim);
-				std::transform(headerName.begin(), headerName.end(), headerName.begin(), tolower);
-				headers[headerName] = header.substr(delim + 2);
+		try {
+			sock = acceptor(fd);
+		} catch(...) { return; }
 
-				headersRaw = headersRaw.substr(pos + 2);
+		try {
+			auto request = sock.receiveUntil({'\r', '\n', '\r', '\n'}, util::HttpHead::MAX_SIZE);
+			util::HttpHead head;
+			long parsed = head.parse(std::string_view((const char*)request.data(), request.size()));
+			if(parsed <= 0 || !upgrade(head, *newClient, response)) {
+				// plain http requests only get an answer from the stats endpoint
+				if(parsed > 0 && statsRequest(head, response)) sock.send((const uint8_t*)response.data(), response.size());
+				sock.disconnect();
+				return;
 			}
 
+			vector<uint8_t> responseBin(response.begin(), response.end());
+			sock.send(responseBin);
 		} catch(...) {
 			// either the incoming http request timed out or it got closed during transport
 			// drop this connection
@@ -653,47 +4051,229 @@ class WebSocketServer {
 			return;
 		}
 
-		if(headers.count("connection") == 0 || !(headers["connection"] == "Upgrade" || headers["connection"] == "upgrade")) {
-			// this request isn't for establishing a websocket connection
-			// drop it
-			sock.disconnect();
-			return;
+		newClient->sock = sock;
+		addClient(newClient);
+
+		if(connectionHandler) connectionHandler(*newClient);
+
+		LatencyHistogram handlerTimes;
+		if(!statsPath.empty()) {
+			newClient->handlerLatency = &handlerTimes;
+			addHandlerTimes(&handlerTimes);
 		}
 
-		if(headers.count("sec-websocket-key") == 0) {
-			// this request for establishing a websocket connection has no key to sign
-			// drop it
-			sock.disconnect();
-			return;
+		newClient->receiveLoop();
+
+		removeClient(newClient.get());
+		if(newClient->handlerLatency) {
+			newClient->handlerLatency = 0;
+			retireHandlerTimes(&handlerTimes);
+		}
+	}
+
+#ifdef WEBSOCKET_EPOLL
+	// one epoll instance with the connections it accepted, only ever touched by its own thread
+	struct EventLoop {
+		int epollFd = -1;
+		unordered_map<int, shared_ptr<WebSocket>> connections;
+		// shared by all connections of the loop, the frame parser copies whatever it has to keep
+		vector<uint8_t> readBuffer = vector<uint8_t>(64 * 1024);
+		LatencyHistogram handlerTimes;
+	};
+
+	int wakeFd = -1;
+
+	void acceptAll(EventLoop& loop) {
+		while(1) {
+			int fd = accept4(socketPtr, 0, 0, SOCK_NONBLOCK);
+			if(fd < 0) return; // drained, or another loop was faster
+
+			shared_ptr<WebSocket> client(new WebSocket());
+			client->sock = Transport(fd);
+			client->epollFd = loop.epollFd;
+			client->loopThreadId = std::this_thread::get_id();
+			client->watching = EPOLLIN | EPOLLRDHUP;
+			client->sendQueueOptions = sendQueueOptions;
+			client->lastReceiveNs = util::nowNs();
+			client->keepalive = keepaliveOptions;
+			if(!statsPath.empty()) client->handlerLatency = &loop.handlerTimes;
+
+			epoll_event event = {0};
+			event.events = client->watching;
+			event.data.fd = fd;
+			if(epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+				closeSocket(fd);
+				continue;
+			}
+			loop.connections[fd] = client;
+		}
+	}
+
+	// reads until the socket runs dry, the first bytes are the http upgrade request
+	void readable(EventLoop& loop, const shared_ptr<WebSocket>& connection) {
+		WebSocket& client = *connection;
+		uint8_t* buffer = loop.readBuffer.data();
+
+		while(!client.closed) {
+			// the rest of a large frame for a shared message handler goes right into its message
+			size_t room;
+			uint8_t* target = client.upgraded ? client.parser.directTarget(room) : 0;
+			long received = target ? client.sock.tryReceive(target, room)
+								   : client.sock.tryReceive(buffer, loop.readBuffer.size());
+			if(received == 0) return;
+			client.lastReceiveNs = util::nowNs();
+
+			if(target) {
+				if(!client.processDirect(received)) return;
+				continue;
+			}
+
+			size_t pos = 0;
+			if(!client.upgraded) {
+				client.upgradeRequest.append((const char*)buffer, received);
+				util::HttpHead head;
+				long length = head.parse(client.upgradeRequest);
+				if(length == util::HttpHead::Incomplete) continue;
+
+				// frames sent right behind the request are already in the buffer
+				pos = received - (client.upgradeRequest.size() - length);
+
+				string response;
+				if(length == util::HttpHead::Invalid || !upgrade(head, client, response)) {
+					// a closed connection still sends what it queued, the stats response here
+					if(length != util::HttpHead::Invalid && statsRequest(head, response)) {
+						lock_guard<mutex> lock(client.sendLock);
+						client.queue((const uint8_t*)response.data(), response.size(), 0, 0);
+					}
+					client.terminate();
+					return;
+				}
+				client.upgraded = true;
+				string().swap(client.upgradeRequest);
+
+				{
+					lock_guard<mutex> lock(client.sendLock);
+					client.queue((const uint8_t*)response.data(), response.size(), 0, 0);
+				}
+
+				addClient(connection);
+				if(connectionHandler) connectionHandler(client);
+			}
+
+			if(!client.process(buffer + pos, received - pos)) return;
+		}
+	}
+
+	void release(EventLoop& loop, int fd) {
+		auto it = loop.connections.find(fd);
+		removeClient(it->second.get());
+		{
+			lock_guard<mutex> lock(it->second->sendLock);
+			epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, fd, 0);
+			::close(fd);
+		}
+		loop.connections.erase(it);
+	}
+
+	/**
+	 * runs the keepalive timers of all connections of the loop. connections that missed their pong deadline are
+	 * dropped right away, their queues will not drain anyway. so are connections that did not complete the upgrade
+	 * request within the pong timeout.
+	 */
+	void keepaliveSweep(EventLoop& loop) {
+		uint64_t now = util::nowNs();
+		vector<int> dead;
+
+		for(auto& connection : loop.connections) {
+			WebSocket& client = *connection.second;
+			if(client.closed) continue;
+
+			if(!client.upgraded) {
+				if(now - client.lastReceiveNs > client.keepalive.pongTimeoutMs * 1000000ull) dead.push_back(connection.first);
+				continue;
+			}
+
+			try {
+				if(client.keepaliveTimer(now) < 0) dead.push_back(connection.first);
+			} catch(...) { dead.push_back(connection.first); }
+		}
+
+		for(int fd : dead) {
+			loop.connections[fd]->terminate();
+			release(loop, fd);
 		}
+	}
+
+	// how often the loops run keepaliveSweep, a fraction of the shortest keepalive interval
+	uint32_t sweepIntervalMs() {
+		uint32_t shortest = std::min(keepaliveOptions.idleMs ? keepaliveOptions.idleMs : UINT32_MAX,
+									 keepaliveOptions.pongTimeoutMs);
+		return std::clamp<uint32_t>(shortest / 4, 10, 1000);
+	}
 
-		string key = headers["sec-websocket-key"];
-		string toHash = key + MAGIC_STRING;
-		vector<uint8_t> asBytes(toHash.begin(), toHash.end());
-		string signedKey = util::b64_encode(util::SHA1().update(asBytes).final());
+	void loopThread(EventLoop& loop) {
+		epoll_event events[256];
+		uint32_t interval = sweepIntervalMs();
+		uint64_t nextSweep = util::nowNs() + interval * 1000000ull;
 
-		string response = WEBSOCKET_SWITCH_PROTOCOLS;
-		response += signedKey;
-		response += "\r\n\r\n";
+		while(running) {
+			uint64_t now = util::nowNs();
+			if(now >= nextSweep) {
+				keepaliveSweep(loop);
+				nextSweep = now + interval * 1000000ull;
+			}
 
-		vector<uint8_t> responseBin(response.begin(), response.end());
-		sock.send(responseBin);
+			int count = epoll_wait(loop.epollFd, events, 256, (nextSweep - std::min(nextSweep, now)) / 1000000 + 1);
 
-		WebSocket newClient;
+			for(int i = 0; i < count; i++) {
+				int fd = events[i].data.fd;
+				if(fd == wakeFd) continue;
+				if(fd == (int)socketPtr) {
+					acceptAll(loop);
+					continue;
+				}
 
-		newClient.clientMode = false;
-		newClient.sock = sock;
-		clients.push_back(&newClient);
+				auto it = loop.connections.find(fd);
+				if(it == loop.connections.end()) continue;
+				WebSocket& client = *it->second;
+
+				try {
+					if(events[i].events & EPOLLOUT) client.writeQueued();
+					if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) readable(loop, it->second);
+				} catch(...) { client.terminate(); }
+
+				// a closed connection still gets to send what it queued, a close frame most of all
+				if(client.closed) {
+					bool drained = false;
+					try {
+						drained = client.writeQueued();
+					} catch(...) { drained = true; }
+					if(drained || (events[i].events & (EPOLLHUP | EPOLLERR))) release(loop, fd);
+				}
+			}
+		}
 
-		connectionHandler(newClient);
+		for(auto& connection : loop.connections) {
+			connection.second->terminate();
+			removeClient(connection.second.get());
+			::close(connection.first);
+		}
+		loop.connections.clear();
+	}
+#endif
 
-		newClient.receiveLoop();
+	void prepare(bool launchThread) {
+#ifdef WEBSOCKET_EPOLL
+		wakeFd = eventfd(0, EFD_NONBLOCK);
+#endif
 
-		clients.remove(&newClient);
+		if(launchThread) {
+			thread([this]() { run(); }).detach();
+		}
 	}
 
   public:
-	WebSocketServer(uint16_t port, int host = INADDR_ANY, bool launchThread = false) {
+	BasicWebSocketServer(uint16_t port, int host = INADDR_ANY, bool launchThread = false) {
 #ifdef _WIN32
 		startWSA();
 #endif
@@ -714,28 +4294,342 @@ class WebSocketServer {
 
 		if(bind(socketPtr, (struct sockaddr*)&server, sizeof(server)) < 0) throw runtime_error("failed to bind socket");
 
-		if(launchThread) {
-			thread([&]() { run(); }).detach();
-		}
+		prepare(launchThread);
+	}
+
+	// listens on a socket file, for transports with a static bind(path) like UnixSocket
+	BasicWebSocketServer(const string& path, bool launchThread = false) {
+		socketPtr = Transport::bind(path);
+		prepare(launchThread);
 	}
 
+#ifdef WEBSOCKET_EPOLL
+	~BasicWebSocketServer() { ::close(wakeFd); }
+#endif
+
+	/**
+	 * how accepted sockets become connections, needed for transports that can't be made from a bare fd. for tls:
+	 *   server.setAcceptor([&](int fd) { return sslServer.accept(fd); });
+	 * it runs on the connection's own thread and has to close fd if it throws.
+	 */
+	void setAcceptor(function<Transport(int)> handler) { acceptor = handler; }
+
 	void onConnection(function<void(WebSocket&)> handler) { connectionHandler = handler; }
 
+	// offers permessage-deflate to clients that ask for it, takes effect for connections accepted afterwards
+	void enableDeflate(DeflateOptions options = DeflateOptions()) {
+#ifndef WEBSOCKET_DEFLATE
+		throw runtime_error("permessage-deflate needs zlib and WEBSOCKET_DEFLATE defined");
+#endif
+		deflateOptions = options;
+		deflateOptions.enabled = true;
+	}
+
+	// keepalive of connections accepted afterwards, they can still change their own with WebSocket::setKeepalive
+	void setKeepalive(KeepaliveOptions options) { keepaliveOptions = options; }
+
+	// default send queue limits of event loop connections, applies to connections accepted afterwards
+	void setSendQueue(SendQueueOptions options) {
+		if(options.lowWaterMark > options.highWaterMark) throw runtime_error("low water mark above high water mark");
+		sendQueueOptions = options;
+	}
+
+	// frame and message size limits of connections accepted afterwards
+	void setMessageLimits(MessageLimits options) { messageLimits = options; }
+
+	// corking of connections accepted afterwards, see WebSocket::setCork
+	void setCork(CorkOptions options) {
+		corkOptions = options;
+		if(options.delayUs && !flushTimer) flushTimer = std::make_shared<FlushTimer>();
+	}
+
+	// bytes all connections may hold in receive buffers and send queues together, 0 for no limit. see MemoryBudget
+	void setMemoryBudget(size_t bytes) { memoryBudget->limit = bytes; }
+
+	// current buffer usage of all connections and what limits and budget turned away so far
+	MemoryStats memoryStats() { return memoryBudget->stats(); }
+
+#ifdef WEBSOCKET_CAPTURE
+	// records the frames of connections accepted afterwards, each under its own connection id. null stops that
+	void captureTo(shared_ptr<FrameCapture> recorder) { capture = recorder; }
+#endif
+
+	/**
+	 * answers plain http GET requests for path on the listening port with statsJson(), path?connections adds every
+	 * open connection. connections accepted afterwards also time their message handlers. call before run().
+	 */
+	void enableStats(const string& path = "/stats") { statsPath = path; }
+
+	ServerStats stats() {
+		ServerStats stats;
+		stats.uptimeMs = (util::nowNs() - startNs) / 1000000;
+		{
+			lock_guard<mutex> lock(clientsLock);
+			stats.connections = clients.size();
+			stats.accepted = accepted;
+			stats.traffic = closedTraffic;
+			for(auto& client : clients) stats.traffic += client.second.socket->stats();
+		}
+		stats.sendQueue = sendQueueStats();
+		stats.memory = memoryStats();
+
+		lock_guard<mutex> lock(statsLock);
+		vector<const LatencyHistogram*> histograms = handlerTimes;
+		histograms.push_back(&retiredHandlerTimes);
+		stats.handlerNs = LatencyHistogram::summarize(histograms);
+		return stats;
+	}
+
+	// stats() as json, rates are averages since the start
+	string statsJson(bool perConnection = false) {
+		ServerStats stats = this->stats();
+		string out;
+		auto field = [&](const char* name, uint64_t value) {
+			if(out.back() != '{' && out.back() != '[') out += ',';
+			out += '"';
+			out += name;
+			out += "\":";
+			out += std::to_string(value);
+		};
+		auto object = [&](const char* name) {
+			if(out.back() != '{' && out.back() != '[') out += ',';
+			out += '"';
+			out += name;
+			out += "\":{";
+		};
+		auto traffic = [&](const ConnectionStats& traffic) {
+			field("messages_in", traffic.messagesIn);
+			field("frames_in", traffic.framesIn);
+			field("bytes_in", traffic.bytesIn);
+			field("messages_out", traffic.messagesOut);
+			field("frames_out", traffic.framesOut);
+			field("bytes_out", traffic.bytesOut);
+			field("writes", traffic.writes);
+			char ratio[32];
+			snprintf(ratio, sizeof(ratio), ",\"frames_per_write\":%.2f", traffic.framesPerWrite());
+			out += ratio;
+		};
+
+		out = "{";
+		field("uptime_ms", stats.uptimeMs);
+		field("connections", stats.connections);
+		field("accepted", stats.accepted);
+		traffic(stats.traffic);
+		uint64_t seconds = std::max<uint64_t>(stats.uptimeMs / 1000, 1);
+		field("messages_in_per_s", stats.traffic.messagesIn / seconds);
+		field("messages_out_per_s", stats.traffic.messagesOut / seconds);
+
+		object("send_queue");
+		field("queued_bytes", stats.sendQueue.queuedBytes);
+		field("queued_frames", stats.sendQueue.queuedFrames);
+		field("peak_bytes", stats.sendQueue.peakBytes);
+		field("dropped_frames", stats.sendQueue.droppedFrames);
+		field("dropped_bytes", stats.sendQueue.droppedBytes);
+		field("coalesced_frames", stats.sendQueue.coalescedFrames);
+		field("backpressure_events", stats.sendQueue.backpressureEvents);
+		field("disconnects", stats.sendQueue.disconnects);
+		out += '}';
+
+		object("memory");
+		field("limit", stats.memory.limit);
+		field("receive_bytes", stats.memory.receiveBytes);
+		field("send_bytes", stats.memory.sendBytes);
+		field("peak_bytes", stats.memory.peakBytes);
+		field("oversized_frames", stats.memory.oversizedFrames);
+		field("oversized_messages", stats.memory.oversizedMessages);
+		field("budget_closes", stats.memory.budgetCloses);
+		out += '}';
+
+		object("handler_ns");
+		field("count", stats.handlerNs.count);
+		field("p50", stats.handlerNs.p50);
+		field("p99", stats.handlerNs.p99);
+		field("p999", stats.handlerNs.p999);
+		field("max", stats.handlerNs.max);
+		out += '}';
+
+		if(perConnection) {
+			out += ",\"per_connection\":[";
+			lock_guard<mutex> lock(clientsLock);
+			for(auto& client : clients) {
+				if(out.back() != '[') out += ',';
+				out += '{';
+				field("id", client.second.id);
+				traffic(client.second.socket->stats());
+				SendQueueStats queue = client.second.socket->sendQueueStats();
+				field("queued_bytes", queue.queuedBytes);
+				field("queued_frames", queue.queuedFrames);
+				out += '}';
+			}
+			out += ']';
+		}
+
+		out += '}';
+		return out;
+	}
+
+	size_t clientCount() {
+		lock_guard<mutex> lock(clientsLock);
+		return clients.size();
+	}
+
+	// send queue counters of all connections so far, queued bytes/frames of the open ones. peakBytes is the largest
+	// single queue
+	SendQueueStats sendQueueStats() {
+		lock_guard<mutex> lock(clientsLock);
+		SendQueueStats total = closedQueueStats;
+		for(auto& client : clients) total += client.second.socket->sendQueueStats();
+		return total;
+	}
+
+	// adds a connection of this server to topic, its subscriptions end when it closes
+	void subscribe(WebSocket& client, const string& topic) {
+		lock_guard<mutex> lock(clientsLock);
+		auto it = clients.find(&client);
+		if(it == clients.end()) throw runtime_error("not a connection of this server");
+
+		auto& subscribed = it->second.topics;
+		if(std::find(subscribed.begin(), subscribed.end(), topic) != subscribed.end()) return;
+		subscribed.push_back(topic);
+
+		Topic& entry = topics[topic];
+		entry.members.push_back(it->second.socket);
+		entry.snapshot.reset();
+	}
+
+	void unsubscribe(WebSocket& client, const string& topic) {
+		lock_guard<mutex> lock(clientsLock);
+		auto it = clients.find(&client);
+		if(it == clients.end()) return;
+
+		auto& subscribed = it->second.topics;
+		auto position = std::find(subscribed.begin(), subscribed.end(), topic);
+		if(position == subscribed.end()) return;
+		subscribed.erase(position);
+		leave(&client, topic);
+	}
+
+	size_t subscriberCount(const string& topic) {
+		lock_guard<mutex> lock(clientsLock);
+		auto it = topics.find(topic);
+		return it == topics.end() ? 0 : it->second.members.size();
+	}
+
+	/**
+	 * sends one message to every subscriber of topic and returns how many that were. the frame is encoded once and
+	 * the same buffer goes to every connection - event loop connections queue it and never block the caller, with
+	 * run() each send waits until that client took it. messages are never compressed.
+	 */
+	size_t broadcast(const string& topic, const uint8_t* data, size_t length, bool binary = true) {
+		shared_ptr<const Subscribers> subscribers = subscribersOf(topic);
+		if(!subscribers) return 0;
+
+		auto frame = WebSocket::encodeFrame(binary ? WebSocket::Binary : WebSocket::Text, data, length);
+		// a newer message on the topic may replace queued ones of slow subscribers, see SlowConsumerPolicy::Coalesce
+		size_t key = std::hash<string>()(topic) | 1;
+		for(auto& subscriber : *subscribers) subscriber->sendEncoded(frame, key);
+		return subscribers->size();
+	}
+
+	size_t broadcast(const string& topic, vector<uint8_t>& data, bool binary = true) {
+		return broadcast(topic, data.data(), data.size(), binary);
+	}
+
+	// a message is already encoded, every subscriber gets a reference to its buffer
+	size_t broadcast(const string& topic, const Message& message) {
+		if(!message.block) return broadcast(topic, 0, 0, message.binary());
+		shared_ptr<const Subscribers> subscribers = subscribersOf(topic);
+		if(!subscribers) return 0;
+
+		size_t key = std::hash<string>()(topic) | 1;
+		for(auto& subscriber : *subscribers) subscriber->sendEncoded(message, key);
+		return subscribers->size();
+	}
+
+	size_t broadcast(const string& topic, const string& message) {
+		return broadcast(topic, (const uint8_t*)message.data(), message.size(), false);
+	}
+
+	// one thread per connection, blocks until stop()
 	void run() {
-		if(running) return;
+		if(running.exchange(true)) return;
 
-		running = true;
-		listen(socketPtr, 0);
+		listen(socketPtr, SOMAXCONN);
 
 		while(running) {
 			sockaddr_in clientAddress;
 			int len = sizeof(clientAddress);
 
-			uint32_t clientSocket = accept(socketPtr, (sockaddr*)&clientAddress, (socklen_t*)&len);
+			int clientSocket = accept(socketPtr, (sockaddr*)&clientAddress, (socklen_t*)&len);
+			if(clientSocket < 0) continue;
+
+			try {
+				thread([this, clientSocket]() { tryUpgrade(clientSocket); }).detach();
+			} catch(std::system_error&) {
+				closeSocket(clientSocket); // out of threads
+			}
+		}
+	}
+
+#ifdef WEBSOCKET_EPOLL
+	/**
+	 * serves every connection from threadCount epoll loops (one per core if 0) instead of a thread each, blocks until
+	 * stop(). the loops accept on their own and keep what they accepted, handlers run on the loop thread of their
+	 * connection and must not block - sends from handlers or other threads are queued and never wait for the peer.
+	 */
+	void runEventLoop(size_t threadCount = 0) {
+		static_assert(WebSocketTransport<Transport>::eventLoop, "this transport is served by run() only");
+		if(running.exchange(true)) return;
+		if(threadCount == 0) threadCount = std::max(1u, thread::hardware_concurrency());
+
+		listen(socketPtr, SOMAXCONN);
+		int flags = fcntl(socketPtr, F_GETFL, 0);
+		fcntl(socketPtr, F_SETFL, flags | O_NONBLOCK);
+
+		vector<EventLoop> loops(threadCount);
+		vector<thread> threads;
+		for(auto& loop : loops) {
+			loop.epollFd = epoll_create1(0);
+
+			// every loop waits for new connections, EPOLLEXCLUSIVE wakes only one of them per connection
+			epoll_event event = {0};
+			event.events = EPOLLIN | EPOLLEXCLUSIVE;
+			event.data.fd = socketPtr;
+			epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, socketPtr, &event);
+
+			event.events = EPOLLIN;
+			event.data.fd = wakeFd;
+			epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+
+			addHandlerTimes(&loop.handlerTimes);
+			threads.emplace_back([this, &loop]() { loopThread(loop); });
+		}
 
-			thread([&]() { tryUpgrade(clientSocket); }).detach();
+		for(auto& worker : threads) worker.join();
+		for(auto& loop : loops) {
+			::close(loop.epollFd);
+			retireHandlerTimes(&loop.handlerTimes);
 		}
 	}
+#endif
+
+	// makes run()/runEventLoop() return, connections of the event loop get closed
+	void stop() {
+		if(!running.exchange(false)) return;
+#ifdef WEBSOCKET_EPOLL
+		uint64_t one = 1;
+		if(write(wakeFd, &one, sizeof(one)) < 0) {}
+#endif
+#ifndef _WIN32
+		shutdown(socketPtr, SHUT_RDWR);
+#else
+		closesocket(socketPtr);
+#endif
+	}
 };
 
+using WebSocketServer = BasicWebSocketServer<TCPSocket>;
+using SSLWebSocketServer = BasicWebSocketServer<SSLSocket>;
+using UnixWebSocketServer = BasicWebSocketServer<UnixSocket>;
+
 #endif
\ No newline at end of file